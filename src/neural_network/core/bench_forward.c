@@ -0,0 +1,282 @@
+/*
+ * Microbenchmark of the forward pass on the OCR topology (1024 x 256 x 26):
+ * per-sample cost of predict_nn_ctx() and predict_nn_batch_ctx(), against the
+ * input-major weight layout Network used to store, the single precision
+ * variant, the sparse path for binarized glyphs, and against a deeper but
+ * narrower network and a small convolutional network.
+ *
+ * NOTE: Build without -fsanitize=address for meaningful timings, e.g.
+ * make bench_forward CC_FLAGS="-std=c17 -O2"
+ */
+#define _GNU_SOURCE
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "lib/core_network.h"
+#include "lib/network_f32.h"
+#include "lib/sparse.h"
+
+#define NB_INPUT 1024
+#define NB_HIDDEN 256
+#define NB_OUTPUT 26
+#define NB_SAMPLES 256
+
+/**
+ * @brief Returns the number of seconds elapsed since start
+ */
+static double elapsed_since(const struct timespec* start) {
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/**
+ * Copy of the weights in the former input-major layout (one row of outgoing
+ * weights per input)
+ */
+typedef struct InputMajorWeights {
+  double* hidden;  // nb_input rows of nb_hidden weights
+  double* output;  // nb_hidden rows of nb_output weights
+} InputMajorWeights;
+
+/**
+ * @brief Former forward pass: each neuron is a dot product striding by the
+ * size of the layer over the input-major weights
+ */
+static void forward_strided(const Network* network,
+                            const InputMajorWeights* weights,
+                            const double* input,
+                            double* hidden,
+                            double* output) {
+  const Layer* hidden_layer = &network->layers[0];
+  const Layer* output_layer = &network->layers[1];
+  for (size_t i = 0; i < hidden_layer->nb_output; i++) {
+    double total = 0;
+    for (size_t j = 0; j < hidden_layer->nb_input; j++) {
+      total += input[j] * weights->hidden[j * hidden_layer->nb_output + i];
+    }
+    hidden[i] = relu(total + hidden_layer->biases[i]);
+  }
+  for (size_t i = 0; i < output_layer->nb_output; i++) {
+    double total = 0;
+    for (size_t j = 0; j < output_layer->nb_input; j++) {
+      total += hidden[j] * weights->output[j * output_layer->nb_output + i];
+    }
+    output[i] = total + output_layer->biases[i];
+  }
+}
+
+/**
+ * @brief Former layer kernel: one axpy per input over its row of input-major
+ * weights, the layer being accumulated in memory
+ */
+static void forward_rows(const Network* network,
+                         const InputMajorWeights* weights,
+                         const double* input,
+                         double* hidden,
+                         double* output) {
+  const Layer* hidden_layer = &network->layers[0];
+  const Layer* output_layer = &network->layers[1];
+  memcpy(hidden, hidden_layer->biases,
+         hidden_layer->nb_output * sizeof(double));
+  for (size_t j = 0; j < hidden_layer->nb_input; j++) {
+    if (input[j] == 0.)
+      continue;
+    const double* row = weights->hidden + j * hidden_layer->nb_output;
+    for (size_t i = 0; i < hidden_layer->nb_output; i++) {
+      hidden[i] += input[j] * row[i];
+    }
+  }
+  for (size_t i = 0; i < hidden_layer->nb_output; i++) {
+    hidden[i] = relu(hidden[i]);
+  }
+  memcpy(output, output_layer->biases,
+         output_layer->nb_output * sizeof(double));
+  for (size_t j = 0; j < output_layer->nb_input; j++) {
+    const double* row = weights->output + j * output_layer->nb_output;
+    for (size_t i = 0; i < output_layer->nb_output; i++) {
+      output[i] += hidden[j] * row[i];
+    }
+  }
+}
+
+/**
+ * @brief Returns the index of the largest value of a list
+ */
+static size_t argmax(const double* values, size_t size) {
+  size_t res = 0;
+  for (size_t i = 1; i < size; i++) {
+    if (values[i] > values[res])
+      res = i;
+  }
+  return res;
+}
+
+int main(int argc, char** argv) {
+  if (argc > 2)
+    errx(EXIT_FAILURE, "Usage: %s [repetitions]", argv[0]);
+  long repetitions = argc == 2 ? strtol(argv[1], NULL, 10) : 20;
+  if (repetitions <= 0)
+    errx(EXIT_FAILURE, "Invalid number of repetitions");
+
+  Network* network = init_nn(NB_INPUT, NB_HIDDEN, NB_OUTPUT, RELU, SOFTMAX);
+  for (size_t i = 0; i < NB_HIDDEN; i++)
+    network->layers[0].biases[i] = ((double)rand() / RAND_MAX - .5) / 10.;
+
+  InputMajorWeights weights;
+  weights.hidden = calloc(NB_INPUT * NB_HIDDEN, sizeof(double));
+  weights.output = calloc(NB_HIDDEN * NB_OUTPUT, sizeof(double));
+  double* inputs = calloc(NB_SAMPLES * NB_INPUT, sizeof(double));
+  double* outputs = calloc(NB_SAMPLES * NB_OUTPUT, sizeof(double));
+  double* hidden = calloc(NB_HIDDEN, sizeof(double));
+  double* output = calloc(NB_OUTPUT, sizeof(double));
+  if (weights.hidden == NULL || weights.output == NULL || inputs == NULL ||
+      outputs == NULL || hidden == NULL || output == NULL)
+    errx(EXIT_FAILURE, "Error while allocating memory");
+
+  for (size_t i = 0; i < NB_HIDDEN; i++) {
+    for (size_t j = 0; j < NB_INPUT; j++)
+      weights.hidden[j * NB_HIDDEN + i] =
+          network->layers[0].weights[i * NB_INPUT + j];
+  }
+  for (size_t i = 0; i < NB_OUTPUT; i++) {
+    for (size_t j = 0; j < NB_HIDDEN; j++)
+      weights.output[j * NB_OUTPUT + i] =
+          network->layers[1].weights[i * NB_HIDDEN + j];
+  }
+  // Glyph-like samples: mostly white (1) with about 20% of ink (0)
+  for (size_t i = 0; i < NB_SAMPLES * NB_INPUT; i++)
+    inputs[i] = rand() % 5 == 0 ? 0. : 1.;
+
+  // Ink bitmasks of the samples, packed once as the image conversion would
+  uint64_t* ink =
+      calloc(NB_SAMPLES * SPARSE_NB_WORDS(NB_INPUT), sizeof(uint64_t));
+  if (ink == NULL)
+    errx(EXIT_FAILURE, "Error while allocating memory");
+  for (size_t k = 0; k < NB_SAMPLES; k++)
+    pack_ink_bits(inputs + k * NB_INPUT, NB_INPUT,
+                  ink + k * SPARSE_NB_WORDS(NB_INPUT));
+  SparseNetwork* sparse = init_sparse_nn(network);
+  // Single precision inputs, converted once as a float dataset would be
+  float* inputs_f32 = calloc(NB_SAMPLES * NB_INPUT, sizeof(float));
+  if (inputs_f32 == NULL)
+    errx(EXIT_FAILURE, "Error while allocating memory");
+  for (size_t i = 0; i < NB_SAMPLES * NB_INPUT; i++)
+    inputs_f32[i] = (float)inputs[i];
+  NetworkF32* network_f32 = nn_to_f32(network);
+  NetworkContextF32* context_f32 = init_nc_f32(network_f32);
+
+  NetworkContext* context = init_nc(network);
+  BatchContext* batch_context = init_bc(network, 0);
+  const char* names[6] = {"input-major, strided dot", "input-major, row axpy",
+                          "predict_nn_ctx", "predict_nn_batch_ctx",
+                          "predict_sparse_nn", "predict_nn_f32"};
+  size_t predictions[6][NB_SAMPLES];
+  printf("Forward pass %dx%dx%d, %d samples x %ld repetitions\n", NB_INPUT,
+         NB_HIDDEN, NB_OUTPUT, NB_SAMPLES, repetitions);
+  for (size_t m = 0; m < 6; m++) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (long r = 0; r < repetitions; r++) {
+      if (m == 3) {
+        predict_nn_batch_ctx(network, batch_context, inputs, NB_SAMPLES,
+                             outputs);
+        continue;
+      }
+      for (size_t k = 0; k < NB_SAMPLES; k++) {
+        const double* input = inputs + k * NB_INPUT;
+        if (m == 0) {
+          forward_strided(network, &weights, input, hidden, output);
+          predictions[m][k] = argmax(output, NB_OUTPUT);
+        } else if (m == 1) {
+          forward_rows(network, &weights, input, hidden, output);
+          predictions[m][k] = argmax(output, NB_OUTPUT);
+        } else if (m == 2) {
+          predict_nn_ctx(network, context, input);
+          predictions[m][k] = argmax(context->output, NB_OUTPUT);
+        } else if (m == 4) {
+          predict_sparse_nn(sparse, context,
+                            ink + k * SPARSE_NB_WORDS(NB_INPUT));
+          predictions[m][k] = argmax(context->output, NB_OUTPUT);
+        } else {
+          predict_nn_f32(network_f32, context_f32,
+                         inputs_f32 + k * NB_INPUT);
+          size_t best = 0;
+          for (size_t o = 1; o < NB_OUTPUT; o++) {
+            if (context_f32->output[o] > context_f32->output[best])
+              best = o;
+          }
+          predictions[m][k] = best;
+        }
+      }
+    }
+    if (m == 3) {
+      for (size_t k = 0; k < NB_SAMPLES; k++)
+        predictions[m][k] = argmax(outputs + k * NB_OUTPUT, NB_OUTPUT);
+    }
+    double time = elapsed_since(&start);
+
+    size_t agree = 0;
+    for (size_t k = 0; k < NB_SAMPLES; k++)
+      agree += predictions[m][k] == predictions[0][k];
+    printf("%-26s %9.2f us/sample (agreement %ld/%d)\n", names[m],
+           time * 1e6 / (repetitions * NB_SAMPLES), agree, NB_SAMPLES);
+  }
+
+  // Same input and output with two narrower hidden layers
+  const size_t deep_sizes[3] = {128, 64, NB_OUTPUT};
+  const ActivationFunction deep_activations[3] = {RELU, RELU, SOFTMAX};
+  Network* deep = init_nn_layers(NB_INPUT, 3, deep_sizes, deep_activations);
+  NetworkContext* deep_context = init_nc(deep);
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (long r = 0; r < repetitions; r++) {
+    for (size_t k = 0; k < NB_SAMPLES; k++)
+      predict_nn_ctx(deep, deep_context, inputs + k * NB_INPUT);
+  }
+  printf("%-26s %9.2f us/sample (%ld weights instead of %ld)\n",
+         "predict_nn_ctx 128x64",
+         elapsed_since(&start) * 1e6 / (repetitions * NB_SAMPLES),
+         nn_nb_weights(deep), nn_nb_weights(network));
+  free_nc(deep_context);
+  free_nn(deep);
+
+  // Two 3x3 convolutions of 8 channels, each followed by a 2x2 max pooling
+  const LayerSpec cnn_specs[5] = {{LAYER_CONV2D, 8, 3, RELU},
+                                  {LAYER_MAXPOOL, 1, 2, RELU},
+                                  {LAYER_CONV2D, 8, 3, RELU},
+                                  {LAYER_MAXPOOL, 1, 2, RELU},
+                                  {LAYER_DENSE, NB_OUTPUT, 0, SOFTMAX}};
+  Network* cnn = init_nn_spec(1, 32, 32, 5, cnn_specs);
+  NetworkContext* cnn_context = init_nc(cnn);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (long r = 0; r < repetitions; r++) {
+    for (size_t k = 0; k < NB_SAMPLES; k++)
+      predict_nn_ctx(cnn, cnn_context, inputs + k * NB_INPUT);
+  }
+  printf("%-26s %9.2f us/sample (%ld multiply-adds instead of %ld)\n",
+         "predict_nn_ctx c8,p2,c8,p2",
+         elapsed_since(&start) * 1e6 / (repetitions * NB_SAMPLES),
+         nn_nb_multiply_adds(cnn), nn_nb_multiply_adds(network));
+  free_nc(cnn_context);
+  free_nn(cnn);
+
+  free_nc(context);
+  free_bc(batch_context);
+  free(weights.hidden);
+  free(weights.output);
+  free(inputs);
+  free(ink);
+  free(inputs_f32);
+  free_nc_f32(context_f32);
+  free_nn_f32(network_f32);
+  free_sparse_nn(sparse);
+  free(outputs);
+  free(hidden);
+  free(output);
+  free_nn(network);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,30 @@
+/*
+ * Converts a model between the text format (save_nn_data()) and the binary
+ * format (save_nn_binary()). The input format is detected automatically.
+ */
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lib/core_network.h"
+
+int main(int argc, char** argv) {
+  if (argc != 4 ||
+      (strcmp(argv[3], "text") != 0 && strcmp(argv[3], "binary") != 0)) {
+    errx(EXIT_FAILURE,
+         "Usage %s <model data> <output path> <text|binary, output format>",
+         argv[0]);
+  }
+
+  Network* network = load_nn_data(argv[1]);
+  if (strcmp(argv[3], "text") == 0)
+    save_nn_data(network, argv[2]);
+  else
+    save_nn_binary(network, argv[2]);
+  printf("Converted %s to %s (%s)\n", argv[1], argv[2], argv[3]);
+
+  free_nn(network);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,212 @@
+#define _GNU_SOURCE
+#include "checkpoint.h"
+
+#include <err.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+/**
+ * Checkpoint file format (version 1), in host byte order:
+ *
+ * * The network in the binary model format (see save_nn_binary()), so that a
+ * checkpoint can be loaded as a model by load_nn_data()
+ *
+ * * At an offset aligned on CHECKPOINT_ALIGN bytes, the optimizer state of
+ * each trainer (see write_nt_state())
+ *
+ * * A 96 bytes CheckpointTrailer, the last bytes of the file
+ *
+ * Checkpoints are written to a temporary file renamed once synced, so an
+ * interrupted write leaves the previous checkpoint intact.
+ */
+#define CHECKPOINT_MAGIC "OCRCKPNT"
+#define CHECKPOINT_VERSION 1
+#define CHECKPOINT_ALIGN 64
+
+typedef struct CheckpointTrailer {
+  char magic[8];
+  uint32_t version;
+  uint32_t nb_trainers;
+  uint64_t epoch;
+  uint64_t seed;
+  uint64_t states_offset;
+  uint64_t file_size;
+  double lr;
+  double best_accuracy;
+  uint32_t nb_stale;
+  uint32_t nb_reductions;
+  uint32_t stopped;
+  uint8_t reserved[20];
+} CheckpointTrailer;
+
+_Static_assert(sizeof(CheckpointTrailer) == 96, "Invalid trailer size");
+
+/**
+ * @brief Returns a checkpoint writer for a path, nothing being written yet
+ *
+ * **NOTE**: The struct should be freed using free_checkpointer()
+ */
+Checkpointer* init_checkpointer(const char* path) {
+  Checkpointer* checkpointer = calloc(1, sizeof(Checkpointer));
+  if (checkpointer == NULL)
+    errx(EXIT_FAILURE, "Error while allocating memory");
+  checkpointer->path = strdup(path);
+  if (checkpointer->path == NULL)
+    errx(EXIT_FAILURE, "Error while allocating memory");
+  return checkpointer;
+}
+
+/**
+ * @brief Writes the snapshot of a checkpointer to a temporary file, then
+ * renames it to the checkpoint path. Used as a thread routine.
+ *
+ * @param arg A pointer to the Checkpointer
+ * @return NULL
+ */
+static void* write_checkpoint(void* arg) {
+  Checkpointer* checkpointer = arg;
+  char* temp_path = calloc(strlen(checkpointer->path) + 5, sizeof(char));
+  if (temp_path == NULL)
+    errx(EXIT_FAILURE, "Error while allocating memory");
+  sprintf(temp_path, "%s.tmp", checkpointer->path);
+  int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    err(EXIT_FAILURE, "Error while opening %s", temp_path);
+  size_t written = 0;
+  while (written < checkpointer->size) {
+    ssize_t res = write(fd, checkpointer->buffer + written,
+                        checkpointer->size - written);
+    if (res < 0)
+      err(EXIT_FAILURE, "Error while writing %s", temp_path);
+    written += res;
+  }
+  if (fsync(fd) != 0 || close(fd) != 0 ||
+      rename(temp_path, checkpointer->path) != 0)
+    err(EXIT_FAILURE, "Error while writing %s", checkpointer->path);
+  free(temp_path);
+  return NULL;
+}
+
+/**
+ * @brief Waits for the checkpoint being written, if any
+ */
+void wait_checkpoint(Checkpointer* checkpointer) {
+  if (!checkpointer->writing)
+    return;
+  pthread_join(checkpointer->thread, NULL);
+  checkpointer->writing = 0;
+  free(checkpointer->buffer);
+  checkpointer->buffer = NULL;
+}
+
+/**
+ * @brief Saves a checkpoint of a training (see the format above): the network
+ * and trainers are serialized in memory before returning, so training can go
+ * on while a background thread writes them. Only waits for the previous
+ * checkpoint when it is still being written.
+ *
+ * @param checkpointer The checkpoint writer
+ * @param network The trained network
+ * @param trainers The trainers of the workers
+ * @param state Position of the training, with the number of trainers
+ */
+void save_checkpoint(Checkpointer* checkpointer,
+                     const Network* network,
+                     NetworkTrainer* const* trainers,
+                     const CheckpointState* state) {
+  wait_checkpoint(checkpointer);
+  FILE* file = open_memstream(&checkpointer->buffer, &checkpointer->size);
+  if (file == NULL)
+    err(EXIT_FAILURE, "Error while allocating checkpoint");
+  write_nn_binary(network, file);
+
+  CheckpointTrailer trailer;
+  memset(&trailer, 0, sizeof(trailer));
+  memcpy(trailer.magic, CHECKPOINT_MAGIC, sizeof(trailer.magic));
+  trailer.version = CHECKPOINT_VERSION;
+  trailer.nb_trainers = state->nb_trainers;
+  trailer.epoch = state->epoch;
+  trailer.seed = state->seed;
+  trailer.lr = state->schedule.lr;
+  trailer.best_accuracy = state->schedule.best;
+  trailer.nb_stale = state->schedule.nb_stale;
+  trailer.nb_reductions = state->schedule.nb_reductions;
+  trailer.stopped = state->schedule.stopped;
+  static const char padding[CHECKPOINT_ALIGN] = {0};
+  long offset = ftell(file);
+  trailer.states_offset =
+      (offset + CHECKPOINT_ALIGN - 1) / CHECKPOINT_ALIGN * CHECKPOINT_ALIGN;
+  if (fwrite(padding, 1, trailer.states_offset - offset, file) !=
+      trailer.states_offset - offset)
+    errx(EXIT_FAILURE, "Error while writing checkpoint");
+  for (size_t t = 0; t < state->nb_trainers; t++)
+    write_nt_state(trainers[t], network, file);
+  trailer.file_size = ftell(file) + sizeof(trailer);
+  if (fwrite(&trailer, sizeof(trailer), 1, file) != 1 || fclose(file) != 0)
+    errx(EXIT_FAILURE, "Error while writing checkpoint");
+
+  if (pthread_create(&checkpointer->thread, NULL, write_checkpoint,
+                     checkpointer) != 0)
+    errx(EXIT_FAILURE, "Error while creating checkpoint thread");
+  checkpointer->writing = 1;
+}
+
+/**
+ * @brief Waits for the last checkpoint to be written and frees the writer
+ *
+ * @param checkpointer A pointer to the checkpoint writer to free
+ */
+void free_checkpointer(Checkpointer* checkpointer) {
+  wait_checkpoint(checkpointer);
+  free(checkpointer->path);
+  free(checkpointer);
+}
+
+/**
+ * @brief Loads a checkpoint written by save_checkpoint(), to resume its
+ * training
+ *
+ * **NOTE**: The network should be freed using free_nn(), and each trainer
+ * using free_nt() before the array itself
+ *
+ * @param path The path of the checkpoint
+ * @param state Where the position of the training is written
+ * @param trainers Where the array of state->nb_trainers trainers is written,
+ * with their optimizer state restored
+ * @return pointer to the loaded network
+ */
+Network* load_checkpoint(const char* path,
+                         CheckpointState* state,
+                         NetworkTrainer*** trainers) {
+  FILE* file = fopen(path, "rb");
+  if (file == NULL)
+    err(EXIT_FAILURE, "Error opening %s", path);
+  CheckpointTrailer trailer;
+  if (fseek(file, -(long)sizeof(trailer), SEEK_END) != 0 ||
+      fread(&trailer, sizeof(trailer), 1, file) != 1 ||
+      memcmp(trailer.magic, CHECKPOINT_MAGIC, sizeof(trailer.magic)) != 0 ||
+      trailer.version != CHECKPOINT_VERSION ||
+      trailer.file_size != (uint64_t)ftell(file) || trailer.nb_trainers == 0 ||
+      trailer.states_offset > trailer.file_size - sizeof(trailer) ||
+      fseek(file, trailer.states_offset, SEEK_SET) != 0)
+    errx(EXIT_FAILURE, "Invalid checkpoint file %s", path);
+
+  Network* network = load_nn_binary(path);
+  state->epoch = trailer.epoch;
+  state->seed = trailer.seed;
+  state->nb_trainers = trailer.nb_trainers;
+  state->schedule = (ScheduleState){trailer.lr, trailer.best_accuracy,
+                                    trailer.nb_stale, trailer.nb_reductions,
+                                    trailer.stopped};
+  *trainers = calloc(trailer.nb_trainers, sizeof(NetworkTrainer*));
+  if (*trainers == NULL)
+    errx(EXIT_FAILURE, "Error while allocating memory");
+  for (size_t t = 0; t < trailer.nb_trainers; t++) {
+    (*trainers)[t] = init_nt(network);
+    read_nt_state((*trainers)[t], network, file);
+  }
+  fclose(file);
+  return network;
+}
@@ -0,0 +1,46 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "core_network.h"
+#include "schedule.h"
+
+/**
+ * Position of a training saved in a checkpoint, besides the network and the
+ * optimizer state of its trainers
+ */
+typedef struct CheckpointState {
+  size_t epoch;   // Number of epochs done
+  uint64_t seed;  // Seed of the batch pipeline
+  size_t nb_trainers;
+  ScheduleState schedule;  // Learning rate and early stopping
+} CheckpointState;
+
+/**
+ * Writer of the checkpoints of a training: a snapshot is serialized in memory
+ * by the training thread between two epochs, then written to disk by a
+ * background thread while training goes on
+ */
+typedef struct Checkpointer {
+  char* path;
+  char* buffer;  // Snapshot being written
+  size_t size;
+  pthread_t thread;
+  int writing;
+} Checkpointer;
+
+Checkpointer* init_checkpointer(const char* path);
+void save_checkpoint(Checkpointer* checkpointer,
+                     const Network* network,
+                     NetworkTrainer* const* trainers,
+                     const CheckpointState* state);
+void wait_checkpoint(Checkpointer* checkpointer);
+void free_checkpointer(Checkpointer* checkpointer);
+Network* load_checkpoint(const char* path,
+                         CheckpointState* state,
+                         NetworkTrainer*** trainers);
+
+#endif
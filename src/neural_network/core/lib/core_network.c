@@ -1,12 +1,19 @@
+#define _POSIX_C_SOURCE 200809L
 #include <err.h>
+#include <fcntl.h>
 #include <math.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <time.h>
+#include <unistd.h>
 // #include <omp.h>
 
 #include "core_network.h"
+#include "linalg.h"
 
 /**
  * Activation functions and their derivatives (prefixed with d_)
@@ -55,132 +62,573 @@ double d_tanh(double x) {
 }
 
 /**
- * @brief Initialize a neural network and returns a pointer to a newly allocated
- * struct.
+ * @brief Applies softmax in place on a list of values, shifted by their max for
+ * numerical stability
  *
- * **NOTE**: The struct should be freed using the free_nn() function.
- *
- * @param input_layer_size Size of the input layer
- * @param hidden_layer_size Size of the hidden layer
- * @param output_layer_size Size of the output layer
- * @param activation_hidden Activation function of the hidden layer (Available
- * functions are in the header associated with this file).
- * @param activation_output Activation function of the output layer (Available
- * functions are in the header associated with this file).
- *
- * @return pointer to initialized neural network
+ * @param values The values to normalize
+ * @param size The number of values
  */
-Network* init_nn(size_t input_layer_size,
-                 size_t hidden_layer_size,
-                 size_t output_layer_size,
-                 ActivationFunction activation_hidden,
-                 ActivationFunction activation_output) {
-  Network* network = malloc(sizeof(Network));
-  if (network == NULL) {
-    errx(EXIT_FAILURE, "Memory allocation failed");
+static void softmax(double* values, size_t size) {
+  double max_output = values[0];
+  for (size_t i = 0; i < size; i++) {
+    if (values[i] > max_output) {
+      max_output = values[i];
+    }
   }
 
-  if (activation_hidden == SOFTMAX) {
-    errx(EXIT_FAILURE, "Softmax on hidden layer is not supported");
+  double total = 0;
+  for (size_t i = 0; i < size; i++) {
+    values[i] = exp(values[i] - max_output);
+    total += values[i];
   }
 
-  srand(time(NULL));
+  for (size_t i = 0; i < size; i++) {
+    values[i] /= total;
+  }
+}
 
-  network->nb_input = input_layer_size;
-  network->nb_hidden = hidden_layer_size;
-  network->nb_output = output_layer_size;
+/**
+ * Layer kernels specialized for each activation function. Each instantiation
+ * calls its activation function directly, so the compiler inlines it and
+ * vectorizes the loop over the whole layer instead of calling through a
+ * function pointer for every neuron. Derivatives are computed from the
+ * activated values, like the d_fct of a Layer.
+ */
+#define DEFINE_ACTIVATION_KERNELS(name, fct, d_fct)                          \
+  static void activate_##name(double* values, size_t size) {                \
+    for (size_t i = 0; i < size; i++) {                                     \
+      values[i] = fct(values[i]);                                           \
+    }                                                                       \
+  }                                                                         \
+  static void derivative_##name(const double* restrict activated,           \
+                                double* restrict gradients, size_t size) {  \
+    for (size_t i = 0; i < size; i++) {                                     \
+      gradients[i] *= d_fct(activated[i]);                                  \
+    }                                                                       \
+  }
 
-  network->ouput_activation = activation_output;
-  network->hidden_activation = activation_hidden;
+DEFINE_ACTIVATION_KERNELS(sigmoid, sigmoid, d_sigmoid)
+DEFINE_ACTIVATION_KERNELS(relu, relu, d_relu)
+DEFINE_ACTIVATION_KERNELS(elu, elu, d_elu)
+DEFINE_ACTIVATION_KERNELS(lrelu, lrelu, d_lrelu)
+DEFINE_ACTIVATION_KERNELS(tanh, tanh_, d_tanh)
 
-  network->hidden = calloc(hidden_layer_size, sizeof(double));
-  network->output = calloc(output_layer_size, sizeof(double));
+static void activate_softmax(double* values, size_t size) {
+  softmax(values, size);
+}
 
-  network->hidden_biases = calloc(hidden_layer_size, sizeof(double));
-  network->output_biases = calloc(output_layer_size, sizeof(double));
+/**
+ * With softmax and cross-entropy, the output gradient is already output -
+ * target: there is no derivative to apply.
+ */
+static void derivative_softmax(const double* activated,
+                               double* gradients,
+                               size_t size) {
+  (void)activated;
+  (void)gradients;
+  (void)size;
+}
 
-  network->hidden_weights =
-      calloc(input_layer_size * hidden_layer_size, sizeof(double));
-  network->output_weights =
-      calloc(hidden_layer_size * output_layer_size, sizeof(double));
+/**
+ * @brief Computes output = biases + weights.input on a dense layer whose
+ * weights are stored output-major (one contiguous row of nb_input weights per
+ * neuron). Neurons are computed by blocks of 4 rows so that each input loaded
+ * is reused by 4 independent accumulators, kept in registers.
+ */
+static inline void dense_accumulate(const double* restrict weights,
+                                    const double* restrict biases,
+                                    const double* restrict input,
+                                    double* restrict output,
+                                    size_t nb_input,
+                                    size_t nb_output) {
+  size_t i = 0;
+  for (; i + 4 <= nb_output; i += 4) {
+    const double* row_0 = weights + i * nb_input;
+    const double* row_1 = row_0 + nb_input;
+    const double* row_2 = row_1 + nb_input;
+    const double* row_3 = row_2 + nb_input;
+    double total_0 = 0., total_1 = 0., total_2 = 0., total_3 = 0.;
+    for (size_t j = 0; j < nb_input; j++) {
+      const double x = input[j];
+      total_0 += row_0[j] * x;
+      total_1 += row_1[j] * x;
+      total_2 += row_2[j] * x;
+      total_3 += row_3[j] * x;
+    }
+    output[i] = total_0 + biases[i];
+    output[i + 1] = total_1 + biases[i + 1];
+    output[i + 2] = total_2 + biases[i + 2];
+    output[i + 3] = total_3 + biases[i + 3];
+  }
+  for (; i < nb_output; i++) {
+    const double* row = weights + i * nb_input;
+    double total = 0.;
+    for (size_t j = 0; j < nb_input; j++) {
+      total += row[j] * input[j];
+    }
+    output[i] = total + biases[i];
+  }
+}
 
-  if (network->output == NULL || network->hidden == NULL ||
-      network->hidden_biases == NULL || network->output_biases == NULL ||
-      network->hidden_weights == NULL || network->output_weights == NULL) {
-    errx(EXIT_FAILURE, "Memory allocation failed");
+#define DEFINE_DENSE_KERNEL(name)                                           \
+  static void forward_##name(const double* weights, const double* biases,  \
+                             const double* input, double* output,          \
+                             size_t nb_input, size_t nb_output) {          \
+    dense_accumulate(weights, biases, input, output, nb_input, nb_output); \
+    activate_##name(output, nb_output);                                    \
   }
 
-  for (size_t i = 0; i < input_layer_size * hidden_layer_size; i++) {
-    network->hidden_weights[i] = ((double)rand() / (RAND_MAX / 2) - 1.) / 2.;
+DEFINE_DENSE_KERNEL(softmax)
+DEFINE_DENSE_KERNEL(sigmoid)
+DEFINE_DENSE_KERNEL(relu)
+DEFINE_DENSE_KERNEL(elu)
+DEFINE_DENSE_KERNEL(lrelu)
+DEFINE_DENSE_KERNEL(tanh)
+
+#define LAYER_KERNELS(name) \
+  {&forward_##name, &activate_##name, &derivative_##name}
+
+// Indexed by ActivationFunction
+static const LayerKernels layer_kernels[] = {
+    LAYER_KERNELS(softmax), LAYER_KERNELS(sigmoid), LAYER_KERNELS(relu),
+    LAYER_KERNELS(elu),     LAYER_KERNELS(lrelu),   LAYER_KERNELS(tanh)};
+
+/**
+ * @brief Gets the layer kernels specialized for an activation function. When
+ * built with NN_GENERIC_KERNELS, no kernel is returned and layers fall back to
+ * the activation function pointers.
+ *
+ * @param activation The activation function of the layer
+ * @param kernels Where the kernels are written (set to NULL if not available)
+ */
+static void get_layer_kernels(ActivationFunction activation,
+                              LayerKernels* kernels) {
+#ifdef NN_GENERIC_KERNELS
+  const int specialized = 0;
+#else
+  const int specialized = 1;
+#endif
+  if (specialized &&
+      (size_t)activation < sizeof(layer_kernels) / sizeof(layer_kernels[0])) {
+    *kernels = layer_kernels[activation];
+    return;
   }
+  kernels->forward = NULL;
+  kernels->activate = NULL;
+  kernels->derivative = NULL;
+}
 
-  for (size_t i = 0; i < hidden_layer_size * output_layer_size; i++) {
-    network->output_weights[i] = ((double)rand() / (RAND_MAX / 2) - 1.) / 2.;
+/**
+ * @brief Applies the activation function of a layer in place, through its
+ * specialized kernel when available
+ */
+static void layer_activate(const LayerKernels* kernels,
+                           double (*fct)(double),
+                           double* values,
+                           size_t size) {
+  if (kernels->activate != NULL) {
+    (*kernels->activate)(values, size);
+  } else if (fct == NULL) {
+    softmax(values, size);
+  } else {
+    for (size_t i = 0; i < size; i++) {
+      values[i] = (*fct)(values[i]);
+    }
   }
+}
 
-  // Define function pointers for activation functions of hidden and output
-  // layer
+/**
+ * @brief Multiplies the gradients of a layer by the derivative of its
+ * activation function, through its specialized kernel when available
+ */
+static void layer_derivative(const LayerKernels* kernels,
+                             double (*d_fct)(double),
+                             const double* activated,
+                             double* gradients,
+                             size_t size) {
+  if (kernels->derivative != NULL) {
+    (*kernels->derivative)(activated, gradients, size);
+  } else if (d_fct != NULL) {
+    for (size_t i = 0; i < size; i++) {
+      gradients[i] *= (*d_fct)(activated[i]);
+    }
+  }
+}
 
-  switch (network->hidden_activation) {
+/**
+ * @brief Gets the activation function and its derivative corresponding to an
+ * ActivationFunction value. Both are set to NULL for SOFTMAX, which is applied
+ * on the whole layer.
+ *
+ * @param activation The activation function to look up
+ * @param fct Address where the activation function pointer is written
+ * @param d_fct Address where the derivative function pointer is written
+ * @return 1 on success, 0 if the activation function is unknown
+ */
+int get_activation(ActivationFunction activation,
+                   double (**fct)(double),
+                   double (**d_fct)(double)) {
+  switch (activation) {
     case SIGMOID:
-      network->hidden_fct = &sigmoid;
-      network->d_hidden_fct = &d_sigmoid;
-      break;
+      *fct = &sigmoid;
+      *d_fct = &d_sigmoid;
+      return 1;
     case RELU:
-      network->hidden_fct = &relu;
-      network->d_hidden_fct = &d_relu;
-      break;
+      *fct = &relu;
+      *d_fct = &d_relu;
+      return 1;
     case LRELU:
-      network->hidden_fct = &lrelu;
-      network->d_hidden_fct = &d_lrelu;
-      break;
+      *fct = &lrelu;
+      *d_fct = &d_lrelu;
+      return 1;
     case ELU:
-      network->hidden_fct = &elu;
-      network->d_hidden_fct = &d_elu;
-      break;
+      *fct = &elu;
+      *d_fct = &d_elu;
+      return 1;
     case TANH:
-      network->hidden_fct = &tanh_;
-      network->d_hidden_fct = &d_tanh;
-      break;
+      *fct = &tanh_;
+      *d_fct = &d_tanh;
+      return 1;
+    case SOFTMAX:
+      *fct = NULL;
+      *d_fct = NULL;
+      return 1;
     default:
-      errx(EXIT_FAILURE, "Unknown hidden activation function");
-      break;
+      return 0;
   }
+}
 
-  // Define function pointers for derivatives of activation functions
-  // of hidden and output layer for back propagation
-  switch (network->ouput_activation) {
-    case SIGMOID:
-      network->output_fct = &sigmoid;
-      network->d_output_fct = &d_sigmoid;
-      break;
-    case RELU:
-      network->output_fct = &relu;
-      network->d_output_fct = &d_relu;
-      break;
-    case LRELU:
-      network->output_fct = &lrelu;
-      network->d_output_fct = &d_lrelu;
-      break;
-    case ELU:
-      network->output_fct = &elu;
-      network->d_output_fct = &d_elu;
+/**
+ * @brief Returns the number of weights of a layer
+ */
+static size_t layer_nb_weights(const Layer* layer) {
+  switch (layer->type) {
+    case LAYER_DENSE:
+      return layer->nb_input * layer->nb_output;
+    case LAYER_CONV2D:
+      return layer->out_channels * layer->in_channels * layer->kernel *
+             layer->kernel;
+    default:
+      return 0;
+  }
+}
+
+/**
+ * @brief Returns the number of biases of a layer
+ */
+static size_t layer_nb_biases(const Layer* layer) {
+  switch (layer->type) {
+    case LAYER_DENSE:
+      return layer->nb_output;
+    case LAYER_CONV2D:
+      return layer->out_channels;
+    default:
+      return 0;
+  }
+}
+
+/**
+ * @brief Returns the size of the unfolded input (im2col matrix) of a
+ * convolution, 0 for other layers
+ */
+static size_t layer_nb_columns(const Layer* layer) {
+  if (layer->type != LAYER_CONV2D)
+    return 0;
+  return layer->in_channels * layer->kernel * layer->kernel *
+         layer->out_height * layer->out_width;
+}
+
+/**
+ * @brief Returns the size of the scratch list of an inference context: room
+ * for the im2col matrix of the largest convolution and for its gradients
+ */
+static size_t nn_scratch_size(const Network* network) {
+  size_t res = 0;
+  for (size_t l = 0; l < network->nb_layers; l++) {
+    size_t size = layer_nb_columns(&network->layers[l]);
+    if (size > res)
+      res = size;
+  }
+  return 2 * res;
+}
+
+/**
+ * @brief Sets the geometry of a layer from its spec and the geometry of its
+ * input
+ */
+static void init_layer_geometry(Layer* layer,
+                                const LayerSpec* spec,
+                                size_t channels,
+                                size_t height,
+                                size_t width) {
+  layer->type = spec->type;
+  layer->in_channels = channels;
+  layer->in_height = height;
+  layer->in_width = width;
+  layer->kernel = spec->kernel;
+  switch (spec->type) {
+    case LAYER_DENSE:
+      if (spec->size == 0)
+        errx(EXIT_FAILURE, "Invalid size of dense layer");
+      layer->in_channels = channels * height * width;
+      layer->in_height = 1;
+      layer->in_width = 1;
+      layer->out_channels = spec->size;
+      layer->out_height = 1;
+      layer->out_width = 1;
+      layer->kernel = 0;
       break;
-    case TANH:
-      network->output_fct = &tanh_;
-      network->d_output_fct = &d_tanh;
+    case LAYER_CONV2D:
+      if (spec->size == 0 || spec->kernel % 2 == 0)
+        errx(EXIT_FAILURE, "Invalid convolution (the kernel size must be odd)");
+      layer->out_channels = spec->size;
+      layer->out_height = height;
+      layer->out_width = width;
       break;
-    case SOFTMAX:
-      network->output_fct = NULL;
-      network->d_output_fct = NULL;
+    case LAYER_MAXPOOL:
+      if (spec->kernel == 0 || spec->kernel > height || spec->kernel > width)
+        errx(EXIT_FAILURE, "Invalid pooling window");
+      layer->out_channels = channels;
+      layer->out_height = height / spec->kernel;
+      layer->out_width = width / spec->kernel;
       break;
     default:
-      errx(EXIT_FAILURE, "Unknown output activation function");
-      break;
+      errx(EXIT_FAILURE, "Unknown layer type");
+  }
+  layer->nb_input = channels * height * width;
+  layer->nb_output = layer->out_channels * layer->out_height * layer->out_width;
+}
+
+/**
+ * @brief Allocates a neural network struct with its layers and default
+ * inference context, but without weights and biases.
+ */
+static Network* alloc_nn(size_t channels,
+                         size_t height,
+                         size_t width,
+                         size_t nb_layers,
+                         const LayerSpec* specs) {
+  if (nb_layers == 0) {
+    errx(EXIT_FAILURE, "A network needs at least one layer");
+  }
+  Network* network = malloc(sizeof(Network));
+  if (network == NULL) {
+    errx(EXIT_FAILURE, "Memory allocation failed");
+  }
+  network->layers = calloc(nb_layers, sizeof(Layer));
+  if (network->layers == NULL) {
+    errx(EXIT_FAILURE, "Memory allocation failed");
+  }
+
+  network->nb_input = channels * height * width;
+  network->nb_layers = nb_layers;
+  network->mapping = NULL;
+  network->mapping_size = 0;
+
+  for (size_t l = 0; l < nb_layers; l++) {
+    Layer* layer = &network->layers[l];
+    init_layer_geometry(layer, &specs[l], channels, height, width);
+    channels = layer->out_channels;
+    height = layer->out_height;
+    width = layer->out_width;
+    layer->weights = NULL;
+    layer->biases = NULL;
+    layer->activation = specs[l].activation;
+    if (layer->type == LAYER_MAXPOOL) {
+      // No activation function
+      layer->fct = NULL;
+      layer->d_fct = NULL;
+      layer->kernels = (LayerKernels){NULL, NULL, NULL};
+      continue;
+    }
+    if (layer->activation == SOFTMAX &&
+        (l + 1 != nb_layers || layer->type != LAYER_DENSE)) {
+      errx(EXIT_FAILURE, "Softmax on hidden layer is not supported");
+    }
+    // Define function pointers for the activation function of the layer, and
+    // its derivative for back propagation
+    if (!get_activation(layer->activation, &layer->fct, &layer->d_fct)) {
+      errx(EXIT_FAILURE, "Unknown activation function of layer %ld", l);
+    }
+    get_layer_kernels(layer->activation, &layer->kernels);
+  }
+  network->nb_output = network->layers[nb_layers - 1].nb_output;
+
+  network->context = init_nc(network);
+  network->output = network->context->output;
+  return network;
+}
+
+/**
+ * @brief Allocates the (zeroed) weights and biases of a network struct from
+ * alloc_nn()
+ */
+static void alloc_params(Network* network) {
+  for (size_t l = 0; l < network->nb_layers; l++) {
+    Layer* layer = &network->layers[l];
+    if (layer->type == LAYER_MAXPOOL)
+      continue;
+    layer->weights = calloc(layer_nb_weights(layer), sizeof(double));
+    layer->biases = calloc(layer_nb_biases(layer), sizeof(double));
+    if (layer->weights == NULL || layer->biases == NULL) {
+      errx(EXIT_FAILURE, "Memory allocation failed");
+    }
+  }
+}
+
+/**
+ * @brief Initialize a neural network made of a stack of layers and returns a
+ * pointer to a newly allocated struct.
+ *
+ * **NOTE**: The struct should be freed using the free_nn() function.
+ *
+ * @param channels Number of channels of the input image (1 for grayscale)
+ * @param height Height of the input image
+ * @param width Width of the input image. Networks made of dense layers only
+ * can use a 1 x 1 image of input_layer_size channels (see init_nn_layers()).
+ * @param nb_layers Number of layers, the last one being the output layer
+ * @param specs Type, size and activation function of each layer. Softmax is
+ * only supported on a dense output layer.
+ *
+ * @return pointer to initialized neural network
+ */
+Network* init_nn_spec(size_t channels,
+                      size_t height,
+                      size_t width,
+                      size_t nb_layers,
+                      const LayerSpec* specs) {
+  Network* network = alloc_nn(channels, height, width, nb_layers, specs);
+
+  srand(time(NULL));
+  alloc_params(network);
+
+  for (size_t l = 0; l < nb_layers; l++) {
+    Layer* layer = &network->layers[l];
+    for (size_t i = 0; i < layer_nb_weights(layer); i++) {
+      layer->weights[i] = ((double)rand() / (RAND_MAX / 2) - 1.) / 2.;
+    }
+  }
+  return network;
+}
+
+/**
+ * @brief Initialize a neural network made of a stack of dense layers and
+ * returns a pointer to a newly allocated struct.
+ *
+ * **NOTE**: The struct should be freed using the free_nn() function.
+ *
+ * @param input_layer_size Size of the input layer
+ * @param nb_layers Number of layers (hidden layers and output layer)
+ * @param layer_sizes Number of neurons of each layer, the last one being the
+ * output layer
+ * @param activations Activation function of each layer (Available functions
+ * are in the header associated with this file). Softmax is only supported on
+ * the output layer.
+ *
+ * @return pointer to initialized neural network
+ */
+Network* init_nn_layers(size_t input_layer_size,
+                        size_t nb_layers,
+                        const size_t* layer_sizes,
+                        const ActivationFunction* activations) {
+  LayerSpec* specs = calloc(nb_layers, sizeof(LayerSpec));
+  if (specs == NULL) {
+    errx(EXIT_FAILURE, "Memory allocation failed");
+  }
+  for (size_t l = 0; l < nb_layers; l++) {
+    specs[l].type = LAYER_DENSE;
+    specs[l].size = layer_sizes[l];
+    specs[l].activation = activations[l];
   }
+  Network* network = init_nn_spec(input_layer_size, 1, 1, nb_layers, specs);
+  free(specs);
   return network;
 }
 
+/**
+ * @brief Initialize a neural network with one hidden layer and returns a
+ * pointer to a newly allocated struct (see init_nn_layers()).
+ *
+ * **NOTE**: The struct should be freed using the free_nn() function.
+ *
+ * @param input_layer_size Size of the input layer
+ * @param hidden_layer_size Size of the hidden layer
+ * @param output_layer_size Size of the output layer
+ * @param activation_hidden Activation function of the hidden layer (Available
+ * functions are in the header associated with this file).
+ * @param activation_output Activation function of the output layer (Available
+ * functions are in the header associated with this file).
+ *
+ * @return pointer to initialized neural network
+ */
+Network* init_nn(size_t input_layer_size,
+                 size_t hidden_layer_size,
+                 size_t output_layer_size,
+                 ActivationFunction activation_hidden,
+                 ActivationFunction activation_output) {
+  const size_t sizes[2] = {hidden_layer_size, output_layer_size};
+  const ActivationFunction activations[2] = {activation_hidden,
+                                             activation_output};
+  return init_nn_layers(input_layer_size, 2, sizes, activations);
+}
+
+/**
+ * @brief Returns the number of weights (biases excluded) of a network
+ */
+size_t nn_nb_weights(const Network* network) {
+  size_t res = 0;
+  for (size_t l = 0; l < network->nb_layers; l++) {
+    res += layer_nb_weights(&network->layers[l]);
+  }
+  return res;
+}
+
+/**
+ * @brief Returns the number of multiply-adds of the forward propagation of one
+ * sample
+ */
+size_t nn_nb_multiply_adds(const Network* network) {
+  size_t res = 0;
+  for (size_t l = 0; l < network->nb_layers; l++) {
+    const Layer* layer = &network->layers[l];
+    if (layer->type == LAYER_DENSE)
+      res += layer_nb_weights(layer);
+    else if (layer->type == LAYER_CONV2D)
+      res += layer_nb_weights(layer) * layer->out_height * layer->out_width;
+  }
+  return res;
+}
+
+/**
+ * @brief Returns an array of one heap-allocated list of doubles per layer of
+ * the network, each holding rows lists of the size of the layer
+ */
+static double** alloc_layer_lists(const Network* network, size_t rows) {
+  double** res = calloc(network->nb_layers, sizeof(double*));
+  if (res == NULL) {
+    errx(EXIT_FAILURE, "Error while allocating memory");
+  }
+  for (size_t l = 0; l < network->nb_layers; l++) {
+    res[l] = calloc(rows * network->layers[l].nb_output, sizeof(double));
+    if (res[l] == NULL) {
+      errx(EXIT_FAILURE, "Error while allocating memory");
+    }
+  }
+  return res;
+}
+
+/**
+ * @brief Frees an array allocated by alloc_layer_lists()
+ */
+static void free_layer_lists(double** lists, size_t nb_layers) {
+  if (lists == NULL)
+    return;
+  for (size_t l = 0; l < nb_layers; l++) {
+    free(lists[l]);
+  }
+  free(lists);
+}
+
 /**
  * @brief Returns a trainer struct pointer which is adapted for the specified
  * neural network
@@ -190,17 +638,122 @@ Network* init_nn(size_t input_layer_size,
  * @param network A pointer to the neural network structure to train.
  * @return pointer to initialized trainer structure
  */
-NetworkTrainer* init_nt(Network* network) {
+NetworkTrainer* init_nt(const Network* network) {
   NetworkTrainer* trainer = malloc(sizeof(NetworkTrainer));
   if (trainer == NULL) {
     errx(EXIT_FAILURE, "Error while allocating memory");
   }
-  trainer->gradients_errors_hidden = calloc(network->nb_hidden, sizeof(double));
-  trainer->gradients_errors_output = calloc(network->nb_output, sizeof(double));
-  if (trainer->gradients_errors_hidden == NULL || trainer->gradients_errors_output == NULL) {
+  trainer->gradients = alloc_layer_lists(network, 1);
+  trainer->context = init_nc(network);
+  trainer->batch_capacity = 0;
+  trainer->batch_layers = NULL;
+  trainer->batch_gradients = NULL;
+  trainer->optimizer = default_optimizer(OPTIMIZER_SGD);
+  trainer->nb_steps = 0;
+  trainer->parameter_gradients = NULL;
+  trainer->first_moments = NULL;
+  trainer->second_moments = NULL;
+  return trainer;
+}
+
+/**
+ * @brief Returns the usual hyperparameters of an optimizer: 0.9 momentum,
+ * and for Adam 0.9 and 0.999 moment decays with a 1e-8 epsilon
+ */
+Optimizer default_optimizer(OptimizerType type) {
+  Optimizer res = {type, 0.9, 0.999, 1e-8};
+  return res;
+}
+
+/**
+ * @brief Returns an array of one zeroed heap-allocated list per layer of the
+ * network, able to hold its weights then its biases (NULL for layers without
+ * parameters)
+ */
+static double** alloc_parameter_lists(const Network* network) {
+  double** res = calloc(network->nb_layers, sizeof(double*));
+  if (res == NULL) {
     errx(EXIT_FAILURE, "Error while allocating memory");
   }
-  return trainer;
+  for (size_t l = 0; l < network->nb_layers; l++) {
+    const Layer* layer = &network->layers[l];
+    size_t size = layer_nb_weights(layer) + layer_nb_biases(layer);
+    if (size == 0)
+      continue;
+    res[l] = calloc(size, sizeof(double));
+    if (res[l] == NULL) {
+      errx(EXIT_FAILURE, "Error while allocating memory");
+    }
+  }
+  return res;
+}
+
+/**
+ * @brief Selects the optimizer used by train_nn() and train_nn_batch() and
+ * allocates its state once (gradients and moments of every parameter), the
+ * state of the previous optimizer being dropped
+ *
+ * @param trainer A pointer to the trainer structure
+ * @param network A pointer to the neural network structure to train
+ * @param optimizer The optimizer, see default_optimizer()
+ */
+void set_optimizer_nt(NetworkTrainer* trainer,
+                      const Network* network,
+                      const Optimizer* optimizer) {
+  free_layer_lists(trainer->parameter_gradients, network->nb_layers);
+  free_layer_lists(trainer->first_moments, network->nb_layers);
+  free_layer_lists(trainer->second_moments, network->nb_layers);
+  trainer->parameter_gradients = NULL;
+  trainer->first_moments = NULL;
+  trainer->second_moments = NULL;
+  trainer->optimizer = *optimizer;
+  trainer->nb_steps = 0;
+  if (optimizer->type == OPTIMIZER_SGD)
+    return;
+  trainer->parameter_gradients = alloc_parameter_lists(network);
+  trainer->first_moments = alloc_parameter_lists(network);
+  if (optimizer->type == OPTIMIZER_ADAM)
+    trainer->second_moments = alloc_parameter_lists(network);
+}
+
+/**
+ * @brief Returns an inference context (activations of every layer) adapted for
+ * the specified neural network. A context is cheap compared to the network
+ * weights: each thread predicting with a shared network owns one.
+ *
+ *  **NOTE**: The pointer has to be freed after use using free_nc()
+ *
+ * @param network A pointer to the neural network structure to predict with
+ * @return pointer to initialized inference context
+ */
+NetworkContext* init_nc(const Network* network) {
+  NetworkContext* context = malloc(sizeof(NetworkContext));
+  if (context == NULL) {
+    errx(EXIT_FAILURE, "Error while allocating memory");
+  }
+  context->nb_layers = network->nb_layers;
+  context->layers = alloc_layer_lists(network, 1);
+  context->output = context->layers[network->nb_layers - 1];
+  context->scratch = NULL;
+  size_t scratch_size = nn_scratch_size(network);
+  if (scratch_size > 0) {
+    context->scratch = calloc(scratch_size, sizeof(double));
+    if (context->scratch == NULL) {
+      errx(EXIT_FAILURE, "Error while allocating memory");
+    }
+  }
+  return context;
+}
+
+/**
+ * @brief Frees an inference context heap-allocated memory
+ *
+ * @param context A pointer to the inference context to free
+ */
+void free_nc(NetworkContext* context) {
+  free_layer_lists(context->layers, context->nb_layers);
+  free(context->scratch);
+  free(context);
 }
 
 /**
@@ -210,12 +763,16 @@ NetworkTrainer* init_nt(Network* network) {
  *
  */
 void free_nn(Network* network) {
-  free(network->hidden_weights);
-  free(network->hidden_biases);
-  free(network->output_weights);
-  free(network->output_biases);
-  free(network->hidden);
-  free(network->output);
+  if (network->mapping != NULL) {
+    munmap(network->mapping, network->mapping_size);
+  } else {
+    for (size_t l = 0; l < network->nb_layers; l++) {
+      free(network->layers[l].weights);
+      free(network->layers[l].biases);
+    }
+  }
+  free_nc(network->context);
+  free(network->layers);
   free(network);
 }
 
@@ -225,14 +782,20 @@ void free_nn(Network* network) {
  * @param trainer A pointer to the trainer structure
  */
 void free_nt(NetworkTrainer* trainer) {
-  free(trainer->gradients_errors_hidden);
-  free(trainer->gradients_errors_output);
+  size_t nb_layers = trainer->context->nb_layers;
+  free_layer_lists(trainer->gradients, nb_layers);
+  free_layer_lists(trainer->batch_layers, nb_layers);
+  free_layer_lists(trainer->batch_gradients, nb_layers);
+  free_layer_lists(trainer->parameter_gradients, nb_layers);
+  free_layer_lists(trainer->first_moments, nb_layers);
+  free_layer_lists(trainer->second_moments, nb_layers);
+  free_nc(trainer->context);
   free(trainer);
 }
 
 /**
- * @brief Prints in stdout wether the hidden or output layer is dead (i.e. all
- * of the neurons from a layer are equal to 0). Layers die when
+ * @brief Prints in stdout wether a layer is dead (i.e. all of its neurons are
+ * equal to 0) after the last prediction with predict_nn(). Layers die when
  * learning rate is too high and using RELU or its variants.
  *
  * @param network A pointer to the neural network structure to test its layers.
@@ -240,26 +803,479 @@ void free_nt(NetworkTrainer* trainer) {
  */
 void is_network_dead(const Network* network) {
   const double threshold = 0.00001;
-  char hidden_dead = 1;
-  char output_dead = 1;
-  for (size_t k = 0; k < network->nb_hidden; k++) {
-    if (fabs(network->hidden[k]) > threshold) {
-      hidden_dead = 0;
-      break;
+  for (size_t l = 0; l < network->nb_layers; l++) {
+    const double* values = network->context->layers[l];
+    char dead = 1;
+    for (size_t k = 0; k < network->layers[l].nb_output; k++) {
+      if (fabs(values[k]) > threshold) {
+        dead = 0;
+        break;
+      }
+    }
+    if (dead == 1) {
+      if (l + 1 == network->nb_layers)
+        printf("\033[31m\033[1mOUT LAYER DEAD\033[0m\n");
+      else
+        printf("\033[31m\033[1mHIDDEN LAYER %ld DEAD\033[0m\n", l);
+    }
+  }
+}
+
+/**
+ * @brief Forward propagates one dense layer through the activation function
+ * pointers, when no specialized kernel is available
+ */
+static void forward_generic(const Layer* layer,
+                            const double* input,
+                            double* output) {
+  // * NOTE: Parallelization fails when using function pointers
+  // #pragma acc parallel loop
+  for (size_t i = 0; i < layer->nb_output; i++) {
+    const double* row = layer->weights + i * layer->nb_input;
+    double total = 0;
+    // #pragma acc loop reduction(+ : total)
+    for (size_t j = 0; j < layer->nb_input; j++) {
+      total += input[j] * row[j];
+    }
+    output[i] = total + layer->biases[i];
+  }
+  layer_activate(&layer->kernels, layer->fct, output, layer->nb_output);
+}
+
+/**
+ * @brief Unfolds the input of a convolution (im2col): row (c, ki, kj) of
+ * columns holds, for every output pixel, the input pixel of channel c under
+ * the kernel element (ki, kj), or 0 in the padding. The convolution is then
+ * one matrix product of the weights by columns.
+ */
+static void im2col(const Layer* layer, const double* input, double* columns) {
+  const size_t k = layer->kernel;
+  const size_t pad = k / 2;
+  const size_t height = layer->in_height;
+  const size_t width = layer->in_width;
+  double* row = columns;
+  for (size_t c = 0; c < layer->in_channels; c++) {
+    const double* channel = input + c * height * width;
+    for (size_t ki = 0; ki < k; ki++) {
+      for (size_t kj = 0; kj < k; kj++) {
+        for (size_t y = 0; y < height; y++) {
+          // Unsigned wrap around makes out of bounds rows and columns large
+          size_t iy = y + ki - pad;
+          for (size_t x = 0; x < width; x++) {
+            size_t ix = x + kj - pad;
+            row[y * width + x] =
+                iy < height && ix < width ? channel[iy * width + ix] : 0.;
+          }
+        }
+        row += height * width;
+      }
+    }
+  }
+}
+
+/**
+ * @brief Adds the gradients of the unfolded input of a convolution back to
+ * the gradients of its input (reverse of im2col())
+ */
+static void col2im(const Layer* layer,
+                   const double* columns,
+                   double* input_gradients) {
+  const size_t k = layer->kernel;
+  const size_t pad = k / 2;
+  const size_t height = layer->in_height;
+  const size_t width = layer->in_width;
+  const double* row = columns;
+  for (size_t c = 0; c < layer->in_channels; c++) {
+    double* channel = input_gradients + c * height * width;
+    for (size_t ki = 0; ki < k; ki++) {
+      for (size_t kj = 0; kj < k; kj++) {
+        for (size_t y = 0; y < height; y++) {
+          size_t iy = y + ki - pad;
+          if (iy >= height)
+            continue;
+          for (size_t x = 0; x < width; x++) {
+            size_t ix = x + kj - pad;
+            if (ix < width)
+              channel[iy * width + ix] += row[y * width + x];
+          }
+        }
+        row += height * width;
+      }
+    }
+  }
+}
+
+/**
+ * @brief Forward propagates a convolution: output = f(W.im2col(input) + b)
+ *
+ * @param scratch Room for the im2col matrix of the layer
+ */
+static void forward_conv(const Layer* layer,
+                         const double* input,
+                         double* output,
+                         double* scratch) {
+  const size_t pixels = layer->out_height * layer->out_width;
+  const size_t patch = layer->in_channels * layer->kernel * layer->kernel;
+  im2col(layer, input, scratch);
+  for (size_t c = 0; c < layer->out_channels; c++) {
+    for (size_t p = 0; p < pixels; p++) {
+      output[c * pixels + p] = layer->biases[c];
     }
   }
-  for (size_t k = 0; k < network->nb_output; k++) {
-    if (fabs(network->output[k]) > threshold) {
-      output_dead = 0;
+  gemm(NO_TRANS, NO_TRANS, layer->out_channels, pixels, patch, 1.,
+       layer->weights, patch, scratch, pixels, 1., output, pixels);
+  layer_activate(&layer->kernels, layer->fct, output, layer->nb_output);
+}
+
+/**
+ * @brief Forward propagates a max pooling layer (window and stride of
+ * kernel, the last rows and columns being dropped if they do not fill a
+ * window)
+ */
+static void forward_maxpool(const Layer* layer,
+                            const double* input,
+                            double* output) {
+  const size_t k = layer->kernel;
+  for (size_t c = 0; c < layer->out_channels; c++) {
+    const double* channel = input + c * layer->in_height * layer->in_width;
+    for (size_t y = 0; y < layer->out_height; y++) {
+      for (size_t x = 0; x < layer->out_width; x++) {
+        const double* window = channel + y * k * layer->in_width + x * k;
+        double max = window[0];
+        for (size_t dy = 0; dy < k; dy++) {
+          for (size_t dx = 0; dx < k; dx++) {
+            if (window[dy * layer->in_width + dx] > max)
+              max = window[dy * layer->in_width + dx];
+          }
+        }
+        output[(c * layer->out_height + y) * layer->out_width + x] = max;
+      }
+    }
+  }
+}
+
+/**
+ * @brief Forward propagates one sample through one layer
+ *
+ * @param scratch Room for the im2col matrix of convolutions
+ */
+static void forward_layer(const Layer* layer,
+                          const double* input,
+                          double* output,
+                          double* scratch) {
+  switch (layer->type) {
+    case LAYER_DENSE:
+      if (layer->kernels.forward != NULL) {
+        (*layer->kernels.forward)(layer->weights, layer->biases, input, output,
+                                  layer->nb_input, layer->nb_output);
+      } else {
+        forward_generic(layer, input, output);
+      }
+      break;
+    case LAYER_CONV2D:
+      forward_conv(layer, input, output, scratch);
+      break;
+    case LAYER_MAXPOOL:
+      forward_maxpool(layer, input, output);
       break;
+  }
+}
+
+/**
+ * @brief Back propagates the gradients of the (activated) output of a layer to
+ * its input, before the derivative of the previous layer is applied
+ *
+ * @param layer The layer
+ * @param output The activations of the layer
+ * @param gradients The gradients of the layer, i.e. with its derivative
+ * applied
+ * @param input_gradients Where the gradients of the input are written
+ * @param scratch Room for the im2col matrix of convolutions and its gradients
+ */
+static void backward_layer(const Layer* layer,
+                           const double* input,
+                           const double* output,
+                           const double* gradients,
+                           double* input_gradients,
+                           double* scratch) {
+  memset(input_gradients, 0, layer->nb_input * sizeof(double));
+  if (layer->type == LAYER_DENSE) {
+    // Each neuron adds its gradient times its row of weights
+    for (size_t c = 0; c < layer->nb_output; c++) {
+      const double gradient = gradients[c];
+      const double* row = layer->weights + c * layer->nb_input;
+      for (size_t r = 0; r < layer->nb_input; r++) {
+        input_gradients[r] += gradient * row[r];
+      }
+    }
+  } else if (layer->type == LAYER_CONV2D) {
+    const size_t pixels = layer->out_height * layer->out_width;
+    const size_t patch = layer->in_channels * layer->kernel * layer->kernel;
+    double* gradient_columns = scratch + patch * pixels;
+    gemm(TRANS, NO_TRANS, patch, pixels, layer->out_channels, 1.,
+         layer->weights, patch, gradients, pixels, 0., gradient_columns,
+         pixels);
+    col2im(layer, gradient_columns, input_gradients);
+  } else {
+    // The gradient of a window goes to its (first) max
+    const size_t k = layer->kernel;
+    for (size_t c = 0; c < layer->out_channels; c++) {
+      const size_t offset = c * layer->in_height * layer->in_width;
+      for (size_t y = 0; y < layer->out_height; y++) {
+        for (size_t x = 0; x < layer->out_width; x++) {
+          size_t o = (c * layer->out_height + y) * layer->out_width + x;
+          size_t max = offset + y * k * layer->in_width + x * k;
+          for (size_t d = 0; d < k * k; d++) {
+            size_t i = max + (d / k) * layer->in_width + d % k;
+            if (input[i] == output[o]) {
+              input_gradients[i] += gradients[o];
+              break;
+            }
+          }
+        }
+      }
+    }
+  }
+}
+
+/**
+ * @brief Adds alpha times the gradients of the weights and biases of a layer
+ * (G.input^T and G) to weights and biases: the parameters of the layer
+ * themselves with plain SGD (alpha = -lr), the gradient lists of the
+ * optimizer otherwise
+ *
+ * @param scratch Room for the im2col matrix of convolutions
+ */
+static void accumulate_layer(const Layer* layer,
+                             const double* input,
+                             const double* gradients,
+                             double alpha,
+                             double* weights,
+                             double* biases,
+                             double* scratch) {
+  if (layer->type == LAYER_DENSE) {
+    // #pragma acc parallel loop
+    for (size_t c = 0; c < layer->nb_output; c++) {
+      if (gradients[c] == 0.)
+        continue;  // Inactive RELU neuron
+      const double neuron_alpha = alpha * gradients[c];
+      double* row = weights + c * layer->nb_input;
+      for (size_t r = 0; r < layer->nb_input; r++) {
+        row[r] += neuron_alpha * input[r];
+      }
+      biases[c] += neuron_alpha;
+    }
+  } else if (layer->type == LAYER_CONV2D) {
+    const size_t pixels = layer->out_height * layer->out_width;
+    const size_t patch = layer->in_channels * layer->kernel * layer->kernel;
+    im2col(layer, input, scratch);
+    gemm(NO_TRANS, TRANS, layer->out_channels, patch, pixels, alpha, gradients,
+         pixels, scratch, pixels, 1., weights, patch);
+    for (size_t c = 0; c < layer->out_channels; c++) {
+      double total = 0.;
+      for (size_t p = 0; p < pixels; p++) {
+        total += gradients[c * pixels + p];
+      }
+      biases[c] += alpha * total;
+    }
+  }
+}
+
+/**
+ * @brief Prepares the update of the parameters of a network (see
+ * accumulate_layer()): zeroes the gradient lists of the optimizer
+ *
+ * @return the factor of the gradients: -lr with plain SGD, 1 otherwise
+ */
+static double begin_update(NetworkTrainer* trainer,
+                           const Network* network,
+                           double lr) {
+  if (trainer->optimizer.type == OPTIMIZER_SGD)
+    return -lr;
+  for (size_t l = 0; l < network->nb_layers; l++) {
+    const Layer* layer = &network->layers[l];
+    if (trainer->parameter_gradients[l] != NULL) {
+      memset(trainer->parameter_gradients[l], 0,
+             (layer_nb_weights(layer) + layer_nb_biases(layer)) *
+                 sizeof(double));
     }
   }
+  return 1.;
+}
+
+/**
+ * @brief Returns where the gradients of the weights and biases of layer l
+ * are accumulated (see accumulate_layer())
+ */
+static void update_targets(const NetworkTrainer* trainer,
+                           Layer* layer,
+                           size_t l,
+                           double** weights,
+                           double** biases) {
+  if (trainer->optimizer.type == OPTIMIZER_SGD) {
+    *weights = layer->weights;
+    *biases = layer->biases;
+  } else {
+    *weights = trainer->parameter_gradients[l];
+    *biases = trainer->parameter_gradients[l] + layer_nb_weights(layer);
+  }
+}
+
+/**
+ * @brief Applies one optimizer step to a block of parameters, in a single
+ * pass updating the moments and the parameters together
+ *
+ * @param step_size Learning rate (bias corrected for Adam)
+ * @param epsilon Epsilon of Adam (bias corrected)
+ */
+static void optimizer_update(const Optimizer* optimizer,
+                             double step_size,
+                             double epsilon,
+                             double* restrict params,
+                             const double* restrict gradients,
+                             double* restrict first_moments,
+                             double* restrict second_moments,
+                             size_t size) {
+  const double beta1 = optimizer->beta1;
+  const double beta2 = optimizer->beta2;
+  switch (optimizer->type) {
+    case OPTIMIZER_MOMENTUM:
+      for (size_t i = 0; i < size; i++) {
+        first_moments[i] = beta1 * first_moments[i] + gradients[i];
+        params[i] -= step_size * first_moments[i];
+      }
+      break;
+    case OPTIMIZER_NESTEROV:
+      // Look-ahead form: the step uses the velocity after this update
+      for (size_t i = 0; i < size; i++) {
+        first_moments[i] = beta1 * first_moments[i] + gradients[i];
+        params[i] -= step_size * (gradients[i] + beta1 * first_moments[i]);
+      }
+      break;
+    case OPTIMIZER_ADAM:
+      for (size_t i = 0; i < size; i++) {
+        const double gradient = gradients[i];
+        first_moments[i] = beta1 * first_moments[i] + (1. - beta1) * gradient;
+        second_moments[i] =
+            beta2 * second_moments[i] + (1. - beta2) * gradient * gradient;
+        params[i] -= step_size * first_moments[i] /
+                     (sqrt(second_moments[i]) + epsilon);
+      }
+      break;
+    default:
+      for (size_t i = 0; i < size; i++) {
+        params[i] -= step_size * gradients[i];
+      }
+  }
+}
+
+/**
+ * @brief Ends the update started by begin_update(): applies the optimizer to
+ * the accumulated gradients (nothing to do with plain SGD)
+ */
+static void end_update(NetworkTrainer* trainer, Network* network, double lr) {
+  const Optimizer* optimizer = &trainer->optimizer;
+  if (optimizer->type == OPTIMIZER_SGD)
+    return;
+  trainer->nb_steps++;
+  double step_size = lr;
+  double epsilon = optimizer->epsilon;
+  if (optimizer->type == OPTIMIZER_ADAM) {
+    // Bias correction of the moments folded into the step size and epsilon
+    const double t = (double)trainer->nb_steps;
+    const double correction = sqrt(1. - pow(optimizer->beta2, t));
+    step_size = lr * correction / (1. - pow(optimizer->beta1, t));
+    epsilon *= correction;
+  }
+  for (size_t l = 0; l < network->nb_layers; l++) {
+    Layer* layer = &network->layers[l];
+    if (trainer->parameter_gradients[l] == NULL)
+      continue;
+    const size_t nb_weights = layer_nb_weights(layer);
+    const double* gradients = trainer->parameter_gradients[l];
+    double* first = trainer->first_moments[l];
+    double* second =
+        trainer->second_moments != NULL ? trainer->second_moments[l] : NULL;
+    optimizer_update(optimizer, step_size, epsilon, layer->weights, gradients,
+                     first, second, nb_weights);
+    optimizer_update(optimizer, step_size, epsilon, layer->biases,
+                     gradients + nb_weights, first + nb_weights,
+                     second != NULL ? second + nb_weights : NULL,
+                     layer_nb_biases(layer));
+  }
+}
+
+/**
+ * @brief Forward propagates (i.e predicts the result of) the input data.
+ * Result is stored in the output pointer list of the inference context, the
+ * network itself is only read so it can be shared between threads as long as
+ * each of them uses its own context.
+ *
+ * @param network A pointer to the neural network structure to perform the
+ * forward propagation.
+ * @param context A pointer to the inference context receiving the activations
+ * of every layer
+ * @param input A double pointer list of size equal to the input layer size
+ *
+ */
+void predict_nn_ctx(const Network* network,
+                    NetworkContext* context,
+                    const double* input) {
+  for (size_t l = 0; l < network->nb_layers; l++) {
+    const double* layer_input = l == 0 ? input : context->layers[l - 1];
+    forward_layer(&network->layers[l], layer_input, context->layers[l],
+                  context->scratch);
+  }
+}
+
+/**
+ * @brief Forward propagates the input data like predict_nn_ctx(), but leaves
+ * the output layer before its activation function: the output of the context
+ * holds the logits (biases + weights.input) instead of e.g. the softmax
+ * probabilities, whose argmax is the same for a softmax, sigmoid or tanh
+ * output. Saves the exponentials of the softmax when only the best outputs are
+ * needed.
+ *
+ * @param network A pointer to the neural network structure, whose output
+ * layer is dense
+ * @param context A pointer to the inference context receiving the activations
+ * of every layer and the logits
+ * @param input A double pointer list of size equal to the input layer size
+ */
+void predict_nn_logits(const Network* network,
+                       NetworkContext* context,
+                       const double* input) {
+  const size_t last = network->nb_layers - 1;
+  const Layer* output = &network->layers[last];
+  if (output->type != LAYER_DENSE)
+    errx(EXIT_FAILURE, "Logits need a dense output layer");
+  for (size_t l = 0; l < last; l++) {
+    const double* layer_input = l == 0 ? input : context->layers[l - 1];
+    forward_layer(&network->layers[l], layer_input, context->layers[l],
+                  context->scratch);
+  }
+  dense_accumulate(output->weights, output->biases,
+                   last == 0 ? input : context->layers[last - 1],
+                   context->layers[last], output->nb_input, output->nb_output);
+}
 
-  if (hidden_dead == 1) {
-    printf("\033[31m\033[1mHIDDEN LAYER DEAD\033[0m\n");
-  }
-  if (output_dead == 1) {
-    printf("\033[31m\033[1mOUT LAYER DEAD\033[0m\n");
+/**
+ * @brief Finishes the forward propagation of a sample whose first layer was
+ * computed by the caller up to its activation function (e.g. by a specialized
+ * input path, see sparse.c): activates the first layer, then propagates the
+ * next ones like predict_nn_ctx()
+ *
+ * @param network A pointer to the neural network structure
+ * @param context A pointer to the inference context, whose first layer holds
+ * the pre-activation biases + weights.input of the first layer
+ */
+void predict_nn_preactivated(const Network* network, NetworkContext* context) {
+  const Layer* first = &network->layers[0];
+  layer_activate(&first->kernels, first->fct, context->layers[0],
+                 first->nb_output);
+  for (size_t l = 1; l < network->nb_layers; l++) {
+    forward_layer(&network->layers[l], context->layers[l - 1],
+                  context->layers[l], context->scratch);
   }
 }
 
@@ -267,6 +1283,9 @@ void is_network_dead(const Network* network) {
  * @brief Forward propagates (i.e predicts the result of) the input data.
  * Result is stored in the output pointer list of the neural network struct
  *
+ * **NOTE**: Writes to the network struct, use predict_nn_ctx() when the
+ * network is shared between threads.
+ *
  * @param network A pointer to the neural network structure to perform the
  * forward propagation.
  *
@@ -274,65 +1293,7 @@ void is_network_dead(const Network* network) {
  *
  */
 void predict_nn(Network* network, double* input) {
-  // * NOTE: Parallelization fails when using function pointers
-  // #pragma acc kernels
-  {
-    // #pragma acc parallel loop
-    for (size_t i = 0; i < network->nb_hidden; i++) {
-      double total = 0;
-      // #pragma acc loop reduction(+ : total)
-      for (size_t j = 0; j < network->nb_input; j++) {
-        total += input[j] * network->hidden_weights[j * network->nb_hidden + i];
-      }
-      network->hidden[i] =
-          /*relu*/ (*network->hidden_fct)(total + network->hidden_biases[i]);
-    }
-
-    if (network->ouput_activation == SOFTMAX) {
-      // #pragma acc parallel loop
-      for (size_t i = 0; i < network->nb_output; i++) {
-        double total = 0.0;
-        // #pragma acc loop reduction(+ : total)
-        for (size_t j = 0; j < network->nb_hidden; j++) {
-          total += network->hidden[j] *
-                   network->output_weights[j * network->nb_output + i];
-        }
-        network->output[i] = total + network->output_biases[i];
-      }
-
-      double max_output = network->output[0];
-      for (size_t i = 0; i < network->nb_output; i++) {
-        if (network->output[i] > max_output) {
-          max_output = network->output[i];
-        }
-      }
-
-      double total = 0;
-      // #pragma acc parallel loop reduction(+ : total)
-      for (size_t i = 0; i < network->nb_output; i++) {
-        network->output[i] = exp(network->output[i] - max_output);
-        total += network->output[i];
-      }
-
-      // #pragma acc parallel loop
-      for (size_t i = 0; i < network->nb_output; i++) {
-        network->output[i] /= total;
-      }
-    } else {
-      // #pragma acc parallel loop
-      for (size_t i = 0; i < network->nb_output; i++) {
-        double total = 0;
-        // #pragma acc loop reduction(+ : total)
-        for (size_t j = 0; j < network->nb_hidden; j++) {
-          total += network->hidden[j] *
-                   network->output_weights[j * network->nb_output + i];
-        }
-
-        network->output[i] =
-            /*relu*/ (*network->output_fct)(total + network->output_biases[i]);
-      }
-    }
-  }
+  predict_nn_ctx(network, network->context, input);
 }
 
 /**
@@ -344,63 +1305,293 @@ void predict_nn(Network* network, double* input) {
  * input neurons
  * @param target A pointer used as a double list of size equal to the the size
  * of output layer. It represents the expected output of the given input
- * @param lr Learning rate. For RELU, and similar activation functions,
- * appropriate range is about 10^-4, otherwise between 0.1 and 1.
+ * @param lr Learning rate. With plain SGD and RELU, or similar activation
+ * functions, appropriate range is about 10^-4, otherwise between 0.1 and 1.
+ * Adam (see set_optimizer_nt()) usually works with about 10^-3.
+ *
+ * The forward pass goes to the trainer context (trainer->context->output holds
+ * the prediction of the sample afterwards), the network struct is only written
+ * to update weights and biases.
  */
 void train_nn(NetworkTrainer* trainer,
               Network* network,
               double* input,
               double* target,
               double lr) {
-  predict_nn(network, input);
+  NetworkContext* context = trainer->context;
+  const size_t last = network->nb_layers - 1;
+  predict_nn_ctx(network, context, input);
   // is_network_dead(network);
-  // * NOTE: Parallelization fails when using function pointers
-  // #pragma acc kernels
-  {
-    // #pragma acc parallel loop
-    for (size_t c = 0; c < network->nb_output; c++) {
-      if (network->ouput_activation == SOFTMAX)
-        trainer->gradients_errors_output[c] = network->output[c] - target[c];
-      else
-        trainer->gradients_errors_output[c] =
-            (network->output[c] - target[c]) * /*d_relu*/
-            (*network->d_output_fct)(network->output[c]);
-    }
-    // #pragma acc parallel loop
-    for (size_t r = 0; r < network->nb_hidden; r++) {
-      double sum = 0.0;
-      // #pragma acc loop reduction(+ : sum)
-      for (size_t c = 0; c < network->nb_output; c++) {
-        sum += trainer->gradients_errors_output[c] *
-               network->output_weights[r * network->nb_output + c];
-      }
 
-      trainer->gradients_errors_hidden[r] =
-          sum * (*network->d_hidden_fct) /*d_relu*/ (network->hidden[r]);
+  // Backward propagation, using the weights from before the update
+  // #pragma acc parallel loop
+  for (size_t c = 0; c < network->nb_output; c++) {
+    trainer->gradients[last][c] = context->output[c] - target[c];
+  }
+  layer_derivative(&network->layers[last].kernels,
+                   network->layers[last].d_fct, context->output,
+                   trainer->gradients[last], network->nb_output);
+  for (size_t l = last; l > 0; l--) {
+    const Layer* layer = &network->layers[l];
+    backward_layer(layer, context->layers[l - 1], context->layers[l],
+                   trainer->gradients[l], trainer->gradients[l - 1],
+                   context->scratch);
+    layer_derivative(&network->layers[l - 1].kernels,
+                     network->layers[l - 1].d_fct, context->layers[l - 1],
+                     trainer->gradients[l - 1], layer->nb_input);
+  }
+
+  const double alpha = begin_update(trainer, network, lr);
+  for (size_t l = 0; l < network->nb_layers; l++) {
+    const double* layer_input = l == 0 ? input : context->layers[l - 1];
+    double *weights, *biases;
+    update_targets(trainer, &network->layers[l], l, &weights, &biases);
+    accumulate_layer(&network->layers[l], layer_input, trainer->gradients[l],
+                     alpha, weights, biases, context->scratch);
+  }
+  end_update(trainer, network, lr);
+}
+
+/**
+ * @brief Forward propagates a batch of samples: each dense layer computes
+ * A = f(X.W^T + b), weights being stored output-major, the other layers are
+ * propagated sample by sample. Only reads the network.
+ *
+ * @param network A pointer to the neural network structure
+ * @param inputs Row-major matrix of batch_size rows of nb_input doubles
+ * @param batch_size Number of samples in the batch
+ * @param layers Row-major matrices (one per layer) of batch_size rows of the
+ * size of the layer, where the activations of each layer are written
+ * @param scratch Room for the im2col matrix of convolutions
+ */
+static void forward_batch(const Network* network,
+                          const double* inputs,
+                          size_t batch_size,
+                          double** layers,
+                          double* scratch) {
+  for (size_t l = 0; l < network->nb_layers; l++) {
+    const Layer* layer = &network->layers[l];
+    const double* layer_inputs = l == 0 ? inputs : layers[l - 1];
+    double* res = layers[l];
+    if (layer->type != LAYER_DENSE) {
+      for (size_t s = 0; s < batch_size; s++) {
+        forward_layer(layer, layer_inputs + s * layer->nb_input,
+                      res + s * layer->nb_output, scratch);
+      }
+      continue;
+    }
+    for (size_t s = 0; s < batch_size; s++) {
+      memcpy(res + s * layer->nb_output, layer->biases,
+             layer->nb_output * sizeof(double));
     }
-    // #pragma acc parallel loop collapse(2)
-    for (size_t r = 0; r < network->nb_hidden; r++) {
-      for (size_t c = 0; c < network->nb_output; c++) {
-        network->output_weights[r * network->nb_output + c] -=
-            lr * trainer->gradients_errors_output[c] * network->hidden[r];
+    gemm(NO_TRANS, TRANS, batch_size, layer->nb_output, layer->nb_input, 1.,
+         layer_inputs, layer->nb_input, layer->weights, layer->nb_input, 1.,
+         res, layer->nb_output);
+    if (layer->activation == SOFTMAX) {
+      for (size_t s = 0; s < batch_size; s++) {
+        layer_activate(&layer->kernels, layer->fct,
+                       res + s * layer->nb_output, layer->nb_output);
       }
+    } else {
+      layer_activate(&layer->kernels, layer->fct, res,
+                     batch_size * layer->nb_output);
     }
-    // #pragma acc parallel loop collapse(2)
-    for (size_t r = 0; r < network->nb_input; r++) {
-      for (size_t c = 0; c < network->nb_hidden; c++) {
-        network->hidden_weights[r * network->nb_hidden + c] -=
-            lr * trainer->gradients_errors_hidden[c] * input[r];
+  }
+}
+
+/**
+ * @brief Returns the buffers of batched inference of a network, reused from
+ * one call of predict_nn_batch_ctx() to the next. Like an inference context,
+ * a batch context is used by one thread at a time.
+ *
+ * **NOTE**: The struct should be freed using free_bc()
+ *
+ * @param network A pointer to the neural network structure
+ * @param tile Number of samples propagated together, 0 for PREDICT_TILE
+ * @return pointer to the batch context
+ */
+BatchContext* init_bc(const Network* network, size_t tile) {
+  BatchContext* context = malloc(sizeof(BatchContext));
+  if (context == NULL)
+    errx(EXIT_FAILURE, "Error while allocating memory");
+  context->nb_layers = network->nb_layers;
+  context->tile = tile > 0 ? tile : PREDICT_TILE;
+  context->layers = alloc_layer_lists(network, context->tile);
+  context->scratch = NULL;
+  size_t scratch_size = nn_scratch_size(network);
+  if (scratch_size > 0) {
+    context->scratch = calloc(scratch_size, sizeof(double));
+    if (context->scratch == NULL)
+      errx(EXIT_FAILURE, "Error while allocating memory");
+  }
+  return context;
+}
+
+/**
+ * @brief Frees a batch context
+ *
+ * @param context A pointer to the batch context to free
+ */
+void free_bc(BatchContext* context) {
+  free_layer_lists(context->layers, context->nb_layers);
+  free(context->scratch);
+  free(context);
+}
+
+/**
+ * @brief Forward propagates a batch of inputs without touching the network
+ * struct: results are written to a caller-owned buffer, so a loaded network
+ * can be shared. Samples are processed by tiles of the batch context so that
+ * each weight loaded in cache is reused across the whole tile, and each weight
+ * loaded in a register by 4 samples of the tile (see linalg.c).
+ *
+ * @param network A pointer to the neural network structure
+ * @param context A batch context of the network, see init_bc()
+ * @param inputs Row-major matrix of n rows of nb_input doubles
+ * @param n Number of samples to predict
+ * @param outputs Row-major matrix of n rows of nb_output doubles, where the
+ * output layer of each sample is written
+ */
+void predict_nn_batch_ctx(const Network* network,
+                          BatchContext* context,
+                          const double* inputs,
+                          size_t n,
+                          double* outputs) {
+  const size_t last = network->nb_layers - 1;
+  double* tile_output = context->layers[last];
+  for (size_t s = 0; s < n; s += context->tile) {
+    size_t count = n - s < context->tile ? n - s : context->tile;
+    // The output layer is written in place
+    context->layers[last] = outputs + s * network->nb_output;
+    forward_batch(network, inputs + s * network->nb_input, count,
+                  context->layers, context->scratch);
+  }
+  context->layers[last] = tile_output;
+}
+
+/**
+ * @brief Forward propagates a batch of inputs like predict_nn_batch_ctx(),
+ * with a batch context allocated for this call only
+ *
+ * @param network A pointer to the neural network structure
+ * @param inputs Row-major matrix of n rows of nb_input doubles
+ * @param n Number of samples to predict
+ * @param outputs Row-major matrix of n rows of nb_output doubles, where the
+ * output layer of each sample is written
+ */
+void predict_nn_batch(const Network* network,
+                      const double* inputs,
+                      size_t n,
+                      double* outputs) {
+  if (n == 0)
+    return;
+  BatchContext* context = init_bc(network, n < PREDICT_TILE ? n : 0);
+  predict_nn_batch_ctx(network, context, inputs, n, outputs);
+  free_bc(context);
+}
+
+/**
+ * @brief Makes sure the mini-batch scratch matrices of a trainer can hold
+ * batch_size samples of the specified network
+ */
+static void reserve_batch(NetworkTrainer* trainer,
+                          const Network* network,
+                          size_t batch_size) {
+  if (batch_size <= trainer->batch_capacity)
+    return;
+  free_layer_lists(trainer->batch_layers, network->nb_layers);
+  free_layer_lists(trainer->batch_gradients, network->nb_layers);
+  trainer->batch_layers = alloc_layer_lists(network, batch_size);
+  trainer->batch_gradients = alloc_layer_lists(network, batch_size);
+  trainer->batch_capacity = batch_size;
+}
+
+/**
+ * @brief Trains the specified neural network on a mini-batch of samples. The
+ * forward and backward passes of dense layers are computed as blocked
+ * matrix-matrix products over the whole batch and the weights are updated
+ * once, with the gradients averaged over the batch.
+ *
+ * @param trainer A pointer to the trainer structure
+ * @param network A pointer to the neural network structure to train
+ * @param inputs Row-major matrix of batch_size rows of nb_input doubles
+ * @param targets Row-major matrix of batch_size rows of nb_output doubles,
+ * expected output of each row of inputs
+ * @param batch_size Number of samples in the batch
+ * @param lr Learning rate. As the gradient is averaged, it can usually be
+ * larger than the one used with train_nn().
+ */
+void train_nn_batch(NetworkTrainer* trainer,
+                    Network* network,
+                    const double* inputs,
+                    const double* targets,
+                    size_t batch_size,
+                    double lr) {
+  if (batch_size == 0)
+    return;
+  reserve_batch(trainer, network, batch_size);
+
+  const size_t last = network->nb_layers - 1;
+  double** layers = trainer->batch_layers;
+  double** gradients = trainer->batch_gradients;
+  double* scratch = trainer->context->scratch;
+
+  forward_batch(network, inputs, batch_size, layers, scratch);
+
+  // Backward propagation, using the weights from before the update
+  for (size_t i = 0; i < batch_size * network->nb_output; i++) {
+    gradients[last][i] = layers[last][i] - targets[i];
+  }
+  layer_derivative(&network->layers[last].kernels,
+                   network->layers[last].d_fct, layers[last], gradients[last],
+                   batch_size * network->nb_output);
+  for (size_t l = last; l > 0; l--) {
+    const Layer* layer = &network->layers[l];
+    if (layer->type == LAYER_DENSE) {
+      gemm(NO_TRANS, NO_TRANS, batch_size, layer->nb_input, layer->nb_output,
+           1., gradients[l], layer->nb_output, layer->weights, layer->nb_input,
+           0., gradients[l - 1], layer->nb_input);
+    } else {
+      for (size_t s = 0; s < batch_size; s++) {
+        backward_layer(layer, layers[l - 1] + s * layer->nb_input,
+                       layers[l] + s * layer->nb_output,
+                       gradients[l] + s * layer->nb_output,
+                       gradients[l - 1] + s * layer->nb_input, scratch);
       }
     }
-    // #pragma acc parallel loop
-    for (size_t c = 0; c < network->nb_output; c++) {
-      network->output_biases[c] -= lr * trainer->gradients_errors_output[c];
+    layer_derivative(&network->layers[l - 1].kernels,
+                     network->layers[l - 1].d_fct, layers[l - 1],
+                     gradients[l - 1], batch_size * layer->nb_input);
+  }
+
+  // One accumulated update per batch of the gradients averaged over the
+  // batch, e.g. W -= lr / n * G^T.A with plain SGD
+  const double alpha =
+      begin_update(trainer, network, lr) / (double)batch_size;
+  for (size_t l = 0; l < network->nb_layers; l++) {
+    Layer* layer = &network->layers[l];
+    const double* layer_inputs = l == 0 ? inputs : layers[l - 1];
+    double *weights, *biases;
+    update_targets(trainer, layer, l, &weights, &biases);
+    if (layer->type != LAYER_DENSE) {
+      for (size_t s = 0; s < batch_size; s++) {
+        accumulate_layer(layer, layer_inputs + s * layer->nb_input,
+                         gradients[l] + s * layer->nb_output, alpha, weights,
+                         biases, scratch);
+      }
+      continue;
     }
-    // #pragma acc parallel loop
-    for (size_t c = 0; c < network->nb_hidden; c++) {
-      network->hidden_biases[c] -= lr * trainer->gradients_errors_hidden[c];
+    gemm(TRANS, NO_TRANS, layer->nb_output, layer->nb_input, batch_size,
+         alpha, gradients[l], layer->nb_output, layer_inputs, layer->nb_input,
+         1., weights, layer->nb_input);
+    for (size_t s = 0; s < batch_size; s++) {
+      const double* row = gradients[l] + s * layer->nb_output;
+      for (size_t c = 0; c < layer->nb_output; c++) {
+        biases[c] += alpha * row[c];
+      }
     }
   }
+  end_update(trainer, network, lr);
 }
 
 /**
@@ -409,50 +1600,86 @@ void train_nn(NetworkTrainer* trainer,
  * @param network A pointer to the neural network to print data from
  */
 void print_nn(const Network* network) {
-  printf("Hidden layer weights:\n");
-  for (size_t i = 0; i < network->nb_input; i++) {
-    printf("\tInput neuron %ld: ", i);
-    for (size_t j = 0; j < network->nb_hidden; j++) {
-      printf("%9.6f ", network->hidden_weights[network->nb_input * i + j]);
+  for (size_t l = 0; l < network->nb_layers; l++) {
+    const Layer* layer = &network->layers[l];
+    if (layer->type == LAYER_MAXPOOL) {
+      printf("Layer %ld: max pooling %ldx%ld\n\n", l, layer->kernel,
+             layer->kernel);
+      continue;
+    }
+    if (layer->type == LAYER_CONV2D) {
+      const size_t patch = layer->in_channels * layer->kernel * layer->kernel;
+      printf("Layer %ld weights (%ldx%ld convolution):\n", l, layer->kernel,
+             layer->kernel);
+      for (size_t c = 0; c < layer->out_channels; c++) {
+        printf("\tOutput channel %ld: ", c);
+        for (size_t i = 0; i < patch; i++) {
+          printf("%9.6f ", layer->weights[c * patch + i]);
+        }
+        printf("\n");
+      }
+      printf("\n");
+      continue;
+    }
+    printf("Layer %ld weights:\n", l);
+    for (size_t i = 0; i < layer->nb_input; i++) {
+      printf("\tInput neuron %ld: ", i);
+      for (size_t j = 0; j < layer->nb_output; j++) {
+        printf("%9.6f ", layer->weights[j * layer->nb_input + i]);
+      }
+
+      printf("\n");
     }
 
     printf("\n");
   }
 
-  printf("\n");
-
-  printf("Output layer weights:\n");
-  for (size_t i = 0; i < network->nb_hidden; i++) {
-    printf("\tHidden neuron %ld: ", i);
-
-    for (size_t j = 0; j < network->nb_output; j++) {
-      printf("%9.6f ", network->output_weights[i * network->nb_output + j]);
+  for (size_t l = 0; l < network->nb_layers; l++) {
+    const Layer* layer = &network->layers[l];
+    if (layer->type == LAYER_MAXPOOL)
+      continue;
+    printf("Biases of layer %ld:\n\t", l);
+    for (size_t i = 0; i < layer_nb_biases(layer); i++) {
+      printf("%9.6f ", layer->biases[i]);
     }
-
     printf("\n");
   }
-  printf("Biases of hidden layer:\n\t");
-  for (size_t i = 0; i < network->nb_hidden; i++) {
-    printf("%9.6f ", network->hidden_biases[i]);
-  }
-  printf("\n");
+}
 
-  printf("Biases of output layer:\n\t");
-  for (size_t i = 0; i < network->nb_output; i++) {
-    printf("%9.6f ", network->output_biases[i]);
+/**
+ * @brief Writes the weights then the biases of a layer, as two lines of values
+ * separated by ';'. Dense weights are written input-major (the weights of the
+ * first input to every neuron, then of the second input, etc.), convolution
+ * weights in their stored order. Pooling layers write nothing.
+ */
+static void write_layer_text(FILE* file, const Layer* layer) {
+  if (layer->type == LAYER_MAXPOOL)
+    return;
+  if (layer->type == LAYER_CONV2D) {
+    for (size_t i = 0; i < layer_nb_weights(layer); i++) {
+      fprintf(file, "%9.12f;", layer->weights[i]);
+    }
+  } else {
+    for (size_t j = 0; j < layer->nb_input; j++) {
+      for (size_t i = 0; i < layer->nb_output; i++) {
+        fprintf(file, "%9.12f;", layer->weights[i * layer->nb_input + j]);
+      }
+    }
   }
-
-  printf("\n");
+  fprintf(file, "\n");
+  for (size_t i = 0; i < layer_nb_biases(layer); i++) {
+    fprintf(file, "%9.12f;", layer->biases[i]);
+  }
+  fprintf(file, "\n");
 }
 
 /**
- * @brief Saves the neural network data to a file.
+ * @brief Saves the neural network data to a text file (export format, see
+ * save_nn_binary() for the faster binary format).
  *
  * This function saves the structure and weights of the neural network to a
- * specified file. The file will contain the number of inputs, hidden neurons,
- * and outputs, followed by the weights of the hidden layer.
- *
- * The file will look like this (where Ln is the line number n):
+ * specified file. Networks with one dense hidden layer are saved in the
+ * original format, which will look like this (where Ln is the line number n):
  *
  * * L1: Hidden activation function
  *
@@ -464,14 +1691,22 @@ void print_nn(const Network* network) {
  *
  * * L5: Number of output neurons
  *
- * * L6: Hidden layer weights (separated by ';')
+ * * L6: Hidden layer weights (separated by ';'), input-major: the weights of
+ * the first input to every hidden neuron, then of the second input, etc.
  *
  * * L7: Hidden layer biases (separated by ';')
  *
- * * L8: Output layer weights (separated by ';')
+ * * L8: Output layer weights (separated by ';'), input-major as well
  *
  * * L9: Output layer biases (separated by ';')
  *
+ * Other networks start with a line "layers N" followed by the number of input
+ * neurons (or "channels height width" when the first layer is not dense), then
+ * one line per layer: "activation size" for dense layers, "conv activation
+ * channels kernel" for convolutions and "maxpool window" for pooling layers.
+ * The weights and biases lines of each layer follow, as above (convolution
+ * weights are written in the order of Layer, pooling layers have none).
+ *
  * @param network A pointer to the neural network structure containing the data
  * to be saved.
  * @param path The file path where the neural network data will be saved.
@@ -482,101 +1717,555 @@ void save_nn_data(const Network* network, const char* path) {
   if (fptr == NULL)
     errx(EXIT_FAILURE, "Error while opening file to save config");
 
-  fprintf(fptr, "%d\n%d\n%ld\n%ld\n%ld\n", network->hidden_activation,
-          network->ouput_activation, network->nb_input, network->nb_hidden,
-          network->nb_output);
-
-  for (size_t i = 0; i < network->nb_input * network->nb_hidden; i++) {
-    fprintf(fptr, "%9.12f;", network->hidden_weights[i]);
+  const Layer* first = &network->layers[0];
+  if (network->nb_layers == 2 && first->type == LAYER_DENSE &&
+      network->layers[1].type == LAYER_DENSE) {
+    fprintf(fptr, "%d\n%d\n%ld\n%ld\n%ld\n", network->layers[0].activation,
+            network->layers[1].activation, network->nb_input,
+            network->layers[0].nb_output, network->nb_output);
+  } else {
+    fprintf(fptr, "layers %ld\n", network->nb_layers);
+    if (first->type == LAYER_DENSE) {
+      fprintf(fptr, "%ld\n", network->nb_input);
+    } else {
+      fprintf(fptr, "%ld %ld %ld\n", first->in_channels, first->in_height,
+              first->in_width);
+    }
+    for (size_t l = 0; l < network->nb_layers; l++) {
+      const Layer* layer = &network->layers[l];
+      if (layer->type == LAYER_CONV2D) {
+        fprintf(fptr, "conv %d %ld %ld\n", layer->activation,
+                layer->out_channels, layer->kernel);
+      } else if (layer->type == LAYER_MAXPOOL) {
+        fprintf(fptr, "maxpool %ld\n", layer->kernel);
+      } else {
+        fprintf(fptr, "%d %ld\n", layer->activation, layer->nb_output);
+      }
+    }
   }
-  fprintf(fptr, "\n");
-  for (size_t i = 0; i < network->nb_hidden; i++) {
-    fprintf(fptr, "%9.12f;", network->hidden_biases[i]);
+  for (size_t l = 0; l < network->nb_layers; l++) {
+    write_layer_text(fptr, &network->layers[l]);
   }
-  fprintf(fptr, "\n");
-  for (size_t i = 0; i < network->nb_hidden * network->nb_output; i++) {
-    fprintf(fptr, "%9.12f;", network->output_weights[i]);
+  fclose(fptr);
+}
+
+/**
+ * @brief Reads the weights and biases of a layer written by
+ * write_layer_text(), transposing dense weights to the output-major layout
+ *
+ * @return 1 on success, 0 on parsing error
+ */
+static int read_layer_text(FILE* file, Layer* layer) {
+  if (layer->type == LAYER_MAXPOOL)
+    return 1;
+  for (size_t i = 0; i < layer_nb_weights(layer); i++) {
+    double* weight = &layer->weights[i];
+    if (layer->type == LAYER_DENSE) {
+      size_t j = i / layer->nb_output;
+      size_t h = i % layer->nb_output;
+      weight = &layer->weights[h * layer->nb_input + j];
+    }
+    if (fscanf(file, "%lf;", weight) != 1) {
+      return 0;
+    }
   }
-  fprintf(fptr, "\n");
-  for (size_t i = 0; i < network->nb_output; i++) {
-    fprintf(fptr, "%9.12f;", network->output_biases[i]);
+  fscanf(file, "%*[\n;]");
+  for (size_t i = 0; i < layer_nb_biases(layer); i++) {
+    if (fscanf(file, "%lf;", &layer->biases[i]) != 1) {
+      return 0;
+    }
   }
-  fprintf(fptr, "\n");
-  fclose(fptr);
+  fscanf(file, "%*[\n;]");
+  return 1;
+}
+
+/**
+ * @brief Parses one layer line of the header of the text format (see
+ * save_nn_data())
+ *
+ * @return 1 on success, 0 on parsing error
+ */
+static int parse_layer_spec(const char* line, LayerSpec* spec) {
+  long int activation, size, kernel;
+  memset(spec, 0, sizeof(LayerSpec));
+  if (sscanf(line, "conv %ld %ld %ld", &activation, &size, &kernel) == 3) {
+    spec->type = LAYER_CONV2D;
+  } else if (sscanf(line, "maxpool %ld", &kernel) == 1) {
+    spec->type = LAYER_MAXPOOL;
+    activation = 0;
+    size = 1;
+  } else if (sscanf(line, "%ld %ld", &activation, &size) == 2) {
+    spec->type = LAYER_DENSE;
+    kernel = 0;
+  } else {
+    return 0;
+  }
+  if (activation < 0 || size <= 0 || kernel < 0)
+    return 0;
+  spec->activation = activation;
+  spec->size = size;
+  spec->kernel = kernel;
+  return 1;
 }
 
 /**
- * @brief Loads the neural network data from a file.
+ * @brief Loads the neural network data from a text file.
  *
  * This function loads the structure and weights of a neural network from a
- * specified file generated by the above function.
+ * specified file generated by the above function. Weights are transposed from
+ * the input-major layout of the file to the output-major layout of Network.
  *
- * @param network A pointer to the neural network structure which has been
- * previously initialized
  * @param path The file path where the neural network data has been saved.
  * @return pointer to loaded neural network struct
  */
-Network* load_nn_data(const char* path) {
+Network* load_nn_text(const char* path) {
   FILE* file = fopen(path, "r");
   if (!file) {
     errx(EXIT_FAILURE, "Error opening file");
   }
 
-  long int act_hidden, act_output, input_layer_size_, n_hidden_, n_output_;
-  if (fscanf(file, "%ld\n%ld\n%ld\n%ld\n%ld\n", &act_hidden, &act_output,
-             &input_layer_size_, &n_hidden_, &n_output_) != 5) {
-    fclose(file);
-    errx(EXIT_FAILURE, "Parsing NN confing failed\n");
-  }
-  if (act_hidden < 0 || act_output < 0 || n_hidden_ <= 0 ||
-      input_layer_size_ <= 0 || n_output_ <= 0) {
-    errx(EXIT_FAILURE, "Inavlid NN confing");
+  Network* network;
+  long int nb_layers_;
+  if (fscanf(file, "layers %ld\n", &nb_layers_) == 1) {
+    char line[128];
+    long int channels = 1, height = 1, width = 1;
+    if (nb_layers_ <= 0 || fgets(line, sizeof(line), file) == NULL ||
+        sscanf(line, "%ld %ld %ld", &channels, &height, &width) < 1 ||
+        channels <= 0 || height <= 0 || width <= 0) {
+      fclose(file);
+      errx(EXIT_FAILURE, "Parsing NN confing failed\n");
+    }
+    size_t nb_layers = nb_layers_;
+    LayerSpec* specs = calloc(nb_layers, sizeof(LayerSpec));
+    if (specs == NULL)
+      errx(EXIT_FAILURE, "Memory allocation failed");
+    for (size_t l = 0; l < nb_layers; l++) {
+      if (fgets(line, sizeof(line), file) == NULL ||
+          !parse_layer_spec(line, &specs[l])) {
+        fclose(file);
+        errx(EXIT_FAILURE, "Inavlid NN confing");
+      }
+    }
+    network = init_nn_spec(channels, height, width, nb_layers, specs);
+    free(specs);
+  } else {
+    long int act_hidden, act_output, input_layer_size_, n_hidden_, n_output_;
+    if (fscanf(file, "%ld\n%ld\n%ld\n%ld\n%ld\n", &act_hidden, &act_output,
+               &input_layer_size_, &n_hidden_, &n_output_) != 5) {
+      fclose(file);
+      errx(EXIT_FAILURE, "Parsing NN confing failed\n");
+    }
+    if (act_hidden < 0 || act_output < 0 || n_hidden_ <= 0 ||
+        input_layer_size_ <= 0 || n_output_ <= 0) {
+      errx(EXIT_FAILURE, "Inavlid NN confing");
+    }
+    network = init_nn(input_layer_size_, n_hidden_, n_output_, act_hidden,
+                      act_output);
   }
-  size_t input_layer_size = input_layer_size_;
-  size_t hidden_layer_size = n_hidden_;
-  size_t output_layer_size = n_output_;
 
-  Network* network = init_nn(input_layer_size, hidden_layer_size,
-                             output_layer_size, act_hidden, act_output);
-
-  for (size_t i = 0; i < input_layer_size * hidden_layer_size; i++) {
-    if (fscanf(file, "%lf;", &network->hidden_weights[i]) != 1) {
+  for (size_t l = 0; l < network->nb_layers; l++) {
+    if (!read_layer_text(file, &network->layers[l])) {
       free_nn(network);
-      errx(EXIT_FAILURE, "Error while parsing WH at %ld", i);
+      fclose(file);
+      errx(EXIT_FAILURE, "Error while parsing layer %ld", l);
     }
   }
-  fscanf(file, "%*[\n;]");
-  for (size_t i = 0; i < hidden_layer_size; i++) {
-    if (fscanf(file, "%lf;", &network->hidden_biases[i]) != 1) {
-      free_nn(network);
-      errx(EXIT_FAILURE, "Error while parsing BH at %ld", i);
+  fclose(file);
+  return network;
+}
+
+/**
+ * Binary model format (version 1), in little-endian byte order:
+ *
+ * * A 64 bytes NetworkFileHeader
+ *
+ * * One 64 bytes NetworkFileLayer descriptor per layer (from the first hidden
+ * layer to the output layer)
+ *
+ * * For each layer, its weights then its biases as doubles, each block
+ * starting at an offset aligned on NN_BINARY_ALIGN bytes
+ *
+ * The checksum is the 64 bits FNV-1a hash of the bytes after the header, up to
+ * file_size. Bytes after file_size are ignored (training checkpoints append
+ * their state there, see checkpoint.c). Blocks being aligned, load_nn_binary()
+ * maps the file and points the weights of the network directly at the mapping.
+ * Weights are stored output-major, the layout of Network.
+ */
+#define NN_BINARY_MAGIC "OCRNNBIN"
+#define NN_BINARY_VERSION 1
+#define NN_BINARY_ALIGN 64
+#define NN_DTYPE_F64 1
+#define NN_LAYOUT_OUTPUT_MAJOR 1
+
+typedef struct NetworkFileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t dtype;
+  uint32_t nb_layers;
+  uint32_t reserved_0;
+  uint64_t file_size;
+  uint64_t checksum;
+  uint8_t reserved_1[24];
+} NetworkFileHeader;
+
+typedef struct NetworkFileLayer {
+  uint64_t nb_input;
+  uint64_t nb_output;
+  uint32_t activation;
+  uint32_t layout;
+  uint64_t weights_offset;
+  uint64_t biases_offset;
+  uint32_t type;
+  uint32_t kernel;
+  uint32_t in_channels;
+  uint32_t in_height;
+  uint32_t in_width;
+  uint32_t out_channels;
+} NetworkFileLayer;
+
+_Static_assert(sizeof(NetworkFileHeader) == 64, "Invalid header size");
+_Static_assert(sizeof(NetworkFileLayer) == 64, "Invalid layer size");
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "The binary model format is only supported on little-endian hosts"
+#endif
+
+static uint64_t fnv1a(uint64_t hash, const void* data, size_t size) {
+  const unsigned char* bytes = data;
+  for (size_t i = 0; i < size; i++) {
+    hash ^= bytes[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+#define FNV1A_INIT 0xcbf29ce484222325ULL
+
+static uint64_t align_offset(uint64_t offset) {
+  return (offset + NN_BINARY_ALIGN - 1) / NN_BINARY_ALIGN * NN_BINARY_ALIGN;
+}
+
+/**
+ * @brief Writes the neural network data in the binary format (see above) at
+ * the current position of a stream
+ *
+ * @param network A pointer to the neural network structure containing the data
+ * to be saved.
+ * @param file The stream, opened for writing
+ */
+void write_nn_binary(const Network* network, FILE* file) {
+  const size_t nb_layers = network->nb_layers;
+  const size_t nb_blocks = 2 * nb_layers;
+  NetworkFileLayer* layers = calloc(nb_layers, sizeof(NetworkFileLayer));
+  uint64_t* offsets = calloc(nb_blocks, sizeof(uint64_t));
+  if (layers == NULL || offsets == NULL)
+    errx(EXIT_FAILURE, "Memory allocation failed");
+
+  // Blocks are the weights then the biases of each layer
+  const uint64_t layers_size = nb_layers * sizeof(NetworkFileLayer);
+  uint64_t offset = sizeof(NetworkFileHeader) + layers_size;
+  for (size_t l = 0; l < nb_layers; l++) {
+    const Layer* layer = &network->layers[l];
+    layers[l].nb_input = layer->nb_input;
+    layers[l].nb_output = layer->nb_output;
+    layers[l].activation = layer->activation;
+    layers[l].layout = NN_LAYOUT_OUTPUT_MAJOR;
+    layers[l].type = layer->type;
+    layers[l].kernel = layer->kernel;
+    layers[l].in_channels = layer->in_channels;
+    layers[l].in_height = layer->in_height;
+    layers[l].in_width = layer->in_width;
+    layers[l].out_channels = layer->out_channels;
+    offsets[2 * l] = align_offset(offset);
+    offset = offsets[2 * l] + layer_nb_weights(layer) * sizeof(double);
+    offsets[2 * l + 1] = align_offset(offset);
+    offset = offsets[2 * l + 1] + layer_nb_biases(layer) * sizeof(double);
+    layers[l].weights_offset = offsets[2 * l];
+    layers[l].biases_offset = offsets[2 * l + 1];
+  }
+
+  NetworkFileHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, NN_BINARY_MAGIC, sizeof(header.magic));
+  header.version = NN_BINARY_VERSION;
+  header.dtype = NN_DTYPE_F64;
+  header.nb_layers = nb_layers;
+  header.file_size = offset;
+
+  // The hash covers the padding as well, which is written as zeros
+  static const char padding[NN_BINARY_ALIGN] = {0};
+  uint64_t hash = fnv1a(FNV1A_INIT, layers, layers_size);
+  offset = sizeof(NetworkFileHeader) + layers_size;
+  for (size_t b = 0; b < nb_blocks; b++) {
+    const Layer* layer = &network->layers[b / 2];
+    const double* block = b % 2 == 0 ? layer->weights : layer->biases;
+    size_t block_size =
+        b % 2 == 0 ? layer_nb_weights(layer) : layer_nb_biases(layer);
+    hash = fnv1a(hash, padding, offsets[b] - offset);
+    hash = fnv1a(hash, block, block_size * sizeof(double));
+    offset = offsets[b] + block_size * sizeof(double);
+  }
+  header.checksum = hash;
+
+  if (fwrite(&header, sizeof(header), 1, file) != 1 ||
+      fwrite(layers, sizeof(NetworkFileLayer), nb_layers, file) != nb_layers) {
+    errx(EXIT_FAILURE, "Error while writing binary model");
+  }
+  offset = sizeof(NetworkFileHeader) + layers_size;
+  for (size_t b = 0; b < nb_blocks; b++) {
+    const Layer* layer = &network->layers[b / 2];
+    const double* block = b % 2 == 0 ? layer->weights : layer->biases;
+    size_t block_size =
+        b % 2 == 0 ? layer_nb_weights(layer) : layer_nb_biases(layer);
+    // Max pooling layers have no parameters, and NULL blocks
+    if (fwrite(padding, 1, offsets[b] - offset, file) != offsets[b] - offset ||
+        (block_size > 0 &&
+         fwrite(block, sizeof(double), block_size, file) != block_size)) {
+      errx(EXIT_FAILURE, "Error while writing binary model");
     }
+    offset = offsets[b] + block_size * sizeof(double);
   }
-  fscanf(file, "%*[\n;]");
-  for (size_t i = 0; i < hidden_layer_size * output_layer_size; i++) {
-    if (fscanf(file, "%lf;", &network->output_weights[i]) != 1) {
-      free_nn(network);
-      errx(EXIT_FAILURE, "Error while parsing WO at %ld", i);
+  free(layers);
+  free(offsets);
+}
+
+/**
+ * @brief Saves the neural network data to a binary file (see the format above)
+ *
+ * @param network A pointer to the neural network structure containing the data
+ * to be saved.
+ * @param path The file path where the neural network data will be saved.
+ */
+void save_nn_binary(const Network* network, const char* path) {
+  FILE* file = fopen(path, "wb");
+  if (file == NULL)
+    errx(EXIT_FAILURE, "Error while opening file to save config");
+  write_nn_binary(network, file);
+  if (fclose(file) != 0)
+    errx(EXIT_FAILURE, "Error while writing binary model");
+}
+
+/**
+ * @brief Checks that a block of count doubles at offset lies inside the file
+ */
+static int valid_block(uint64_t offset, uint64_t count, uint64_t file_size) {
+  return offset % NN_BINARY_ALIGN == 0 && offset <= file_size &&
+         count <= (file_size - offset) / sizeof(double);
+}
+
+/**
+ * @brief Loads a neural network from a binary file generated by
+ * save_nn_binary(). The file is memory mapped (privately, so training the
+ * loaded network does not modify the file) and the weights and biases of the
+ * network point directly into the mapping: nothing is parsed or copied.
+ *
+ * @param path The file path where the neural network data has been saved.
+ * @return pointer to loaded neural network struct
+ */
+Network* load_nn_binary(const char* path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    errx(EXIT_FAILURE, "Error opening file");
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(NetworkFileHeader)) {
+    close(fd);
+    errx(EXIT_FAILURE, "Invalid binary model file");
+  }
+  NetworkFileHeader file_header;
+  if (pread(fd, &file_header, sizeof(file_header), 0) !=
+          (ssize_t)sizeof(file_header) ||
+      file_header.file_size < sizeof(NetworkFileHeader) ||
+      file_header.file_size > (uint64_t)st.st_size) {
+    close(fd);
+    errx(EXIT_FAILURE, "Unsupported binary model file");
+  }
+  // Only the model is mapped, not the bytes following it
+  size_t size = file_header.file_size;
+  unsigned char* mapping =
+      mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED)
+    err(EXIT_FAILURE, "Error while mapping model file");
+
+  const NetworkFileHeader* header = (const NetworkFileHeader*)mapping;
+  const size_t nb_layers = header->nb_layers;
+  if (memcmp(header->magic, NN_BINARY_MAGIC, sizeof(header->magic)) != 0 ||
+      header->version != NN_BINARY_VERSION ||
+      header->dtype != NN_DTYPE_F64 || nb_layers == 0 ||
+      nb_layers > (size - sizeof(NetworkFileHeader)) /
+                      sizeof(NetworkFileLayer)) {
+    munmap(mapping, size);
+    errx(EXIT_FAILURE, "Unsupported binary model file");
+  }
+  if (fnv1a(FNV1A_INIT, mapping + sizeof(NetworkFileHeader),
+            size - sizeof(NetworkFileHeader)) != header->checksum) {
+    munmap(mapping, size);
+    errx(EXIT_FAILURE, "Binary model file is corrupted (checksum mismatch)");
+  }
+
+  const NetworkFileLayer* layers =
+      (const NetworkFileLayer*)(mapping + sizeof(NetworkFileHeader));
+  LayerSpec* specs = calloc(nb_layers, sizeof(LayerSpec));
+  if (specs == NULL)
+    errx(EXIT_FAILURE, "Memory allocation failed");
+  for (size_t l = 0; l < nb_layers; l++) {
+    if (layers[l].nb_input == 0 || layers[l].nb_output == 0 ||
+        layers[l].layout != NN_LAYOUT_OUTPUT_MAJOR ||
+        layers[l].type > LAYER_MAXPOOL ||
+        layers[l].nb_input > SIZE_MAX / layers[l].nb_output) {
+      munmap(mapping, size);
+      errx(EXIT_FAILURE, "Invalid binary model layer");
     }
+    specs[l].type = layers[l].type;
+    specs[l].size = layers[l].type == LAYER_DENSE ? layers[l].nb_output
+                                                  : layers[l].out_channels;
+    specs[l].kernel = layers[l].kernel;
+    specs[l].activation = layers[l].activation;
   }
-  fscanf(file, "%*[\n;]");
-  for (size_t i = 0; i < output_layer_size; i++) {
-    if (fscanf(file, "%lf;", &network->output_biases[i]) != 1) {
+
+  Network* network = alloc_nn(layers[0].in_channels, layers[0].in_height,
+                              layers[0].in_width, nb_layers, specs);
+  free(specs);
+  for (size_t l = 0; l < nb_layers; l++) {
+    const Layer* layer = &network->layers[l];
+    if (layers[l].nb_input != layer->nb_input ||
+        layers[l].nb_output != layer->nb_output ||
+        !valid_block(layers[l].weights_offset, layer_nb_weights(layer),
+                     size) ||
+        !valid_block(layers[l].biases_offset, layer_nb_biases(layer), size)) {
       free_nn(network);
-      errx(EXIT_FAILURE, "Error while parsing BO at %ld", i);
+      munmap(mapping, size);
+      errx(EXIT_FAILURE, "Invalid binary model layer");
     }
   }
-  fscanf(file, "%*[\n;]");
-  fclose(file);
+  for (size_t l = 0; l < nb_layers; l++) {
+    if (network->layers[l].type == LAYER_MAXPOOL)
+      continue;
+    network->layers[l].weights = (double*)(mapping + layers[l].weights_offset);
+    network->layers[l].biases = (double*)(mapping + layers[l].biases_offset);
+  }
+  network->mapping = mapping;
+  network->mapping_size = size;
   return network;
 }
 
+/**
+ * @brief Loads the neural network data from a file saved either by
+ * save_nn_binary() or by save_nn_data() (text format), depending on its first
+ * bytes.
+ *
+ * @param path The file path where the neural network data has been saved.
+ * @return pointer to loaded neural network struct
+ */
+Network* load_nn_data(const char* path) {
+  FILE* file = fopen(path, "rb");
+  if (!file) {
+    errx(EXIT_FAILURE, "Error opening file");
+  }
+  char magic[sizeof(NN_BINARY_MAGIC) - 1];
+  size_t read = fread(magic, 1, sizeof(magic), file);
+  fclose(file);
+  if (read == sizeof(magic) && memcmp(magic, NN_BINARY_MAGIC, read) == 0)
+    return load_nn_binary(path);
+  return load_nn_text(path);
+}
+
+/**
+ * Optimizer state of a trainer, as written by write_nt_state(): this header,
+ * then for each layer with parameters its first moments, then for each layer
+ * its second moments (Adam only), as doubles laid out as the parameters
+ */
+typedef struct TrainerFileHeader {
+  uint32_t optimizer;
+  uint32_t nb_layers;
+  uint64_t nb_steps;
+  double beta1;
+  double beta2;
+  double epsilon;
+  uint8_t reserved[24];
+} TrainerFileHeader;
+
+_Static_assert(sizeof(TrainerFileHeader) == 64, "Invalid header size");
+
+/**
+ * @brief Writes the optimizer state of a trainer (see above) at the current
+ * position of a stream, to resume training later with read_nt_state()
+ *
+ * @param trainer A pointer to the trainer structure
+ * @param network A pointer to the neural network structure it trains
+ * @param file The stream, opened for writing
+ */
+void write_nt_state(const NetworkTrainer* trainer,
+                    const Network* network,
+                    FILE* file) {
+  TrainerFileHeader header;
+  memset(&header, 0, sizeof(header));
+  header.optimizer = trainer->optimizer.type;
+  header.nb_layers = network->nb_layers;
+  header.nb_steps = trainer->nb_steps;
+  header.beta1 = trainer->optimizer.beta1;
+  header.beta2 = trainer->optimizer.beta2;
+  header.epsilon = trainer->optimizer.epsilon;
+  if (fwrite(&header, sizeof(header), 1, file) != 1)
+    errx(EXIT_FAILURE, "Error while writing trainer state");
+  double** moments[2] = {trainer->first_moments, trainer->second_moments};
+  for (size_t m = 0; m < 2; m++) {
+    if (moments[m] == NULL)
+      continue;
+    for (size_t l = 0; l < network->nb_layers; l++) {
+      const Layer* layer = &network->layers[l];
+      size_t size = layer_nb_weights(layer) + layer_nb_biases(layer);
+      if (size > 0 && fwrite(moments[m][l], sizeof(double), size, file) != size)
+        errx(EXIT_FAILURE, "Error while writing trainer state");
+    }
+  }
+}
+
+/**
+ * @brief Restores the optimizer state written by write_nt_state(): selects
+ * the same optimizer (see set_optimizer_nt()) and reads its moments
+ *
+ * @param trainer A pointer to the trainer structure
+ * @param network A pointer to the neural network structure it trains, the
+ * same as when the state was written
+ * @param file The stream, positioned at the state
+ */
+void read_nt_state(NetworkTrainer* trainer,
+                   const Network* network,
+                   FILE* file) {
+  TrainerFileHeader header;
+  if (fread(&header, sizeof(header), 1, file) != 1 ||
+      header.optimizer > OPTIMIZER_ADAM ||
+      header.nb_layers != network->nb_layers)
+    errx(EXIT_FAILURE, "Invalid trainer state");
+  const Optimizer optimizer = {header.optimizer, header.beta1, header.beta2,
+                               header.epsilon};
+  set_optimizer_nt(trainer, network, &optimizer);
+  trainer->nb_steps = header.nb_steps;
+  double** moments[2] = {trainer->first_moments, trainer->second_moments};
+  for (size_t m = 0; m < 2; m++) {
+    if (moments[m] == NULL)
+      continue;
+    for (size_t l = 0; l < network->nb_layers; l++) {
+      const Layer* layer = &network->layers[l];
+      size_t size = layer_nb_weights(layer) + layer_nb_biases(layer);
+      if (size > 0 && fread(moments[m][l], sizeof(double), size, file) != size)
+        errx(EXIT_FAILURE, "Invalid trainer state");
+    }
+  }
+}
+
 /**
  * @brief Prints a graphviz representation of the neural network for debugging
  *
  * @param network A pointer to the neural network structure to print
  */
 void print_graphviz(const Network* net) {
+  for (size_t l = 0; l < net->nb_layers; l++) {
+    if (net->layers[l].type != LAYER_DENSE) {
+      printf("// Only networks of dense layers can be drawn\n");
+      return;
+    }
+  }
   printf("digraph NeuralNetwork {\n");
   printf("    rankdir=LR;\n");
   printf("    splines=false;\n");
@@ -585,44 +2274,39 @@ void print_graphviz(const Network* net) {
   printf("        label=\"Input Layer\";\n");
   for (size_t i = 0; i < net->nb_input; i++) {
     printf(
-        "        input%ld [label=\"Input %ld\", shape=circle, color=blue];\n",
+        "        layer0_%ld [label=\"Input %ld\", shape=circle, color=blue];\n",
         i, i);
   }
   printf("    }\n");
 
-  printf("    subgraph cluster_hidden {\n");
-  printf("        label=\"Hidden Layer\";\n");
-  for (size_t j = 0; j < net->nb_hidden; j++) {
-    printf(
-        "        hidden%ld [label=\"Hidden %ld\\nb=%.2f\", shape=circle, "
-        "color=green];\n",
-        j, j, net->hidden_biases[j]);
-  }
-  printf("    }\n");
-
-  printf("    subgraph cluster_output {\n");
-  printf("        label=\"Output Layer\";\n");
-  for (size_t k = 0; k < net->nb_output; k++) {
-    printf(
-        "        output%ld [label=\"Output %ld\\nb=%.2f\", shape=circle, "
-        "color=red];\n",
-        k, k, net->output_biases[k]);
-  }
-  printf("    }\n");
-
-  for (size_t i = 0; i < net->nb_input; i++) {
-    for (size_t j = 0; j < net->nb_hidden; j++) {
-      double weight = net->hidden_weights[i * net->nb_hidden + j];
-      printf("    input%ld -> hidden%ld [label=\"%.2f\"];\n", i, j, weight);
+  for (size_t l = 0; l < net->nb_layers; l++) {
+    const Layer* layer = &net->layers[l];
+    int is_output = l + 1 == net->nb_layers;
+    printf("    subgraph cluster_layer%ld {\n", l + 1);
+    if (is_output)
+      printf("        label=\"Output Layer\";\n");
+    else
+      printf("        label=\"Hidden Layer %ld\";\n", l + 1);
+    for (size_t j = 0; j < layer->nb_output; j++) {
+      printf(
+          "        layer%ld_%ld [label=\"%s %ld\\nb=%.2f\", shape=circle, "
+          "color=%s];\n",
+          l + 1, j, is_output ? "Output" : "Hidden", j, layer->biases[j],
+          is_output ? "red" : "green");
     }
+    printf("    }\n");
   }
 
-  for (size_t j = 0; j < net->nb_hidden; j++) {
-    for (size_t k = 0; k < net->nb_output; k++) {
-      double weight = net->output_weights[j * net->nb_output + k];
-      printf("    hidden%ld -> output%ld [label=\"%.2f\"];\n", j, k, weight);
+  for (size_t l = 0; l < net->nb_layers; l++) {
+    const Layer* layer = &net->layers[l];
+    for (size_t i = 0; i < layer->nb_input; i++) {
+      for (size_t j = 0; j < layer->nb_output; j++) {
+        double weight = layer->weights[j * layer->nb_input + i];
+        printf("    layer%ld_%ld -> layer%ld_%ld [label=\"%.2f\"];\n", l, i,
+               l + 1, j, weight);
+      }
     }
   }
 
   printf("}\n");
-}
\ No newline at end of file
+}
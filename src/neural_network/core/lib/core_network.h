@@ -1,6 +1,7 @@
 #ifndef CORE_NETWORK_H
 #define CORE_NETWORK_H
 
+#include <stdio.h>
 #include <stdlib.h>
 
 
@@ -27,30 +28,167 @@ typedef enum ActivationFunction {
 
 } ActivationFunction;
 
-typedef struct Network {
+/**
+ * Kernels of a layer, specialized for its activation function (see
+ * get_layer_kernels() in core_network.c)
+ */
+typedef struct LayerKernels {
+  // output = activation(biases + weights.input), weights stored output-major
+  void (*forward)(const double* weights,
+                  const double* biases,
+                  const double* input,
+                  double* output,
+                  size_t nb_input,
+                  size_t nb_output);
+  // Applies the activation function in place on a whole layer
+  void (*activate)(double* values, size_t size);
+  // gradients *= derivative of the activation function (from activated values)
+  void (*derivative)(const double* activated, double* gradients, size_t size);
+} LayerKernels;
+
+int get_activation(ActivationFunction activation,
+                   double (**fct)(double),
+                   double (**d_fct)(double));
+
+typedef enum LayerType {
+  LAYER_DENSE,
+  LAYER_CONV2D,
+  LAYER_MAXPOOL
+
+} LayerType;
+
+/**
+ * Description of a layer, see init_nn_spec()
+ */
+typedef struct LayerSpec {
+  LayerType type;
+  // Number of neurons (dense) or of output channels (convolution)
+  size_t size;
+  // Side of the square kernel (convolution, odd and zero padded so that the
+  // output has the size of the input) or of the pooling window (stride)
+  size_t kernel;
+  // Ignored by pooling layers
+  ActivationFunction activation;
+} LayerSpec;
+
+/**
+ * Layer of the network. Dense layers store their weights output-major: one
+ * contiguous row of incoming weights per neuron (model files are converted at
+ * load and save time). Convolutions store one row of in_channels x kernel x
+ * kernel weights per output channel, and pooling layers have no parameters.
+ * Images are stored channel by channel, row by row.
+ */
+typedef struct Layer {
+  LayerType type;
   size_t nb_input;
-  size_t nb_hidden;
   size_t nb_output;
-  double* hidden_weights;
-  double* hidden_biases;
-  double* output_weights;
-  double* output_biases;
-  double* hidden;
-  double* output;
-  ActivationFunction hidden_activation;
-  ActivationFunction ouput_activation;
+  // Geometry of the input and output of the layer (dense layers are 1 x 1
+  // images with nb_input and nb_output channels)
+  size_t in_channels;
+  size_t in_height;
+  size_t in_width;
+  size_t out_channels;
+  size_t out_height;
+  size_t out_width;
+  size_t kernel;
+  double* weights;
+  double* biases;
+  ActivationFunction activation;
   // function pointer should be faster than checking manually at each training
   // step which function to use
-  double (*hidden_fct)(double);
-  double (*output_fct)(double);
-  double (*d_hidden_fct)(double);
-  double (*d_output_fct)(double);
+  double (*fct)(double);
+  double (*d_fct)(double);
+  // Specialized kernels selected once by init_nn_spec(), the function
+  // pointers above being the fallback when they are not available
+  LayerKernels kernels;
+} Layer;
+
+/**
+ * Per-thread inference state: activations of every layer for the last sample
+ * predicted with predict_nn_ctx()
+ */
+typedef struct NetworkContext {
+  size_t nb_layers;
+  double** layers;
+  double* output;  // Activations of the last layer
+  // Unfolded input patches of convolutions (im2col) and their gradients
+  double* scratch;
+} NetworkContext;
+
+// Default number of samples forward propagated together by
+// predict_nn_batch_ctx()
+#define PREDICT_TILE 64
+
+/**
+ * Buffers of batched inference: the activations of every layer for a tile of
+ * samples
+ */
+typedef struct BatchContext {
+  size_t nb_layers;
+  size_t tile;  // Number of samples propagated together
+  double** layers;
+  double* scratch;
+} BatchContext;
+
+/**
+ * Parameters of the network: a stack of layers, the output of each layer
+ * being the input of the next one. Once trained or loaded, a network is only
+ * read by predict_nn_ctx() and predict_nn_batch(), so a single instance can be
+ * shared by any number of threads.
+ */
+typedef struct Network {
+  size_t nb_input;
+  size_t nb_output;
+  size_t nb_layers;
+  Layer* layers;
+  // Default inference context, only used by predict_nn() (not thread safe)
+  NetworkContext* context;
+  double* output;
+  // Memory mapped model file holding weights and biases (see
+  // load_nn_binary()), NULL when they are heap allocated
+  void* mapping;
+  size_t mapping_size;
 
 } Network;
 
+typedef enum OptimizerType {
+  OPTIMIZER_SGD,
+  OPTIMIZER_MOMENTUM,
+  OPTIMIZER_NESTEROV,
+  OPTIMIZER_ADAM
+
+} OptimizerType;
+
+/**
+ * Update rule of the weights and biases, see default_optimizer()
+ */
+typedef struct Optimizer {
+  OptimizerType type;
+  // Decay of the velocity (momentum), or of the first moment (Adam)
+  double beta1;
+  // Decay of the second moment (Adam)
+  double beta2;
+  double epsilon;
+} Optimizer;
+
 typedef struct NetworkTrainer {
-  double* gradients_errors_hidden;
-  double* gradients_errors_output;
+  // Gradients of the errors of each layer
+  double** gradients;
+  // Activations of the last sample trained with train_nn()
+  NetworkContext* context;
+  // Mini-batch scratch matrices of each layer (one row per sample), grown on
+  // demand by train_nn_batch()
+  size_t batch_capacity;
+  double** batch_layers;
+  double** batch_gradients;
+  // Optimizer state, allocated once by set_optimizer_nt(): for each layer, the
+  // gradients of its weights then biases and their first and second moments.
+  // Unused (NULL) with plain SGD, which updates the weights in place.
+  Optimizer optimizer;
+  size_t nb_steps;
+  double** parameter_gradients;
+  double** first_moments;
+  double** second_moments;
 } NetworkTrainer;
 
 Network* init_nn(size_t input_layer_size,
@@ -58,24 +196,75 @@ Network* init_nn(size_t input_layer_size,
                       size_t output_layer_size,
                       ActivationFunction activation_hidden,
                       ActivationFunction activation_output);
+Network* init_nn_layers(size_t input_layer_size,
+                        size_t nb_layers,
+                        const size_t* layer_sizes,
+                        const ActivationFunction* activations);
+Network* init_nn_spec(size_t channels,
+                      size_t height,
+                      size_t width,
+                      size_t nb_layers,
+                      const LayerSpec* specs);
 
-NetworkTrainer* init_nt(Network* network);
+NetworkTrainer* init_nt(const Network* network);
+Optimizer default_optimizer(OptimizerType type);
+void set_optimizer_nt(NetworkTrainer* trainer,
+                      const Network* network,
+                      const Optimizer* optimizer);
+NetworkContext* init_nc(const Network* network);
+BatchContext* init_bc(const Network* network, size_t tile);
 
 void predict_nn(Network* network, double* input);
+void predict_nn_ctx(const Network* network,
+                    NetworkContext* context,
+                    const double* input);
+void predict_nn_logits(const Network* network,
+                       NetworkContext* context,
+                       const double* input);
+void predict_nn_preactivated(const Network* network, NetworkContext* context);
+void predict_nn_batch_ctx(const Network* network,
+                          BatchContext* context,
+                          const double* inputs,
+                          size_t n,
+                          double* outputs);
+void predict_nn_batch(const Network* network,
+                      const double* inputs,
+                      size_t n,
+                      double* outputs);
 void train_nn(NetworkTrainer* trainer,
                    Network* network,
                    double* input,
                    double* target,
                    double lr);
+void train_nn_batch(NetworkTrainer* trainer,
+                    Network* network,
+                    const double* inputs,
+                    const double* targets,
+                    size_t batch_size,
+                    double lr);
 
+size_t nn_nb_weights(const Network* network);
+size_t nn_nb_multiply_adds(const Network* network);
 void print_nn(const Network* network);
 void save_nn_data(const Network* network, const char* path);
+void write_nn_binary(const Network* network, FILE* file);
+void save_nn_binary(const Network* network, const char* path);
 Network* load_nn_data(const char* path);
+Network* load_nn_text(const char* path);
+Network* load_nn_binary(const char* path);
+void write_nt_state(const NetworkTrainer* trainer,
+                    const Network* network,
+                    FILE* file);
+void read_nt_state(NetworkTrainer* trainer,
+                   const Network* network,
+                   FILE* file);
 
 void is_network_dead(const Network* network);
 void print_graphviz(const Network* net);
 
 void free_nt(NetworkTrainer* trainer);
+void free_nc(NetworkContext* context);
+void free_bc(BatchContext* context);
 void free_nn(Network* network);
 
 
@@ -0,0 +1,592 @@
+#define _GNU_SOURCE
+#include "dataset.h"
+
+#include <SDL2/SDL.h>
+#include <err.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ocr.h"
+
+/**
+ * Pack file format (version 1), in host byte order:
+ *
+ * * A 64 bytes DatasetFileHeader
+ *
+ * * The label of each image (one byte)
+ *
+ * * At an offset aligned on DATASET_ALIGN bytes, the pixels of each image
+ * (height x width bytes, 0 = black and 255 = white), after the same
+ * preprocessing as the images given to the network (resized, then binarized
+ * or converted to grayscale)
+ *
+ * * The file name of each image, NUL terminated
+ *
+ * Images are sorted by file name.
+ */
+#define DATASET_MAGIC "OCRDSPAK"
+#define DATASET_VERSION 1
+#define DATASET_ALIGN 64
+
+typedef struct DatasetFileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t is_bw;
+  uint32_t height;
+  uint32_t width;
+  uint64_t size;
+  uint64_t labels_offset;
+  uint64_t pixels_offset;
+  uint64_t names_offset;
+  uint64_t file_size;
+} DatasetFileHeader;
+
+_Static_assert(sizeof(DatasetFileHeader) == 64, "Invalid header size");
+
+/**
+ * @brief Returns the path of the pack file of a dataset directory:
+ * "<directory>.bw.pack" or "<directory>.gs.pack" depending on the
+ * preprocessing
+ *
+ * **NOTE**: The string has to be freed after use
+ */
+char* dataset_pack_path(const char* directory, int is_bw) {
+  size_t length = strlen(directory);
+  while (length > 1 && directory[length - 1] == '/')
+    length--;
+  const char* suffix = is_bw ? ".bw.pack" : ".gs.pack";
+  char* res = calloc(length + strlen(suffix) + 1, sizeof(char));
+  if (res == NULL)
+    errx(EXIT_FAILURE, "Error while allocating memory");
+  memcpy(res, directory, length);
+  strcpy(res + length, suffix);
+  return res;
+}
+
+/**
+ * @brief Returns the label of an image from its file name, whose first letter
+ * is the expected output
+ */
+static uint8_t label_of(const char* name) {
+  if (name[0] < 'a' || name[0] > 'z')
+    return DATASET_NO_LABEL;
+  return name[0] - 'a';
+}
+
+/**
+ * Images of a directory decoded by a pool of threads, each thread taking the
+ * next image not decoded yet. Every image has its own slot in the pixels of
+ * the pack, so the result does not depend on the scheduling.
+ */
+typedef struct PackJob {
+  const char* directory;
+  char** names;
+  size_t size;
+  int is_bw;
+  uint8_t* pixels;     // size slots of IMG_H x IMG_W pixels
+  atomic_size_t next;  // Index of the next image to decode
+} PackJob;
+
+/**
+ * @brief Loads, preprocesses and writes the pixels of one image of a pack
+ */
+static void pack_image(const PackJob* job, size_t index) {
+  size_t path_length =
+      strlen(job->directory) + 1 + strlen(job->names[index]) + 1;
+  char* image_path = calloc(path_length, sizeof(char));
+  if (image_path == NULL)
+    errx(EXIT_FAILURE, "Error while allocating memory");
+  snprintf(image_path, path_length, "%s/%s", job->directory,
+           job->names[index]);
+
+  SDL_Surface* surface = load_image(image_path);
+  surface_to_gray(surface, job->is_bw == 1,
+                  job->pixels + index * IMG_H * IMG_W);
+  SDL_FreeSurface(surface);
+  free(image_path);
+}
+
+/**
+ * @brief Decodes images of a pack job until none is left. Used as a thread
+ * routine.
+ *
+ * @param arg A pointer to the PackJob
+ * @return NULL
+ */
+static void* pack_worker(void* arg) {
+  PackJob* job = arg;
+  size_t index;
+  while ((index = atomic_fetch_add(&job->next, 1)) < job->size) {
+    pack_image(job, index);
+  }
+  return NULL;
+}
+
+/**
+ * @brief Decodes every image of a directory once and writes the preprocessed
+ * pixels and labels to a pack file (see the format above), which map_dataset()
+ * reads without SDL. Images are decoded by a pool of threads writing straight
+ * into the mapped pack. The file is written to a temporary file renamed at the
+ * end, so an interrupted run never leaves a truncated pack.
+ *
+ * @param directory The dataset directory, the first letter of each file name
+ * being its label
+ * @param is_bw Whether images are binarized (1) or converted to grayscale (0)
+ * @param path The path of the pack file
+ * @param workers Number of decoding threads, 0 for one per online CPU
+ */
+void pack_dataset(const char* directory,
+                  int is_bw,
+                  const char* path,
+                  size_t workers) {
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  size_t size = 0;
+  char** names = get_filenames_in_dir(directory, &size);
+  sort_string_list(names, size);
+
+  DatasetFileHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, DATASET_MAGIC, sizeof(header.magic));
+  header.version = DATASET_VERSION;
+  header.is_bw = is_bw != 0;
+  header.height = IMG_H;
+  header.width = IMG_W;
+  header.size = size;
+  header.labels_offset = sizeof(header);
+  header.pixels_offset = (header.labels_offset + size + DATASET_ALIGN - 1) /
+                         DATASET_ALIGN * DATASET_ALIGN;
+  header.names_offset = header.pixels_offset + size * IMG_H * IMG_W;
+  header.file_size = header.names_offset;
+  for (size_t i = 0; i < size; i++)
+    header.file_size += strlen(names[i]) + 1;
+
+  char* temp_path = calloc(strlen(path) + 5, sizeof(char));
+  if (temp_path == NULL)
+    errx(EXIT_FAILURE, "Error while allocating memory");
+  sprintf(temp_path, "%s.tmp", path);
+  int fd = open(temp_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0 || ftruncate(fd, header.file_size) != 0)
+    err(EXIT_FAILURE, "Error while opening %s", temp_path);
+  unsigned char* mapping = mmap(NULL, header.file_size, PROT_READ | PROT_WRITE,
+                                MAP_SHARED, fd, 0);
+  if (mapping == MAP_FAILED)
+    err(EXIT_FAILURE, "Error while mapping %s", temp_path);
+
+  memcpy(mapping, &header, sizeof(header));
+  char* name = (char*)mapping + header.names_offset;
+  for (size_t i = 0; i < size; i++) {
+    mapping[header.labels_offset + i] = label_of(names[i]);
+    strcpy(name, names[i]);
+    name += strlen(names[i]) + 1;
+  }
+
+  PackJob job;
+  job.directory = directory;
+  job.names = names;
+  job.size = size;
+  job.is_bw = is_bw;
+  job.pixels = mapping + header.pixels_offset;
+  atomic_init(&job.next, 0);
+  if (workers == 0) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    workers = cpus > 0 ? cpus : 1;
+  }
+  if (workers > size)
+    workers = size > 0 ? size : 1;
+  pthread_t* threads = calloc(workers, sizeof(pthread_t));
+  if (threads == NULL)
+    errx(EXIT_FAILURE, "Error while allocating memory");
+  for (size_t w = 1; w < workers; w++) {
+    if (pthread_create(&threads[w], NULL, pack_worker, &job) != 0)
+      errx(EXIT_FAILURE, "Error while creating loading thread");
+  }
+  pack_worker(&job);
+  for (size_t w = 1; w < workers; w++) {
+    pthread_join(threads[w], NULL);
+  }
+  free(threads);
+
+  if (munmap(mapping, header.file_size) != 0 || close(fd) != 0 ||
+      rename(temp_path, path) != 0)
+    err(EXIT_FAILURE, "Error while writing %s", path);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double elapsed =
+      (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  printf("Packed %ld images of %s in %.3fs, %.0f files/s (%ld threads)\n",
+         size, directory, elapsed, size / elapsed, workers);
+
+  free(temp_path);
+  for (size_t i = 0; i < size; i++)
+    free(names[i]);
+  free(names);
+}
+
+/**
+ * @brief Maps a pack file written by pack_dataset(). Pixels and labels are
+ * used in place, only the array of names is allocated.
+ *
+ * **NOTE**: The struct should be freed using free_dataset()
+ *
+ * @param path The path of the pack file
+ * @return pointer to the mapped dataset
+ */
+PackedDataset* map_dataset(const char* path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    err(EXIT_FAILURE, "Error opening %s", path);
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(DatasetFileHeader)) {
+    close(fd);
+    errx(EXIT_FAILURE, "Invalid dataset pack %s", path);
+  }
+  size_t mapping_size = st.st_size;
+  unsigned char* mapping =
+      mmap(NULL, mapping_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED)
+    err(EXIT_FAILURE, "Error while mapping %s", path);
+
+  const DatasetFileHeader* header = (const DatasetFileHeader*)mapping;
+  const uint64_t image_size = (uint64_t)header->height * header->width;
+  const uint64_t pixels_size = header->size * image_size;
+  if (memcmp(header->magic, DATASET_MAGIC, sizeof(header->magic)) != 0 ||
+      header->version != DATASET_VERSION ||
+      header->file_size != mapping_size ||
+      header->labels_offset != sizeof(DatasetFileHeader) ||
+      header->pixels_offset < header->labels_offset + header->size ||
+      header->pixels_offset > mapping_size || image_size == 0 ||
+      header->size > (mapping_size - header->pixels_offset) / image_size ||
+      header->names_offset != header->pixels_offset + pixels_size ||
+      (header->size > 0 && mapping[mapping_size - 1] != '\0')) {
+    munmap(mapping, mapping_size);
+    errx(EXIT_FAILURE, "Invalid dataset pack %s", path);
+  }
+
+  PackedDataset* dataset = malloc(sizeof(PackedDataset));
+  const char** names = calloc(header->size + 1, sizeof(char*));
+  size_t* order = calloc(header->size + 1, sizeof(size_t));
+  if (dataset == NULL || names == NULL || order == NULL)
+    errx(EXIT_FAILURE, "Error while allocating memory");
+  for (size_t i = 0; i < header->size; i++)
+    order[i] = i;
+  const char* name = (const char*)mapping + header->names_offset;
+  const char* end = (const char*)mapping + mapping_size;
+  for (size_t i = 0; i < header->size; i++) {
+    if (name >= end) {
+      munmap(mapping, mapping_size);
+      errx(EXIT_FAILURE, "Invalid dataset pack %s", path);
+    }
+    names[i] = name;
+    name += strlen(name) + 1;
+  }
+  dataset->size = header->size;
+  dataset->height = header->height;
+  dataset->width = header->width;
+  dataset->labels = mapping + header->labels_offset;
+  dataset->pixels = mapping + header->pixels_offset;
+  dataset->names = names;
+  dataset->order = order;
+  dataset->nb_samples = header->size;
+  dataset->mapping = mapping;
+  dataset->mapping_size = mapping_size;
+  return dataset;
+}
+
+/**
+ * @brief Returns 1 if the pack file at path exists and is more recent than the
+ * directory. Adding, removing or renaming images updates the modification time
+ * of the directory, editing an image in place does not: delete the pack (or
+ * use pack_dataset()) in that case.
+ */
+static int is_pack_fresh(const char* directory, const char* path) {
+  struct stat directory_st, pack_st;
+  if (stat(directory, &directory_st) != 0)
+    err(EXIT_FAILURE, "Error while opening directory %s", directory);
+  if (stat(path, &pack_st) != 0)
+    return 0;
+  if (pack_st.st_mtim.tv_sec != directory_st.st_mtim.tv_sec)
+    return pack_st.st_mtim.tv_sec > directory_st.st_mtim.tv_sec;
+  return pack_st.st_mtim.tv_nsec > directory_st.st_mtim.tv_nsec;
+}
+
+/**
+ * @brief Returns the preprocessed images of a dataset directory, from its pack
+ * file (see dataset_pack_path()), which is (re)built first when it is missing
+ * or older than the directory
+ *
+ * **NOTE**: The struct should be freed using free_dataset()
+ *
+ * @param directory The dataset directory
+ * @param is_bw Whether images are binarized (1) or converted to grayscale (0)
+ * @return pointer to the mapped dataset
+ */
+PackedDataset* load_dataset(const char* directory, int is_bw) {
+  char* path = dataset_pack_path(directory, is_bw);
+  if (!is_pack_fresh(directory, path)) {
+    printf("Packing %s to %s\n", directory, path);
+    pack_dataset(directory, is_bw, path, 0);
+  }
+  PackedDataset* dataset = map_dataset(path);
+  if (dataset->height != IMG_H || dataset->width != IMG_W)
+    errx(EXIT_FAILURE, "Invalid image size in dataset pack %s", path);
+  free(path);
+  return dataset;
+}
+
+/**
+ * @brief Opens the pack file of a dataset directory to read it shard by shard
+ * (see DatasetStream), after (re)building it like load_dataset()
+ *
+ * **NOTE**: The struct should be freed using close_dataset_stream()
+ *
+ * @param directory The dataset directory
+ * @param is_bw Whether images are binarized (1) or converted to grayscale (0)
+ * @param shard_size Number of images of a shard
+ * @return pointer to the opened stream
+ */
+DatasetStream* open_dataset_stream(const char* directory,
+                                   int is_bw,
+                                   size_t shard_size) {
+  char* path = dataset_pack_path(directory, is_bw);
+  if (!is_pack_fresh(directory, path)) {
+    printf("Packing %s to %s\n", directory, path);
+    pack_dataset(directory, is_bw, path, 0);
+  }
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    err(EXIT_FAILURE, "Error opening %s", path);
+  DatasetFileHeader header;
+  struct stat st;
+  if (fstat(fd, &st) != 0 ||
+      pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+      memcmp(header.magic, DATASET_MAGIC, sizeof(header.magic)) != 0 ||
+      header.version != DATASET_VERSION ||
+      header.file_size != (uint64_t)st.st_size ||
+      header.labels_offset != sizeof(DatasetFileHeader) ||
+      header.pixels_offset < header.labels_offset + header.size ||
+      header.names_offset !=
+          header.pixels_offset + header.size * header.height * header.width ||
+      header.names_offset > header.file_size)
+    errx(EXIT_FAILURE, "Invalid dataset pack %s", path);
+  if (header.height != IMG_H || header.width != IMG_W)
+    errx(EXIT_FAILURE, "Invalid image size in dataset pack %s", path);
+  free(path);
+
+  DatasetStream* stream = malloc(sizeof(DatasetStream));
+  if (stream == NULL)
+    errx(EXIT_FAILURE, "Error while allocating memory");
+  stream->fd = fd;
+  stream->size = header.size;
+  stream->height = header.height;
+  stream->width = header.width;
+  stream->shard_size = shard_size;
+  stream->nb_shards = (header.size + shard_size - 1) / shard_size;
+  stream->labels_offset = header.labels_offset;
+  stream->pixels_offset = header.pixels_offset;
+  return stream;
+}
+
+/**
+ * @brief Returns the number of images of a shard and the index of its first
+ * image
+ */
+static size_t shard_range(const DatasetStream* stream,
+                          size_t shard,
+                          size_t* first) {
+  *first = shard * stream->shard_size;
+  return stream->size - *first < stream->shard_size ? stream->size - *first
+                                                    : stream->shard_size;
+}
+
+/**
+ * @brief Reads exactly size bytes of a file at an offset
+ */
+static void pread_all(int fd, void* buf, size_t size, uint64_t offset) {
+  size_t done = 0;
+  while (done < size) {
+    ssize_t res = pread(fd, (char*)buf + done, size - done, offset + done);
+    if (res <= 0)
+      err(EXIT_FAILURE, "Error while reading dataset pack");
+    done += res;
+  }
+}
+
+/**
+ * @brief Reads the labels and pixels of the images of a shard
+ *
+ * @param stream The stream
+ * @param shard Index of the shard
+ * @param labels Where the label of each image is written
+ * @param pixels Where the pixels of each image are written
+ * @return the number of images of the shard
+ */
+size_t read_dataset_shard(const DatasetStream* stream,
+                          size_t shard,
+                          uint8_t* labels,
+                          uint8_t* pixels) {
+  const size_t image_size = stream->height * stream->width;
+  size_t first;
+  size_t count = shard_range(stream, shard, &first);
+  pread_all(stream->fd, labels, count, stream->labels_offset + first);
+  pread_all(stream->fd, pixels, count * image_size,
+            stream->pixels_offset + first * image_size);
+  return count;
+}
+
+/**
+ * @brief Asks the kernel to read the pixels of a shard in the background, so
+ * that read_dataset_shard() finds them in the page cache
+ */
+void prefetch_dataset_shard(const DatasetStream* stream, size_t shard) {
+  const size_t image_size = stream->height * stream->width;
+  size_t first;
+  size_t count = shard_range(stream, shard, &first);
+  readahead(stream->fd, stream->pixels_offset + first * image_size,
+            count * image_size);
+}
+
+/**
+ * @brief Drops the pixels of a shard read by read_dataset_shard() from the
+ * page cache, so that streaming a dataset does not fill memory with pages
+ * that will not be read before the next epoch
+ */
+void evict_dataset_shard(const DatasetStream* stream, size_t shard) {
+  const size_t image_size = stream->height * stream->width;
+  size_t first;
+  size_t count = shard_range(stream, shard, &first);
+  posix_fadvise(stream->fd, stream->pixels_offset + first * image_size,
+                count * image_size, POSIX_FADV_DONTNEED);
+}
+
+/**
+ * @brief Closes the pack file of a stream and frees its struct
+ *
+ * @param stream A pointer to the stream to close
+ */
+void close_dataset_stream(DatasetStream* stream) {
+  close(stream->fd);
+  free(stream);
+}
+
+/**
+ * @brief Writes the input of the network for an image of a dataset: the light
+ * intensity of each pixel, between 0 (black) and 1 (white)
+ *
+ * @param dataset The dataset
+ * @param index Index of the image
+ * @param input List of height x width doubles
+ */
+void dataset_input(const PackedDataset* dataset, size_t index, double* input) {
+  const size_t image_size = dataset->height * dataset->width;
+  const uint8_t* pixels = dataset->pixels + index * image_size;
+  for (size_t i = 0; i < image_size; i++)
+    input[i] = pixels[i] / 255.;
+}
+
+/**
+ * @brief Writes the expected output of the network for an image of a dataset:
+ * 1 for its label, 0 for the other letters (only zeros without label)
+ *
+ * @param dataset The dataset
+ * @param index Index of the image
+ * @param target List of size doubles
+ * @param size Number of outputs of the network
+ */
+void dataset_target(const PackedDataset* dataset,
+                    size_t index,
+                    double* target,
+                    size_t size) {
+  memset(target, 0, size * sizeof(double));
+  if (dataset->labels[index] < size)
+    target[dataset->labels[index]] = 1.;
+}
+
+/**
+ * @brief Returns the next number of a xorshift64 pseudo random generator: a
+ * few cycles and reproducible from its seed, unlike rand() whose state is
+ * global
+ *
+ * @param state State of the generator, any value but 0 as seed
+ */
+uint64_t xorshift64(uint64_t* state) {
+  uint64_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  *state = x;
+  return x;
+}
+
+/**
+ * @brief Shuffles an array of indices (Fisher-Yates)
+ *
+ * @param indices The indices
+ * @param size Number of indices
+ * @param state State of the xorshift64() generator
+ */
+void shuffle_indices(size_t* indices, size_t size, uint64_t* state) {
+  for (size_t i = size; i > 1; i--) {
+    size_t j = xorshift64(state) % i;
+    size_t tmp = indices[i - 1];
+    indices[i - 1] = indices[j];
+    indices[j] = tmp;
+  }
+}
+
+/**
+ * @brief Shuffles the order of the images of a dataset: only the permutation
+ * of their indices is written, images stay in place. Held out images (see
+ * holdout_dataset()) stay at the end.
+ *
+ * @param dataset The dataset
+ * @param state State of the xorshift64() generator
+ */
+void shuffle_dataset(PackedDataset* dataset, uint64_t* state) {
+  shuffle_indices(dataset->order, dataset->nb_samples, state);
+}
+
+/**
+ * @brief Holds random images of a dataset out of training, e.g. to validate
+ * the network on images it was not trained on: they are moved to the end of
+ * its order, out of the nb_samples images shuffled and trained on
+ *
+ * @param dataset The dataset
+ * @param count Number of images to hold out, at most the number of samples
+ * @param state State of the xorshift64() generator
+ * @return the indices of the held out images, owned by the dataset
+ */
+const size_t* holdout_dataset(PackedDataset* dataset,
+                              size_t count,
+                              uint64_t* state) {
+  if (count > dataset->nb_samples)
+    errx(EXIT_FAILURE, "Not enough images to hold out %ld", count);
+  for (size_t k = 0; k < count; k++) {
+    size_t last = dataset->nb_samples - 1;
+    size_t j = xorshift64(state) % dataset->nb_samples;
+    size_t tmp = dataset->order[last];
+    dataset->order[last] = dataset->order[j];
+    dataset->order[j] = tmp;
+    dataset->nb_samples--;
+  }
+  return dataset->order + dataset->nb_samples;
+}
+
+/**
+ * @brief Unmaps a dataset and frees its struct
+ *
+ * @param dataset A pointer to the dataset to free
+ */
+void free_dataset(PackedDataset* dataset) {
+  munmap(dataset->mapping, dataset->mapping_size);
+  free(dataset->names);
+  free(dataset->order);
+  free(dataset);
+}
@@ -0,0 +1,79 @@
+#ifndef DATASET_H
+#define DATASET_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+// Label of the samples whose file name does not start with a letter
+#define DATASET_NO_LABEL 255
+
+/**
+ * Preprocessed images of a dataset directory, memory mapped from its pack file
+ * (see pack_dataset()): one byte per pixel and one label byte per image,
+ * instead of the PNG files decoded and converted by SDL at each run. Samples
+ * are decoded to the inputs of the network when they are used (see
+ * dataset_input()), and shuffled through a permutation of their indices.
+ * The last images of that permutation can be held out of training (see
+ * holdout_dataset()).
+ */
+typedef struct PackedDataset {
+  size_t size;  // Number of images
+  size_t height;
+  size_t width;
+  const uint8_t* labels;  // Index of the letter, or DATASET_NO_LABEL
+  const uint8_t* pixels;  // size images of height x width, row by row
+  const char** names;     // File name of each image
+  size_t* order;          // Permutation of the indices, see shuffle_dataset()
+  size_t nb_samples;      // Images trained on, the first ones of order
+  void* mapping;
+  size_t mapping_size;
+} PackedDataset;
+
+/**
+ * Pack file of a dataset read shard by shard instead of being mapped, for
+ * datasets larger than memory: a shard is shard_size consecutive images of the
+ * pack (the last one may be smaller). Nothing but the header is kept in
+ * memory.
+ */
+typedef struct DatasetStream {
+  int fd;
+  size_t size;  // Number of images
+  size_t height;
+  size_t width;
+  size_t shard_size;
+  size_t nb_shards;
+  uint64_t labels_offset;
+  uint64_t pixels_offset;
+} DatasetStream;
+
+char* dataset_pack_path(const char* directory, int is_bw);
+void pack_dataset(const char* directory,
+                  int is_bw,
+                  const char* path,
+                  size_t workers);
+PackedDataset* map_dataset(const char* path);
+PackedDataset* load_dataset(const char* directory, int is_bw);
+void dataset_input(const PackedDataset* dataset, size_t index, double* input);
+void dataset_target(const PackedDataset* dataset,
+                    size_t index,
+                    double* target,
+                    size_t size);
+DatasetStream* open_dataset_stream(const char* directory,
+                                   int is_bw,
+                                   size_t shard_size);
+size_t read_dataset_shard(const DatasetStream* stream,
+                          size_t shard,
+                          uint8_t* labels,
+                          uint8_t* pixels);
+void prefetch_dataset_shard(const DatasetStream* stream, size_t shard);
+void evict_dataset_shard(const DatasetStream* stream, size_t shard);
+void close_dataset_stream(DatasetStream* stream);
+uint64_t xorshift64(uint64_t* state);
+void shuffle_indices(size_t* indices, size_t size, uint64_t* state);
+void shuffle_dataset(PackedDataset* dataset, uint64_t* state);
+const size_t* holdout_dataset(PackedDataset* dataset,
+                              size_t count,
+                              uint64_t* state);
+void free_dataset(PackedDataset* dataset);
+
+#endif
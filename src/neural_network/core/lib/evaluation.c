@@ -0,0 +1,251 @@
+#include "evaluation.h"
+
+#include <err.h>
+#include <string.h>
+
+/**
+ * @brief Returns the rank of an output among the outputs of a sample, 1 being
+ * the best guess (ties are in favour of the first index, as in best_guess(), so
+ * that a rank of 1 means the output is the best guess)
+ */
+static size_t output_rank(const double* outputs, size_t size, size_t index) {
+  size_t rank = 1;
+  for (size_t o = 0; o < index; o++)
+    rank += outputs[o] >= outputs[index];
+  for (size_t o = index + 1; o < size; o++)
+    rank += outputs[o] > outputs[index];
+  return rank;
+}
+
+/**
+ * @brief Returns the index of the best guess of a sample (the first one on
+ * ties, like indexOfMax())
+ */
+static size_t best_guess(const double* outputs, size_t size) {
+  size_t best = 0;
+  for (size_t o = 1; o < size; o++) {
+    if (outputs[o] > outputs[best])
+      best = o;
+  }
+  return best;
+}
+
+/**
+ * @brief Evaluates a network on images of a dataset: accuracy, top-k accuracy
+ * and confusion matrix. Images are decoded and predicted by blocks of
+ * EVALUATION_BLOCK samples with predict_nn_batch_ctx(), reusing one batch
+ * context, so the network is only read and nothing is printed.
+ *
+ * **NOTE**: The struct should be freed using free_evaluation()
+ *
+ * @param network The network
+ * @param dataset The dataset
+ * @param indices Indices of the images to evaluate, NULL for the first size
+ * images of the dataset
+ * @param size Number of images
+ * @param top_k Number of best guesses counted by the top-k accuracy
+ * @return pointer to the results
+ */
+Evaluation* evaluate_nn(const Network* network,
+                        const PackedDataset* dataset,
+                        const size_t* indices,
+                        size_t size,
+                        size_t top_k) {
+  const size_t nb_classes = network->nb_output;
+  Evaluation* evaluation = calloc(1, sizeof(Evaluation));
+  const size_t block = size < EVALUATION_BLOCK ? size : EVALUATION_BLOCK;
+  double* inputs = calloc(block * network->nb_input + 1, sizeof(double));
+  double* outputs = calloc(block * nb_classes + 1, sizeof(double));
+  if (evaluation == NULL || inputs == NULL || outputs == NULL)
+    errx(EXIT_FAILURE, "Error while allocating memory");
+  evaluation->confusion = calloc(nb_classes * nb_classes, sizeof(size_t));
+  evaluation->top_k_hits = calloc(nb_classes, sizeof(size_t));
+  if (evaluation->confusion == NULL || evaluation->top_k_hits == NULL)
+    errx(EXIT_FAILURE, "Error while allocating memory");
+  evaluation->nb_classes = nb_classes;
+  evaluation->size = size;
+  evaluation->top_k = top_k;
+  BatchContext* context = init_bc(network, 0);
+
+  for (size_t start = 0; start < size; start += block) {
+    size_t count = size - start < block ? size - start : block;
+    for (size_t s = 0; s < count; s++) {
+      size_t index = indices != NULL ? indices[start + s] : start + s;
+      dataset_input(dataset, index, inputs + s * network->nb_input);
+    }
+    predict_nn_batch_ctx(network, context, inputs, count, outputs);
+    for (size_t s = 0; s < count; s++) {
+      size_t index = indices != NULL ? indices[start + s] : start + s;
+      size_t label = dataset->labels[index];
+      if (label >= nb_classes)
+        continue;
+      const double* output = outputs + s * nb_classes;
+      size_t guess = best_guess(output, nb_classes);
+      evaluation->confusion[label * nb_classes + guess]++;
+      evaluation->nb_good += guess == label;
+      if (output_rank(output, nb_classes, label) <= top_k) {
+        evaluation->nb_top_k++;
+        evaluation->top_k_hits[label]++;
+      }
+    }
+  }
+  free_bc(context);
+  free(inputs);
+  free(outputs);
+  return evaluation;
+}
+
+/**
+ * @brief Returns the ratio of images of a dataset whose letter is the best
+ * guess of the network, see evaluate_nn()
+ *
+ * @param network The network
+ * @param dataset The dataset
+ * @param indices Indices of the images to evaluate
+ * @param size Number of images, images without label counting as errors
+ * @return the accuracy, between 0 and 1 (0 without images)
+ */
+double evaluate_accuracy(const Network* network,
+                         const PackedDataset* dataset,
+                         const size_t* indices,
+                         size_t size) {
+  if (size == 0)
+    return 0.;
+  Evaluation* evaluation = evaluate_nn(network, dataset, indices, size, 1);
+  double accuracy = (double)evaluation->nb_good / size;
+  free_evaluation(evaluation);
+  return accuracy;
+}
+
+/**
+ * @brief Returns a count divided by the number of images evaluated, 0 without
+ * images
+ */
+static double ratio(const Evaluation* evaluation, size_t count) {
+  return evaluation->size > 0 ? (double)count / evaluation->size : 0.;
+}
+
+/**
+ * @brief Prints the accuracies of an evaluation, and its confusion matrix in
+ * verbose mode
+ *
+ * @param evaluation The results to print
+ * @param verbose Whether the confusion matrix is printed
+ */
+void print_evaluation(const Evaluation* evaluation, int verbose) {
+  const size_t nb_classes = evaluation->nb_classes;
+  printf("Accuracy: %9.3lf%% (%ld/%ld) \n",
+         ratio(evaluation, evaluation->nb_good) * 100, evaluation->nb_good,
+         evaluation->size);
+  printf("Top-%ld accuracy: %9.3lf%% (%ld/%ld) \n", evaluation->top_k,
+         ratio(evaluation, evaluation->nb_top_k) * 100, evaluation->nb_top_k,
+         evaluation->size);
+  if (!verbose)
+    return;
+  printf("Confusion (rows: expected, columns: best guess)\n ");
+  for (size_t c = 0; c < nb_classes; c++)
+    printf("%5c", (int)('A' + c));
+  printf("\n");
+  for (size_t e = 0; e < nb_classes; e++) {
+    printf("%c", (int)('A' + e));
+    for (size_t c = 0; c < nb_classes; c++)
+      printf("%5ld", evaluation->confusion[e * nb_classes + c]);
+    printf("\n");
+  }
+}
+
+/**
+ * @brief Writes an evaluation as a JSON object: its counts and accuracies, the
+ * letters of the classes and the rows of the confusion matrix
+ *
+ * @param evaluation The results to write
+ * @param file The stream, opened for writing
+ */
+void write_evaluation_json(const Evaluation* evaluation, FILE* file) {
+  const size_t nb_classes = evaluation->nb_classes;
+  fprintf(file,
+          "{\"samples\": %ld, \"correct\": %ld, \"accuracy\": %.6f, "
+          "\"top_k\": %ld, \"top_k_correct\": %ld, \"top_k_accuracy\": %.6f, "
+          "\"letters\": \"",
+          evaluation->size, evaluation->nb_good,
+          ratio(evaluation, evaluation->nb_good), evaluation->top_k,
+          evaluation->nb_top_k, ratio(evaluation, evaluation->nb_top_k));
+  for (size_t c = 0; c < nb_classes; c++)
+    fputc('A' + c, file);
+  fprintf(file, "\", \"confusion\": [");
+  for (size_t e = 0; e < nb_classes; e++) {
+    fprintf(file, "%s[", e > 0 ? ", " : "");
+    for (size_t c = 0; c < nb_classes; c++)
+      fprintf(file, "%s%ld", c > 0 ? ", " : "",
+              evaluation->confusion[e * nb_classes + c]);
+    fprintf(file, "]");
+  }
+  fprintf(file, "]}\n");
+}
+
+/**
+ * @brief Writes an evaluation as CSV: one row per expected letter with its
+ * number of images, of best and top-k guesses and its row of the confusion
+ * matrix, then an "all" row with the totals and the guesses of each letter
+ *
+ * @param evaluation The results to write
+ * @param file The stream, opened for writing
+ */
+void write_evaluation_csv(const Evaluation* evaluation, FILE* file) {
+  const size_t nb_classes = evaluation->nb_classes;
+  fprintf(file, "letter,samples,correct,top_k_correct");
+  for (size_t c = 0; c < nb_classes; c++)
+    fprintf(file, ",%c", (int)('A' + c));
+  fprintf(file, "\n");
+  for (size_t e = 0; e < nb_classes; e++) {
+    const size_t* row = evaluation->confusion + e * nb_classes;
+    size_t samples = 0;
+    for (size_t c = 0; c < nb_classes; c++)
+      samples += row[c];
+    fprintf(file, "%c,%ld,%ld,%ld", (int)('A' + e), samples, row[e],
+            evaluation->top_k_hits[e]);
+    for (size_t c = 0; c < nb_classes; c++)
+      fprintf(file, ",%ld", row[c]);
+    fprintf(file, "\n");
+  }
+  fprintf(file, "all,%ld,%ld,%ld", evaluation->size, evaluation->nb_good,
+          evaluation->nb_top_k);
+  for (size_t c = 0; c < nb_classes; c++) {
+    size_t guesses = 0;
+    for (size_t e = 0; e < nb_classes; e++)
+      guesses += evaluation->confusion[e * nb_classes + c];
+    fprintf(file, ",%ld", guesses);
+  }
+  fprintf(file, "\n");
+}
+
+/**
+ * @brief Saves an evaluation to a file, as CSV when its name ends with .csv
+ * and as JSON otherwise
+ *
+ * @param evaluation The results to save
+ * @param path The path of the file
+ */
+void save_evaluation(const Evaluation* evaluation, const char* path) {
+  FILE* file = fopen(path, "w");
+  if (file == NULL)
+    err(EXIT_FAILURE, "Error while opening %s", path);
+  size_t length = strlen(path);
+  if (length >= 4 && strcmp(path + length - 4, ".csv") == 0)
+    write_evaluation_csv(evaluation, file);
+  else
+    write_evaluation_json(evaluation, file);
+  if (fclose(file) != 0)
+    err(EXIT_FAILURE, "Error while writing %s", path);
+}
+
+/**
+ * @brief Frees the results of an evaluation
+ *
+ * @param evaluation A pointer to the evaluation to free
+ */
+void free_evaluation(Evaluation* evaluation) {
+  free(evaluation->confusion);
+  free(evaluation->top_k_hits);
+  free(evaluation);
+}
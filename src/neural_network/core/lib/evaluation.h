@@ -0,0 +1,44 @@
+#ifndef EVALUATION_H
+#define EVALUATION_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "core_network.h"
+#include "dataset.h"
+
+// Number of samples decoded and predicted together by evaluate_nn()
+#define EVALUATION_BLOCK 256
+
+/**
+ * Results of a network on a labelled dataset, computed by evaluate_nn()
+ * without printing anything per sample
+ */
+typedef struct Evaluation {
+  size_t nb_classes;  // Number of outputs of the network, letter A first
+  size_t size;        // Number of images evaluated
+  size_t top_k;
+  size_t nb_good;   // Images whose letter is the best guess
+  size_t nb_top_k;  // Images whose letter is one of the top_k best guesses
+  // nb_classes x nb_classes counts, row = expected letter, column = best
+  // guess (images without label are only counted as errors)
+  size_t* confusion;
+  size_t* top_k_hits;  // nb_top_k of the images of each letter
+} Evaluation;
+
+Evaluation* evaluate_nn(const Network* network,
+                        const PackedDataset* dataset,
+                        const size_t* indices,
+                        size_t size,
+                        size_t top_k);
+double evaluate_accuracy(const Network* network,
+                         const PackedDataset* dataset,
+                         const size_t* indices,
+                         size_t size);
+void print_evaluation(const Evaluation* evaluation, int verbose);
+void write_evaluation_json(const Evaluation* evaluation, FILE* file);
+void write_evaluation_csv(const Evaluation* evaluation, FILE* file);
+void save_evaluation(const Evaluation* evaluation, const char* path);
+void free_evaluation(Evaluation* evaluation);
+
+#endif
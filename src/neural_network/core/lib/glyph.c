@@ -0,0 +1,193 @@
+#include "glyph.h"
+
+#include <err.h>
+#include <string.h>
+
+#include "ocr.h"
+
+/**
+ * @brief Binarizes a 32x32 surface to a glyph with the same OTSU threshold as
+ * to_bw(), without modifying the surface
+ *
+ * @param surface The surface to binarize
+ * @param glyph Where the glyph is written
+ */
+void surface_to_glyph(SDL_Surface* surface, Glyph32* glyph) {
+  if (surface->h != GLYPH_SIZE || surface->w != GLYPH_SIZE)
+    errx(EXIT_FAILURE, "Invalid image size: surface_to_glyph()");
+  Uint8 gray[GLYPH_SIZE * GLYPH_SIZE];
+  surface_to_gray(surface, 1, gray);
+  for (size_t y = 0; y < GLYPH_SIZE; y++) {
+    uint32_t row = 0;
+    for (size_t x = 0; x < GLYPH_SIZE; x++)
+      row |= (uint32_t)(gray[y * GLYPH_SIZE + x] == 0) << x;
+    glyph->rows[y] = row;
+  }
+}
+
+/**
+ * @brief Packs a binarized input of the network to a glyph, inputs below 0.5
+ * being ink
+ *
+ * @param input List of GLYPH_SIZE * GLYPH_SIZE doubles
+ * @param glyph Where the glyph is written
+ */
+void array_to_glyph(const double* input, Glyph32* glyph) {
+  for (size_t y = 0; y < GLYPH_SIZE; y++) {
+    uint32_t row = 0;
+    for (size_t x = 0; x < GLYPH_SIZE; x++)
+      row |= (uint32_t)(input[y * GLYPH_SIZE + x] < .5) << x;
+    glyph->rows[y] = row;
+  }
+}
+
+/**
+ * @brief Unpacks a glyph to an input of the network, 0 for ink and 1 for paper
+ *
+ * @param glyph The glyph to unpack
+ * @param input Where the GLYPH_SIZE * GLYPH_SIZE doubles are written
+ */
+void glyph_to_array(const Glyph32* glyph, double* input) {
+  for (size_t y = 0; y < GLYPH_SIZE; y++) {
+    for (size_t x = 0; x < GLYPH_SIZE; x++)
+      input[y * GLYPH_SIZE + x] = (glyph->rows[y] >> x) & 1 ? 0. : 1.;
+  }
+}
+
+/**
+ * @brief Writes the ink bitmask of a glyph in the layout of pack_ink_bits()
+ *
+ * @param glyph The glyph
+ * @param bits Where the SPARSE_NB_WORDS(GLYPH_SIZE * GLYPH_SIZE) words are
+ * written
+ */
+void glyph_to_ink_bits(const Glyph32* glyph, uint64_t* bits) {
+  for (size_t w = 0; w < GLYPH_SIZE / 2; w++)
+    bits[w] = glyph->rows[2 * w] | (uint64_t)glyph->rows[2 * w + 1] << 32;
+}
+
+/**
+ * @brief Returns the number of ink pixels of a glyph
+ */
+size_t glyph_ink(const Glyph32* glyph) {
+  size_t res = 0;
+  for (size_t y = 0; y < GLYPH_SIZE; y++)
+    res += __builtin_popcount(glyph->rows[y]);
+  return res;
+}
+
+/**
+ * @brief Computes the number of ink pixels of each row and each column of a
+ * glyph
+ *
+ * @param glyph The glyph
+ * @param rows Where the GLYPH_SIZE row counts are written, or NULL
+ * @param columns Where the GLYPH_SIZE column counts are written, or NULL
+ */
+void glyph_profiles(const Glyph32* glyph, uint8_t* rows, uint8_t* columns) {
+  if (rows != NULL) {
+    for (size_t y = 0; y < GLYPH_SIZE; y++)
+      rows[y] = __builtin_popcount(glyph->rows[y]);
+  }
+  if (columns != NULL) {
+    for (size_t x = 0; x < GLYPH_SIZE; x++) {
+      uint8_t count = 0;
+      for (size_t y = 0; y < GLYPH_SIZE; y++)
+        count += (glyph->rows[y] >> x) & 1;
+      columns[x] = count;
+    }
+  }
+}
+
+/**
+ * @brief Returns the bounding box of the ink of a glyph
+ */
+GlyphBox glyph_box(const Glyph32* glyph) {
+  GlyphBox box = {GLYPH_SIZE, -1, GLYPH_SIZE, -1};
+  uint32_t mask = 0;
+  for (int y = 0; y < GLYPH_SIZE; y++) {
+    if (glyph->rows[y] == 0)
+      continue;
+    mask |= glyph->rows[y];
+    if (box.top == GLYPH_SIZE)
+      box.top = y;
+    box.bottom = y;
+  }
+  if (mask != 0) {
+    box.left = __builtin_ctz(mask);
+    box.right = GLYPH_SIZE - 1 - __builtin_clz(mask);
+  }
+  return box;
+}
+
+/**
+ * @brief Moves the ink of a glyph by dx columns (towards the right when
+ * positive) and dy rows (downwards when positive), the pixels moved out of the
+ * glyph being lost
+ *
+ * @param glyph The glyph to shift in place
+ * @param dx Horizontal shift
+ * @param dy Vertical shift
+ */
+void shift_glyph(Glyph32* glyph, int dx, int dy) {
+  uint32_t rows[GLYPH_SIZE];
+  for (int y = 0; y < GLYPH_SIZE; y++) {
+    int from = y - dy;
+    uint32_t row = from >= 0 && from < GLYPH_SIZE ? glyph->rows[from] : 0;
+    if (dx >= GLYPH_SIZE || dx <= -GLYPH_SIZE)
+      row = 0;
+    else if (dx > 0)
+      row <<= dx;
+    else if (dx < 0)
+      row >>= -dx;
+    rows[y] = row;
+  }
+  memcpy(glyph->rows, rows, sizeof(rows));
+}
+
+/**
+ * @brief Moves the ink of a glyph so that its bounding box is centered, the
+ * extra pixel of odd margins going to the right and the bottom
+ *
+ * @param glyph The glyph to center in place
+ */
+void center_glyph(Glyph32* glyph) {
+  GlyphBox box = glyph_box(glyph);
+  if (box.left > box.right)
+    return;
+  int dx = (GLYPH_SIZE - (box.right - box.left + 1)) / 2 - box.left;
+  int dy = (GLYPH_SIZE - (box.bottom - box.top + 1)) / 2 - box.top;
+  shift_glyph(glyph, dx, dy);
+}
+
+/**
+ * @brief Normalizes a glyph to dark ink on light paper, inverting glyphs with
+ * more ink than paper (light letters on a dark cell), then centers it
+ *
+ * @param glyph The glyph to normalize in place
+ */
+void normalize_glyph(Glyph32* glyph) {
+  if (2 * glyph_ink(glyph) > GLYPH_SIZE * GLYPH_SIZE) {
+    for (size_t y = 0; y < GLYPH_SIZE; y++)
+      glyph->rows[y] = ~glyph->rows[y];
+  }
+  center_glyph(glyph);
+}
+
+/**
+ * @brief Forward propagates a glyph through the sparse inference path of a
+ * network with GLYPH_SIZE * GLYPH_SIZE inputs
+ *
+ * @param sparse The sparse inference path of the network
+ * @param context An inference context of the network, receiving the outputs
+ * @param glyph The glyph to predict
+ */
+void predict_glyph(const SparseNetwork* sparse,
+                   NetworkContext* context,
+                   const Glyph32* glyph) {
+  if (sparse->nb_input != GLYPH_SIZE * GLYPH_SIZE)
+    errx(EXIT_FAILURE, "Invalid input size: predict_glyph()");
+  uint64_t bits[SPARSE_NB_WORDS(GLYPH_SIZE * GLYPH_SIZE)];
+  glyph_to_ink_bits(glyph, bits);
+  predict_sparse_nn(sparse, context, bits);
+}
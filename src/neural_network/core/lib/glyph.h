@@ -0,0 +1,47 @@
+#ifndef GLYPH_H
+#define GLYPH_H
+
+#include <SDL2/SDL.h>
+#include <stdint.h>
+
+#include "core_network.h"
+#include "sparse.h"
+
+#define GLYPH_SIZE 32
+
+/**
+ * Binarized 32x32 glyph in 128 bytes: bit x of rows[y] is set when the pixel
+ * (x, y) is ink. Bit y * 32 + x of the glyph is the input y * 32 + x of the
+ * network, as in to_double_array().
+ */
+typedef struct Glyph32 {
+  uint32_t rows[GLYPH_SIZE];
+} Glyph32;
+
+/**
+ * Smallest rectangle holding every ink pixel of a glyph, bounds included.
+ * Empty glyphs have left > right.
+ */
+typedef struct GlyphBox {
+  int left;
+  int right;
+  int top;
+  int bottom;
+} GlyphBox;
+
+void surface_to_glyph(SDL_Surface* surface, Glyph32* glyph);
+void array_to_glyph(const double* input, Glyph32* glyph);
+void glyph_to_array(const Glyph32* glyph, double* input);
+void glyph_to_ink_bits(const Glyph32* glyph, uint64_t* bits);
+
+size_t glyph_ink(const Glyph32* glyph);
+void glyph_profiles(const Glyph32* glyph, uint8_t* rows, uint8_t* columns);
+GlyphBox glyph_box(const Glyph32* glyph);
+void shift_glyph(Glyph32* glyph, int dx, int dy);
+void center_glyph(Glyph32* glyph);
+void normalize_glyph(Glyph32* glyph);
+
+void predict_glyph(const SparseNetwork* sparse,
+                   NetworkContext* context,
+                   const Glyph32* glyph);
+#endif
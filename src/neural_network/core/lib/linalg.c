@@ -0,0 +1,554 @@
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define LINALG_X86
+#endif
+
+#include "linalg.h"
+
+/**
+ * Block sizes of the matrix-matrix product. A BLOCK_K x BLOCK_N panel of B
+ * (128 * 256 doubles = 256 KB) stays in L2 while BLOCK_M rows of A stream
+ * through it, so each weight is loaded from memory once per block of samples
+ * instead of once per sample.
+ */
+#define BLOCK_M 32
+#define BLOCK_N 256
+#define BLOCK_K 128
+
+static size_t min_size(size_t a, size_t b) {
+  return a < b ? a : b;
+}
+
+/**
+ * @brief C += alpha * A.B on one block, A is m x k and B is k x n
+ */
+static void block_nn(size_t i0,
+                     size_t i1,
+                     size_t j0,
+                     size_t j1,
+                     size_t p0,
+                     size_t p1,
+                     double alpha,
+                     const double* restrict a,
+                     size_t lda,
+                     const double* restrict b,
+                     size_t ldb,
+                     double* restrict c,
+                     size_t ldc) {
+  for (size_t i = i0; i < i1; i++) {
+    double* c_row = c + i * ldc;
+    for (size_t p = p0; p < p1; p++) {
+      const double a_ip = alpha * a[i * lda + p];
+      if (a_ip == 0.)
+        continue;
+      const double* b_row = b + p * ldb;
+      for (size_t j = j0; j < j1; j++) {
+        c_row[j] += a_ip * b_row[j];
+      }
+    }
+  }
+}
+
+/**
+ * @brief C += alpha * A^T.B on one block, A is k x m and B is k x n
+ */
+static void block_tn(size_t i0,
+                     size_t i1,
+                     size_t j0,
+                     size_t j1,
+                     size_t p0,
+                     size_t p1,
+                     double alpha,
+                     const double* restrict a,
+                     size_t lda,
+                     const double* restrict b,
+                     size_t ldb,
+                     double* restrict c,
+                     size_t ldc) {
+  for (size_t p = p0; p < p1; p++) {
+    const double* b_row = b + p * ldb;
+    for (size_t i = i0; i < i1; i++) {
+      const double a_pi = alpha * a[p * lda + i];
+      if (a_pi == 0.)
+        continue;
+      double* c_row = c + i * ldc;
+      for (size_t j = j0; j < j1; j++) {
+        c_row[j] += a_pi * b_row[j];
+      }
+    }
+  }
+}
+
+/**
+ * @brief C[i..i+4][j..j+4] += alpha * A.B^T: 4 rows of A (e.g. samples) by 4
+ * rows of B (e.g. neurons) in 16 accumulators, so that each element of B
+ * loaded serves 4 rows of A and each element of A serves 4 rows of B
+ */
+static inline void micro_nt_4x4(size_t i,
+                                size_t j,
+                                size_t p0,
+                                size_t p1,
+                                double alpha,
+                                const double* restrict a,
+                                size_t lda,
+                                const double* restrict b,
+                                size_t ldb,
+                                double* restrict c,
+                                size_t ldc) {
+  const double* a_0 = a + i * lda;
+  const double* a_1 = a_0 + lda;
+  const double* a_2 = a_1 + lda;
+  const double* a_3 = a_2 + lda;
+  const double* b_0 = b + j * ldb;
+  const double* b_1 = b_0 + ldb;
+  const double* b_2 = b_1 + ldb;
+  const double* b_3 = b_2 + ldb;
+  double t_00 = 0., t_01 = 0., t_02 = 0., t_03 = 0.;
+  double t_10 = 0., t_11 = 0., t_12 = 0., t_13 = 0.;
+  double t_20 = 0., t_21 = 0., t_22 = 0., t_23 = 0.;
+  double t_30 = 0., t_31 = 0., t_32 = 0., t_33 = 0.;
+  for (size_t p = p0; p < p1; p++) {
+    const double x_0 = a_0[p], x_1 = a_1[p], x_2 = a_2[p], x_3 = a_3[p];
+    double w = b_0[p];
+    t_00 += x_0 * w;
+    t_10 += x_1 * w;
+    t_20 += x_2 * w;
+    t_30 += x_3 * w;
+    w = b_1[p];
+    t_01 += x_0 * w;
+    t_11 += x_1 * w;
+    t_21 += x_2 * w;
+    t_31 += x_3 * w;
+    w = b_2[p];
+    t_02 += x_0 * w;
+    t_12 += x_1 * w;
+    t_22 += x_2 * w;
+    t_32 += x_3 * w;
+    w = b_3[p];
+    t_03 += x_0 * w;
+    t_13 += x_1 * w;
+    t_23 += x_2 * w;
+    t_33 += x_3 * w;
+  }
+  double* c_0 = c + i * ldc + j;
+  double* c_1 = c_0 + ldc;
+  double* c_2 = c_1 + ldc;
+  double* c_3 = c_2 + ldc;
+  c_0[0] += alpha * t_00;
+  c_0[1] += alpha * t_01;
+  c_0[2] += alpha * t_02;
+  c_0[3] += alpha * t_03;
+  c_1[0] += alpha * t_10;
+  c_1[1] += alpha * t_11;
+  c_1[2] += alpha * t_12;
+  c_1[3] += alpha * t_13;
+  c_2[0] += alpha * t_20;
+  c_2[1] += alpha * t_21;
+  c_2[2] += alpha * t_22;
+  c_2[3] += alpha * t_23;
+  c_3[0] += alpha * t_30;
+  c_3[1] += alpha * t_31;
+  c_3[2] += alpha * t_32;
+  c_3[3] += alpha * t_33;
+}
+
+/**
+ * @brief C[i][j0..j1] += alpha * A.B^T for one row of A. Columns of C are
+ * computed 4 at a time so that each element of A loaded is reused by 4
+ * independent accumulators.
+ */
+static void row_nt(size_t i,
+                   size_t j0,
+                   size_t j1,
+                   size_t p0,
+                   size_t p1,
+                   double alpha,
+                   const double* restrict a,
+                   size_t lda,
+                   const double* restrict b,
+                   size_t ldb,
+                   double* restrict c,
+                   size_t ldc) {
+  const double* a_row = a + i * lda;
+  double* c_row = c + i * ldc;
+  size_t j = j0;
+  for (; j + 4 <= j1; j += 4) {
+    const double* b_0 = b + j * ldb;
+    const double* b_1 = b_0 + ldb;
+    const double* b_2 = b_1 + ldb;
+    const double* b_3 = b_2 + ldb;
+    double total_0 = 0., total_1 = 0., total_2 = 0., total_3 = 0.;
+    for (size_t p = p0; p < p1; p++) {
+      const double a_ip = a_row[p];
+      total_0 += a_ip * b_0[p];
+      total_1 += a_ip * b_1[p];
+      total_2 += a_ip * b_2[p];
+      total_3 += a_ip * b_3[p];
+    }
+    c_row[j] += alpha * total_0;
+    c_row[j + 1] += alpha * total_1;
+    c_row[j + 2] += alpha * total_2;
+    c_row[j + 3] += alpha * total_3;
+  }
+  for (; j < j1; j++) {
+    const double* b_row = b + j * ldb;
+    double total = 0.;
+    for (size_t p = p0; p < p1; p++) {
+      total += a_row[p] * b_row[p];
+    }
+    c_row[j] += alpha * total;
+  }
+}
+
+/**
+ * @brief C += alpha * A.B^T on one block, A is m x k and B is n x k. The
+ * block is covered by 4x4 tiles of C (see micro_nt_4x4()), the rows and
+ * columns left over by row_nt().
+ */
+static void block_nt(size_t i0,
+                     size_t i1,
+                     size_t j0,
+                     size_t j1,
+                     size_t p0,
+                     size_t p1,
+                     double alpha,
+                     const double* restrict a,
+                     size_t lda,
+                     const double* restrict b,
+                     size_t ldb,
+                     double* restrict c,
+                     size_t ldc) {
+  const size_t j4 = j0 + (j1 - j0) / 4 * 4;
+  size_t i = i0;
+  for (; i + 4 <= i1; i += 4) {
+    for (size_t j = j0; j < j4; j += 4)
+      micro_nt_4x4(i, j, p0, p1, alpha, a, lda, b, ldb, c, ldc);
+    for (size_t r = i; r < i + 4 && j4 < j1; r++)
+      row_nt(r, j4, j1, p0, p1, alpha, a, lda, b, ldb, c, ldc);
+  }
+  for (; i < i1; i++)
+    row_nt(i, j0, j1, p0, p1, alpha, a, lda, b, ldb, c, ldc);
+}
+
+/**
+ * @brief C += alpha * A^T.B^T on one block, A is k x m and B is n x k
+ */
+static void block_tt(size_t i0,
+                     size_t i1,
+                     size_t j0,
+                     size_t j1,
+                     size_t p0,
+                     size_t p1,
+                     double alpha,
+                     const double* restrict a,
+                     size_t lda,
+                     const double* restrict b,
+                     size_t ldb,
+                     double* restrict c,
+                     size_t ldc) {
+  for (size_t i = i0; i < i1; i++) {
+    for (size_t j = j0; j < j1; j++) {
+      double total = 0.;
+      for (size_t p = p0; p < p1; p++) {
+        total += a[p * lda + i] * b[j * ldb + p];
+      }
+      c[i * ldc + j] += alpha * total;
+    }
+  }
+}
+
+/**
+ * @brief Blocked general matrix-matrix product on row-major matrices:
+ * C = alpha * op(A).op(B) + beta * C, where op(X) is X or its transpose.
+ *
+ * @param trans_a Whether A is used transposed
+ * @param trans_b Whether B is used transposed
+ * @param m Number of rows of op(A) and C
+ * @param n Number of columns of op(B) and C
+ * @param k Number of columns of op(A) and rows of op(B)
+ * @param alpha Scale factor of the product
+ * @param a Pointer to the first element of A
+ * @param lda Row stride of A (in elements)
+ * @param b Pointer to the first element of B
+ * @param ldb Row stride of B (in elements)
+ * @param beta Scale factor of C before accumulation (0 overwrites C)
+ * @param c Pointer to the first element of C
+ * @param ldc Row stride of C (in elements)
+ */
+void gemm(Transpose trans_a,
+          Transpose trans_b,
+          size_t m,
+          size_t n,
+          size_t k,
+          double alpha,
+          const double* a,
+          size_t lda,
+          const double* b,
+          size_t ldb,
+          double beta,
+          double* c,
+          size_t ldc) {
+  if (beta == 0.) {
+    for (size_t i = 0; i < m; i++) {
+      memset(c + i * ldc, 0, n * sizeof(double));
+    }
+  } else if (beta != 1.) {
+    for (size_t i = 0; i < m; i++) {
+      for (size_t j = 0; j < n; j++) {
+        c[i * ldc + j] *= beta;
+      }
+    }
+  }
+  if (alpha == 0.)
+    return;
+
+  void (*block)(size_t, size_t, size_t, size_t, size_t, size_t, double,
+                const double*, size_t, const double*, size_t, double*, size_t);
+  if (trans_a == NO_TRANS && trans_b == NO_TRANS)
+    block = &block_nn;
+  else if (trans_a == TRANS && trans_b == NO_TRANS)
+    block = &block_tn;
+  else if (trans_a == NO_TRANS && trans_b == TRANS)
+    block = &block_nt;
+  else
+    block = &block_tt;
+
+  for (size_t p0 = 0; p0 < k; p0 += BLOCK_K) {
+    size_t p1 = min_size(p0 + BLOCK_K, k);
+    for (size_t j0 = 0; j0 < n; j0 += BLOCK_N) {
+      size_t j1 = min_size(j0 + BLOCK_N, n);
+      for (size_t i0 = 0; i0 < m; i0 += BLOCK_M) {
+        size_t i1 = min_size(i0 + BLOCK_M, m);
+        (*block)(i0, i1, j0, j1, p0, p1, alpha, a, lda, b, ldb, c, ldc);
+      }
+    }
+  }
+}
+
+/**
+ * Single precision kernels. Each one has a portable version and, on x86, SSE
+ * and AVX2/FMA versions compiled with target attributes so that the binary
+ * still runs on older CPUs. The best version supported by the CPU is selected
+ * at the first call.
+ */
+
+static float dot_f32_scalar(const float* a, const float* b, size_t n) {
+  float total = 0.f;
+  for (size_t i = 0; i < n; i++) {
+    total += a[i] * b[i];
+  }
+  return total;
+}
+
+static void axpy_f32_scalar(float alpha, const float* x, float* y, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    y[i] += alpha * x[i];
+  }
+}
+
+static int32_t dot_u8_i8_scalar(const uint8_t* a, const int8_t* b, size_t n) {
+  int32_t total = 0;
+  for (size_t i = 0; i < n; i++) {
+    total += (int32_t)a[i] * (int32_t)b[i];
+  }
+  return total;
+}
+
+#ifdef LINALG_X86
+__attribute__((target("sse"))) static float dot_f32_sse(const float* a,
+                                                       const float* b,
+                                                       size_t n) {
+  __m128 acc0 = _mm_setzero_ps();
+  __m128 acc1 = _mm_setzero_ps();
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    acc0 =
+        _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+    acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(a + i + 4),
+                                       _mm_loadu_ps(b + i + 4)));
+  }
+  float lanes[4];
+  _mm_storeu_ps(lanes, _mm_add_ps(acc0, acc1));
+  float total = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+  for (; i < n; i++) {
+    total += a[i] * b[i];
+  }
+  return total;
+}
+
+__attribute__((target("sse"))) static void axpy_f32_sse(float alpha,
+                                                       const float* x,
+                                                       float* y,
+                                                       size_t n) {
+  __m128 factor = _mm_set1_ps(alpha);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    _mm_storeu_ps(y + i, _mm_add_ps(_mm_loadu_ps(y + i),
+                                    _mm_mul_ps(factor, _mm_loadu_ps(x + i))));
+  }
+  for (; i < n; i++) {
+    y[i] += alpha * x[i];
+  }
+}
+
+__attribute__((target("avx2,fma"))) static float dot_f32_avx2(const float* a,
+                                                             const float* b,
+                                                             size_t n) {
+  __m256 acc0 = _mm256_setzero_ps();
+  __m256 acc1 = _mm256_setzero_ps();
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    acc0 =
+        _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+    acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8),
+                           _mm256_loadu_ps(b + i + 8), acc1);
+  }
+  __m256 acc = _mm256_add_ps(acc0, acc1);
+  __m128 half = _mm_add_ps(_mm256_castps256_ps128(acc),
+                           _mm256_extractf128_ps(acc, 1));
+  half = _mm_add_ps(half, _mm_movehl_ps(half, half));
+  half = _mm_add_ss(half, _mm_shuffle_ps(half, half, 1));
+  float total = _mm_cvtss_f32(half);
+  for (; i < n; i++) {
+    total += a[i] * b[i];
+  }
+  return total;
+}
+
+__attribute__((target("avx2,fma"))) static void axpy_f32_avx2(float alpha,
+                                                             const float* x,
+                                                             float* y,
+                                                             size_t n) {
+  __m256 factor = _mm256_set1_ps(alpha);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256 result =
+        _mm256_fmadd_ps(factor, _mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i));
+    _mm256_storeu_ps(y + i, result);
+  }
+  for (; i < n; i++) {
+    y[i] += alpha * x[i];
+  }
+}
+
+/**
+ * Both operands are widened to 16 bits before _mm256_madd_epi16, which is exact
+ * (|255 * 127| * 2 fits in 32 bits) unlike the saturating _mm256_maddubs_epi16.
+ */
+__attribute__((target("avx2"))) static int32_t dot_u8_i8_avx2(const uint8_t* a,
+                                                             const int8_t* b,
+                                                             size_t n) {
+  __m256i acc = _mm256_setzero_si256();
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m256i wide_a =
+        _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(a + i)));
+    __m256i wide_b =
+        _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(b + i)));
+    acc = _mm256_add_epi32(acc, _mm256_madd_epi16(wide_a, wide_b));
+  }
+  __m128i half = _mm_add_epi32(_mm256_castsi256_si128(acc),
+                               _mm256_extracti128_si256(acc, 1));
+  half = _mm_add_epi32(half, _mm_shuffle_epi32(half, _MM_SHUFFLE(1, 0, 3, 2)));
+  half = _mm_add_epi32(half, _mm_shuffle_epi32(half, _MM_SHUFFLE(2, 3, 0, 1)));
+  int32_t total = _mm_cvtsi128_si32(half);
+  for (; i < n; i++) {
+    total += (int32_t)a[i] * (int32_t)b[i];
+  }
+  return total;
+}
+#endif
+
+typedef enum SimdLevel {
+  SIMD_UNKNOWN,
+  SIMD_NONE,
+  SIMD_SSE,
+  SIMD_AVX2
+} SimdLevel;
+
+/**
+ * @brief Returns the best instruction set supported by the CPU, detected once
+ */
+static SimdLevel get_simd_level(void) {
+  static SimdLevel level = SIMD_UNKNOWN;
+  if (level == SIMD_UNKNOWN) {
+#ifdef LINALG_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+      level = SIMD_AVX2;
+    else if (__builtin_cpu_supports("sse"))
+      level = SIMD_SSE;
+    else
+      level = SIMD_NONE;
+#else
+    level = SIMD_NONE;
+#endif
+  }
+  return level;
+}
+
+/**
+ * @brief Returns the name of the instruction set used by the single precision
+ * kernels
+ */
+const char* simd_level(void) {
+  switch (get_simd_level()) {
+    case SIMD_AVX2:
+      return "avx2";
+    case SIMD_SSE:
+      return "sse";
+    default:
+      return "scalar";
+  }
+}
+
+/**
+ * @brief Dot product of two float lists of size n
+ */
+float dot_f32(const float* a, const float* b, size_t n) {
+#ifdef LINALG_X86
+  switch (get_simd_level()) {
+    case SIMD_AVX2:
+      return dot_f32_avx2(a, b, n);
+    case SIMD_SSE:
+      return dot_f32_sse(a, b, n);
+    default:
+      break;
+  }
+#endif
+  return dot_f32_scalar(a, b, n);
+}
+
+/**
+ * @brief y += alpha * x, where x and y are float lists of size n
+ */
+void axpy_f32(float alpha, const float* x, float* y, size_t n) {
+#ifdef LINALG_X86
+  switch (get_simd_level()) {
+    case SIMD_AVX2:
+      axpy_f32_avx2(alpha, x, y, n);
+      return;
+    case SIMD_SSE:
+      axpy_f32_sse(alpha, x, y, n);
+      return;
+    default:
+      break;
+  }
+#endif
+  axpy_f32_scalar(alpha, x, y, n);
+}
+
+/**
+ * @brief Dot product of an unsigned and a signed 8 bits integer list of size n,
+ * accumulated on 32 bits
+ */
+int32_t dot_u8_i8(const uint8_t* a, const int8_t* b, size_t n) {
+#ifdef LINALG_X86
+  if (get_simd_level() == SIMD_AVX2)
+    return dot_u8_i8_avx2(a, b, n);
+#endif
+  return dot_u8_i8_scalar(a, b, n);
+}
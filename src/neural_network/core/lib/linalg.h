@@ -0,0 +1,28 @@
+#ifndef LINALG_H
+#define LINALG_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+typedef enum Transpose { NO_TRANS, TRANS } Transpose;
+
+void gemm(Transpose trans_a,
+          Transpose trans_b,
+          size_t m,
+          size_t n,
+          size_t k,
+          double alpha,
+          const double* a,
+          size_t lda,
+          const double* b,
+          size_t ldb,
+          double beta,
+          double* c,
+          size_t ldc);
+
+float dot_f32(const float* a, const float* b, size_t n);
+void axpy_f32(float alpha, const float* x, float* y, size_t n);
+int32_t dot_u8_i8(const uint8_t* a, const int8_t* b, size_t n);
+const char* simd_level(void);
+
+#endif
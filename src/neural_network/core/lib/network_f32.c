@@ -0,0 +1,426 @@
+#include <err.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "core_network.h"
+#include "linalg.h"
+#include "network_f32.h"
+
+/**
+ * @brief Allocates a single precision network of dense layers with all
+ * parameters set to 0
+ */
+static NetworkF32* alloc_nn_f32(size_t input_layer_size,
+                                size_t nb_layers,
+                                const size_t* layer_sizes,
+                                const ActivationFunction* activations) {
+  if (nb_layers == 0) {
+    errx(EXIT_FAILURE, "A network needs at least one layer");
+  }
+  NetworkF32* network = malloc(sizeof(NetworkF32));
+  LayerF32* layers = calloc(nb_layers, sizeof(LayerF32));
+  if (network == NULL || layers == NULL) {
+    errx(EXIT_FAILURE, "Memory allocation failed");
+  }
+  network->nb_input = input_layer_size;
+  network->nb_output = layer_sizes[nb_layers - 1];
+  network->nb_layers = nb_layers;
+  network->layers = layers;
+
+  size_t nb_input = input_layer_size;
+  for (size_t l = 0; l < nb_layers; l++) {
+    LayerF32* layer = &layers[l];
+    if (activations[l] == SOFTMAX && l != nb_layers - 1) {
+      errx(EXIT_FAILURE, "Softmax on hidden layer is not supported");
+    }
+    if (!get_activation(activations[l], &layer->fct, &layer->d_fct)) {
+      errx(EXIT_FAILURE, "Unknown activation function");
+    }
+    layer->nb_input = nb_input;
+    layer->nb_output = layer_sizes[l];
+    layer->activation = activations[l];
+    layer->weights = calloc(nb_input * layer_sizes[l], sizeof(float));
+    layer->biases = calloc(layer_sizes[l], sizeof(float));
+    if (layer->weights == NULL || layer->biases == NULL) {
+      errx(EXIT_FAILURE, "Memory allocation failed");
+    }
+    nb_input = layer_sizes[l];
+  }
+  return network;
+}
+
+/**
+ * @brief Initialize a single precision network made of a stack of dense
+ * layers and returns a pointer to a newly allocated struct. Same parameters
+ * and weight initialization as init_nn_layers().
+ *
+ * **NOTE**: The struct should be freed using the free_nn_f32() function.
+ *
+ * @return pointer to initialized neural network
+ */
+NetworkF32* init_nn_layers_f32(size_t input_layer_size,
+                               size_t nb_layers,
+                               const size_t* layer_sizes,
+                               const ActivationFunction* activations) {
+  NetworkF32* network =
+      alloc_nn_f32(input_layer_size, nb_layers, layer_sizes, activations);
+  for (size_t l = 0; l < nb_layers; l++) {
+    LayerF32* layer = &network->layers[l];
+    for (size_t i = 0; i < layer->nb_input * layer->nb_output; i++) {
+      layer->weights[i] = ((double)rand() / (RAND_MAX / 2) - 1.) / 2.;
+    }
+  }
+  return network;
+}
+
+/**
+ * @brief Initialize a single precision neural network with one hidden layer
+ * and returns a pointer to a newly allocated struct. Same parameters and
+ * weight initialization as init_nn().
+ *
+ * **NOTE**: The struct should be freed using the free_nn_f32() function.
+ *
+ * @return pointer to initialized neural network
+ */
+NetworkF32* init_nn_f32(size_t input_layer_size,
+                        size_t hidden_layer_size,
+                        size_t output_layer_size,
+                        ActivationFunction activation_hidden,
+                        ActivationFunction activation_output) {
+  const size_t sizes[2] = {hidden_layer_size, output_layer_size};
+  const ActivationFunction activations[2] = {activation_hidden,
+                                             activation_output};
+  return init_nn_layers_f32(input_layer_size, 2, sizes, activations);
+}
+
+/**
+ * @brief Allocates one float list per layer of a network, of the size of the
+ * layer
+ */
+static float** alloc_layer_lists_f32(const NetworkF32* network) {
+  float** res = calloc(network->nb_layers, sizeof(float*));
+  if (res == NULL) {
+    errx(EXIT_FAILURE, "Error while allocating memory");
+  }
+  for (size_t l = 0; l < network->nb_layers; l++) {
+    res[l] = calloc(network->layers[l].nb_output, sizeof(float));
+    if (res[l] == NULL) {
+      errx(EXIT_FAILURE, "Error while allocating memory");
+    }
+  }
+  return res;
+}
+
+/**
+ * @brief Frees an array allocated by alloc_layer_lists_f32()
+ */
+static void free_layer_lists_f32(float** lists, size_t nb_layers) {
+  for (size_t l = 0; l < nb_layers; l++) {
+    free(lists[l]);
+  }
+  free(lists);
+}
+
+/**
+ * @brief Returns an inference context adapted for the specified single
+ * precision network
+ *
+ *  **NOTE**: The pointer has to be freed after use using free_nc_f32()
+ *
+ * @param network A pointer to the neural network structure
+ * @return pointer to initialized inference context
+ */
+NetworkContextF32* init_nc_f32(const NetworkF32* network) {
+  NetworkContextF32* context = malloc(sizeof(NetworkContextF32));
+  if (context == NULL) {
+    errx(EXIT_FAILURE, "Error while allocating memory");
+  }
+  context->nb_layers = network->nb_layers;
+  context->layers = alloc_layer_lists_f32(network);
+  context->output = context->layers[network->nb_layers - 1];
+  return context;
+}
+
+/**
+ * @brief Returns a trainer struct pointer which is adapted for the specified
+ * single precision neural network
+ *
+ *  **NOTE**: The pointer has to be freed after use using free_nt_f32()
+ *
+ * @param network A pointer to the neural network structure to train.
+ * @return pointer to initialized trainer structure
+ */
+NetworkTrainerF32* init_nt_f32(const NetworkF32* network) {
+  NetworkTrainerF32* trainer = malloc(sizeof(NetworkTrainerF32));
+  if (trainer == NULL) {
+    errx(EXIT_FAILURE, "Error while allocating memory");
+  }
+  trainer->context = init_nc_f32(network);
+  trainer->gradients = alloc_layer_lists_f32(network);
+  return trainer;
+}
+
+/**
+ * @brief Returns whether a network can be converted by nn_to_f32(): single
+ * precision networks only have dense layers
+ */
+int can_convert_nn_f32(const Network* network) {
+  for (size_t l = 0; l < network->nb_layers; l++) {
+    if (network->layers[l].type != LAYER_DENSE)
+      return 0;
+  }
+  return 1;
+}
+
+/**
+ * @brief Converts a double precision network (e.g. from load_nn_data()) to a
+ * newly allocated single precision network. Only networks of dense layers can
+ * be converted, see can_convert_nn_f32().
+ *
+ * @param network A pointer to the double precision network
+ * @return pointer to the single precision network
+ */
+NetworkF32* nn_to_f32(const Network* network) {
+  if (!can_convert_nn_f32(network)) {
+    errx(EXIT_FAILURE, "Single precision networks only have dense layers");
+  }
+  size_t* sizes = calloc(network->nb_layers, sizeof(size_t));
+  ActivationFunction* activations =
+      calloc(network->nb_layers, sizeof(ActivationFunction));
+  if (sizes == NULL || activations == NULL) {
+    errx(EXIT_FAILURE, "Memory allocation failed");
+  }
+  for (size_t l = 0; l < network->nb_layers; l++) {
+    sizes[l] = network->layers[l].nb_output;
+    activations[l] = network->layers[l].activation;
+  }
+  NetworkF32* res =
+      alloc_nn_f32(network->nb_input, network->nb_layers, sizes, activations);
+  free(sizes);
+  free(activations);
+
+  // Both variants store weights output-major
+  for (size_t l = 0; l < network->nb_layers; l++) {
+    const Layer* layer = &network->layers[l];
+    LayerF32* layer_f32 = &res->layers[l];
+    for (size_t i = 0; i < layer->nb_input * layer->nb_output; i++) {
+      layer_f32->weights[i] = (float)layer->weights[i];
+    }
+    for (size_t o = 0; o < layer->nb_output; o++) {
+      layer_f32->biases[o] = (float)layer->biases[o];
+    }
+  }
+  return res;
+}
+
+/**
+ * @brief Converts a single precision network to a newly allocated double
+ * precision network
+ *
+ * @param network A pointer to the single precision network
+ * @return pointer to the double precision network
+ */
+Network* f32_to_nn(const NetworkF32* network) {
+  size_t* sizes = calloc(network->nb_layers, sizeof(size_t));
+  ActivationFunction* activations =
+      calloc(network->nb_layers, sizeof(ActivationFunction));
+  if (sizes == NULL || activations == NULL) {
+    errx(EXIT_FAILURE, "Memory allocation failed");
+  }
+  for (size_t l = 0; l < network->nb_layers; l++) {
+    sizes[l] = network->layers[l].nb_output;
+    activations[l] = network->layers[l].activation;
+  }
+  Network* res = init_nn_layers(network->nb_input, network->nb_layers, sizes,
+                                activations);
+  free(sizes);
+  free(activations);
+
+  for (size_t l = 0; l < network->nb_layers; l++) {
+    const LayerF32* layer_f32 = &network->layers[l];
+    Layer* layer = &res->layers[l];
+    for (size_t i = 0; i < layer->nb_input * layer->nb_output; i++) {
+      layer->weights[i] = layer_f32->weights[i];
+    }
+    for (size_t o = 0; o < layer->nb_output; o++) {
+      layer->biases[o] = layer_f32->biases[o];
+    }
+  }
+  return res;
+}
+
+/**
+ * @brief Loads a model saved by save_nn_data() as a single precision network
+ *
+ * @param path The file path where the neural network data has been saved.
+ * @return pointer to loaded neural network struct
+ */
+NetworkF32* load_nn_data_f32(const char* path) {
+  Network* network = load_nn_data(path);
+  NetworkF32* res = nn_to_f32(network);
+  free_nn(network);
+  return res;
+}
+
+/**
+ * @brief Saves a single precision network in the format of save_nn_data(), so
+ * that it can be loaded by both load_nn_data() and load_nn_data_f32()
+ *
+ * @param network A pointer to the neural network structure to save
+ * @param path The file path where the neural network data will be saved.
+ */
+void save_nn_data_f32(const NetworkF32* network, const char* path) {
+  Network* res = f32_to_nn(network);
+  save_nn_data(res, path);
+  free_nn(res);
+}
+
+/**
+ * @brief Applies softmax in place on a list of floats
+ */
+static void softmax_f32(float* values, size_t size) {
+  float max_output = values[0];
+  for (size_t i = 0; i < size; i++) {
+    if (values[i] > max_output) {
+      max_output = values[i];
+    }
+  }
+
+  float total = 0.f;
+  for (size_t i = 0; i < size; i++) {
+    values[i] = expf(values[i] - max_output);
+    total += values[i];
+  }
+
+  for (size_t i = 0; i < size; i++) {
+    values[i] /= total;
+  }
+}
+
+/**
+ * @brief Forward propagates the input data. Result is stored in the output
+ * list of the inference context, the network itself is only read so it can be
+ * shared between threads as long as each of them uses its own context. Each
+ * neuron is computed as one SIMD dot product over a contiguous row of weights.
+ *
+ * @param network A pointer to the neural network structure
+ * @param context A pointer to the inference context receiving the activations
+ * @param input A float list of size equal to the input layer size
+ */
+void predict_nn_f32(const NetworkF32* network,
+                    NetworkContextF32* context,
+                    const float* input) {
+  for (size_t l = 0; l < network->nb_layers; l++) {
+    const LayerF32* layer = &network->layers[l];
+    const float* layer_input = l == 0 ? input : context->layers[l - 1];
+    float* res = context->layers[l];
+    for (size_t o = 0; o < layer->nb_output; o++) {
+      res[o] = dot_f32(layer->weights + o * layer->nb_input, layer_input,
+                       layer->nb_input) +
+               layer->biases[o];
+    }
+    if (layer->activation == SOFTMAX) {
+      softmax_f32(res, layer->nb_output);
+    } else {
+      for (size_t o = 0; o < layer->nb_output; o++) {
+        res[o] = (float)(*layer->fct)(res[o]);
+      }
+    }
+  }
+}
+
+/**
+ * @brief Trains the single precision network on one sample, like train_nn().
+ * Back propagation and weight updates are SIMD axpy over rows of weights.
+ *
+ * @param trainer A pointer to the trainer structure
+ * @param network A pointer to the neural network structure to train
+ * @param input A float list of size equal to the input layer size
+ * @param target A float list of size equal to the output layer size
+ * @param lr Learning rate
+ */
+void train_nn_f32(NetworkTrainerF32* trainer,
+                  NetworkF32* network,
+                  const float* input,
+                  const float* target,
+                  float lr) {
+  NetworkContextF32* context = trainer->context;
+  predict_nn_f32(network, context, input);
+
+  const size_t last = network->nb_layers - 1;
+  const LayerF32* output = &network->layers[last];
+  float* gradients_output = trainer->gradients[last];
+  for (size_t o = 0; o < output->nb_output; o++) {
+    if (output->activation == SOFTMAX)
+      gradients_output[o] = context->output[o] - target[o];
+    else
+      gradients_output[o] = (context->output[o] - target[o]) *
+                            (float)(*output->d_fct)(context->output[o]);
+  }
+
+  // Gradients of every layer are computed before any weight changes
+  for (size_t l = last; l > 0; l--) {
+    const LayerF32* layer = &network->layers[l];
+    const LayerF32* previous = &network->layers[l - 1];
+    float* gradients = trainer->gradients[l];
+    float* gradients_previous = trainer->gradients[l - 1];
+    memset(gradients_previous, 0, previous->nb_output * sizeof(float));
+    for (size_t o = 0; o < layer->nb_output; o++) {
+      axpy_f32(gradients[o], layer->weights + o * layer->nb_input,
+               gradients_previous, layer->nb_input);
+    }
+    for (size_t h = 0; h < previous->nb_output; h++) {
+      gradients_previous[h] *=
+          (float)(*previous->d_fct)(context->layers[l - 1][h]);
+    }
+  }
+
+  for (size_t l = 0; l < network->nb_layers; l++) {
+    LayerF32* layer = &network->layers[l];
+    const float* layer_input = l == 0 ? input : context->layers[l - 1];
+    const float* gradients = trainer->gradients[l];
+    for (size_t o = 0; o < layer->nb_output; o++) {
+      if (gradients[o] == 0.f)
+        continue;  // Inactive RELU neuron
+      axpy_f32(-lr * gradients[o], layer_input,
+               layer->weights + o * layer->nb_input, layer->nb_input);
+      layer->biases[o] -= lr * gradients[o];
+    }
+  }
+}
+
+/**
+ * @brief Frees a single precision inference context heap-allocated memory
+ *
+ * @param context A pointer to the inference context
+ */
+void free_nc_f32(NetworkContextF32* context) {
+  free_layer_lists_f32(context->layers, context->nb_layers);
+  free(context);
+}
+
+/**
+ * @brief Frees a single precision trainer heap-allocated memory
+ *
+ * @param trainer A pointer to the trainer structure
+ */
+void free_nt_f32(NetworkTrainerF32* trainer) {
+  free_layer_lists_f32(trainer->gradients, trainer->context->nb_layers);
+  free_nc_f32(trainer->context);
+  free(trainer);
+}
+
+/**
+ * @brief Frees a single precision neural network heap-allocated memory
+ *
+ * @param network A pointer to the neural network structure to free
+ */
+void free_nn_f32(NetworkF32* network) {
+  for (size_t l = 0; l < network->nb_layers; l++) {
+    free(network->layers[l].weights);
+    free(network->layers[l].biases);
+  }
+  free(network->layers);
+  free(network);
+}
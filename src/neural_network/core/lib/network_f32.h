@@ -0,0 +1,80 @@
+#ifndef NETWORK_F32_H
+#define NETWORK_F32_H
+
+#include <stdlib.h>
+
+#include "core_network.h"
+
+/**
+ * Dense layer of a single precision network. Weights are stored output-major
+ * like Network (one contiguous row of inputs per neuron) so that each neuron
+ * is a SIMD dot product, and float halves the memory traffic of the weight
+ * matrices.
+ */
+typedef struct LayerF32 {
+  size_t nb_input;
+  size_t nb_output;
+  float* weights;  // nb_output rows of nb_input weights
+  float* biases;
+  ActivationFunction activation;
+  double (*fct)(double);
+  double (*d_fct)(double);
+} LayerF32;
+
+/**
+ * Single precision variant of a Network made of dense layers
+ */
+typedef struct NetworkF32 {
+  size_t nb_input;
+  size_t nb_output;
+  size_t nb_layers;
+  LayerF32* layers;
+} NetworkF32;
+
+/**
+ * Per-thread inference state of a single precision network, so that a network
+ * can be shared between threads
+ */
+typedef struct NetworkContextF32 {
+  size_t nb_layers;
+  float** layers;  // Activations of each layer
+  float* output;   // Activations of the last layer
+} NetworkContextF32;
+
+typedef struct NetworkTrainerF32 {
+  NetworkContextF32* context;  // Activations of the sample being trained
+  float** gradients;           // Gradients of the errors of each layer
+} NetworkTrainerF32;
+
+NetworkF32* init_nn_f32(size_t input_layer_size,
+                        size_t hidden_layer_size,
+                        size_t output_layer_size,
+                        ActivationFunction activation_hidden,
+                        ActivationFunction activation_output);
+NetworkF32* init_nn_layers_f32(size_t input_layer_size,
+                               size_t nb_layers,
+                               const size_t* layer_sizes,
+                               const ActivationFunction* activations);
+NetworkContextF32* init_nc_f32(const NetworkF32* network);
+NetworkTrainerF32* init_nt_f32(const NetworkF32* network);
+
+int can_convert_nn_f32(const Network* network);
+NetworkF32* nn_to_f32(const Network* network);
+Network* f32_to_nn(const NetworkF32* network);
+NetworkF32* load_nn_data_f32(const char* path);
+void save_nn_data_f32(const NetworkF32* network, const char* path);
+
+void predict_nn_f32(const NetworkF32* network,
+                    NetworkContextF32* context,
+                    const float* input);
+void train_nn_f32(NetworkTrainerF32* trainer,
+                  NetworkF32* network,
+                  const float* input,
+                  const float* target,
+                  float lr);
+
+void free_nc_f32(NetworkContextF32* context);
+void free_nt_f32(NetworkTrainerF32* trainer);
+void free_nn_f32(NetworkF32* network);
+
+#endif
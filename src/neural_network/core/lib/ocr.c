@@ -2,14 +2,13 @@
 #include <SDL2/SDL_image.h>
 #include <dirent.h>
 #include <err.h>
+#include <math.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
 #include "core_network.h"
-
-#define OUTPUT_SIZE 26
-#define IMG_H 32
-#define IMG_W 32
+#include "ocr.h"
 
 /**
  * @brief Returns a pointer to an Neural network struct initialized for OCR
@@ -103,30 +102,122 @@ SDL_Surface* load_image(const char* path) {
   return img;
 }
 
+// Fixed point weights (summing to 1 << 16) of the luma 0.299 R + 0.587 G +
+// 0.114 B, so that the luma of a gray pixel is its value
+#define LUMA_R 19595
+#define LUMA_G 38470
+#define LUMA_B 7471
+
 /**
- * @brief Compute the OTSU threshold of a surface
- *
- * @param surface - An SDL surface to which OTSU threshold needs to be computed
- * @return The otsu threshold
+ * @brief Returns whether the pixels of a format are 32 bits 0xAARRGGBB words
+ * (SDL_PIXELFORMAT_RGB888 as returned by load_image(), or ARGB8888), whose
+ * channels are read with shifts instead of SDL_GetRGB()
  */
-int calculate_otsu_threshold(SDL_Surface* surface) {
-  int width = surface->w;
-  int height = surface->h;
+static int is_xrgb8888(const SDL_PixelFormat* format) {
+  return format->BytesPerPixel == 4 && format->Rmask == 0x00FF0000 &&
+         format->Gmask == 0x0000FF00 && format->Bmask == 0x000000FF;
+}
 
-  Uint32* pixels = (Uint32*)surface->pixels;
+/**
+ * @brief Returns the first byte of a row of a surface, rows being pitch bytes
+ * apart
+ */
+static Uint8* surface_row(SDL_Surface* surface, int y) {
+  return (Uint8*)surface->pixels + (size_t)y * surface->pitch;
+}
 
-  int histogram[256] = {0};
+/**
+ * @brief Returns the value of a pixel of bpp (1 to 4) bytes, as given to
+ * SDL_GetRGB()
+ */
+static Uint32 read_pixel(const Uint8* pixel, int bpp) {
+  switch (bpp) {
+    case 1:
+      return *pixel;
+    case 2: {
+      Uint16 value;
+      memcpy(&value, pixel, sizeof(value));
+      return value;
+    }
+    case 3:
+      if (SDL_BYTEORDER == SDL_BIG_ENDIAN)
+        return pixel[0] << 16 | pixel[1] << 8 | pixel[2];
+      return pixel[0] | pixel[1] << 8 | pixel[2] << 16;
+    default: {
+      Uint32 value;
+      memcpy(&value, pixel, sizeof(value));
+      return value;
+    }
+  }
+}
 
-  for (int y = 0; y < height; y++) {
+/**
+ * @brief Writes the value of a pixel of bpp (1 to 4) bytes, as returned by
+ * SDL_MapRGB()
+ */
+static void write_pixel(Uint8* pixel, int bpp, Uint32 value) {
+  switch (bpp) {
+    case 1:
+      *pixel = value;
+      break;
+    case 2: {
+      Uint16 value16 = value;
+      memcpy(pixel, &value16, sizeof(value16));
+      break;
+    }
+    case 3:
+      if (SDL_BYTEORDER == SDL_BIG_ENDIAN) {
+        pixel[0] = value >> 16;
+        pixel[1] = value >> 8;
+        pixel[2] = value;
+      } else {
+        pixel[0] = value;
+        pixel[1] = value >> 8;
+        pixel[2] = value >> 16;
+      }
+      break;
+    default:
+      memcpy(pixel, &value, sizeof(value));
+  }
+}
+
+/**
+ * @brief Writes the luma of each pixel of a row of a surface, with shifts on
+ * 32 bits 0xAARRGGBB pixels and SDL_GetRGB() on any other format
+ *
+ * @param surface The surface
+ * @param y The row
+ * @param gray Where the surface->w luma bytes are written
+ */
+static void row_luma(SDL_Surface* surface, int y, Uint8* restrict gray) {
+  const Uint8* restrict row = surface_row(surface, y);
+  const int width = surface->w;
+  if (is_xrgb8888(surface->format)) {
+    const Uint32* restrict pixels = (const Uint32*)row;
+    for (int x = 0; x < width; x++) {
+      Uint32 pixel = pixels[x];
+      gray[x] = (LUMA_R * ((pixel >> 16) & 0xFF) +
+                 LUMA_G * ((pixel >> 8) & 0xFF) + LUMA_B * (pixel & 0xFF)) >>
+                16;
+    }
+  } else {
+    const int bpp = surface->format->BytesPerPixel;
     for (int x = 0; x < width; x++) {
-      Uint32 pixel = pixels[(y * width) + x];
       Uint8 r, g, b;
-      SDL_GetRGB(pixel, surface->format, &r, &g, &b);
-      Uint8 gray = (Uint8)(0.299 * r + 0.587 * g + 0.114 * b);
-      histogram[gray]++;
+      SDL_GetRGB(read_pixel(row + x * bpp, bpp), surface->format, &r, &g, &b);
+      gray[x] = (LUMA_R * r + LUMA_G * g + LUMA_B * b) >> 16;
     }
   }
-  int total_pixels = width * height;
+}
+
+/**
+ * @brief Returns the OTSU threshold of a histogram of luma
+ *
+ * @param histogram The number of pixels of each of the 256 luma
+ * @param total_pixels The total number of pixels
+ * @return The threshold, pixels whose luma is above being white
+ */
+static int otsu_threshold(const int* histogram, int total_pixels) {
   int sumB = 0;
   int wB = 0;
   double max_variance = 0;
@@ -160,6 +251,31 @@ int calculate_otsu_threshold(SDL_Surface* surface) {
   return threshold;
 }
 
+/**
+ * @brief Compute the OTSU threshold of a surface
+ *
+ * @param surface - An SDL surface to which OTSU threshold needs to be computed
+ * @return The otsu threshold
+ */
+int calculate_otsu_threshold(SDL_Surface* surface) {
+  int histogram[256] = {0};
+  Uint8* gray = malloc(surface->w);
+  if (gray == NULL)
+    errx(EXIT_FAILURE, "Memory allocation failed: calculate_otsu_threshold()");
+  if (SDL_MUSTLOCK(surface))
+    SDL_LockSurface(surface);
+
+  for (int y = 0; y < surface->h; y++) {
+    row_luma(surface, y, gray);
+    for (int x = 0; x < surface->w; x++)
+      histogram[gray[x]]++;
+  }
+  if (SDL_MUSTLOCK(surface))
+    SDL_UnlockSurface(surface);
+  free(gray);
+  return otsu_threshold(histogram, surface->w * surface->h);
+}
+
 /**
  * @brief Converts a surface to binary black and white - in place - using OTSU
  * thresholding
@@ -168,28 +284,24 @@ int calculate_otsu_threshold(SDL_Surface* surface) {
  */
 void to_bw(SDL_Surface* surface) {
   int threshold = calculate_otsu_threshold(surface);
-  int width = surface->w;
-  int height = surface->h;
+  Uint32 black = SDL_MapRGB(surface->format, 0, 0, 0);
+  Uint32 white = SDL_MapRGB(surface->format, 255, 255, 255);
+  const int bpp = surface->format->BytesPerPixel;
+  Uint8* gray = malloc(surface->w);
+  if (gray == NULL)
+    errx(EXIT_FAILURE, "Memory allocation failed: to_bw()");
   if (SDL_MUSTLOCK(surface))
     SDL_LockSurface(surface);
 
-  Uint32* pixels = (Uint32*)surface->pixels;
-
-  for (int y = 0; y < height; y++) {
-    for (int x = 0; x < width; x++) {
-      Uint32 pixel = pixels[(y * width) + x];
-      Uint8 r, g, b;
-      SDL_GetRGB(pixel, surface->format, &r, &g, &b);
-      Uint8 gray = (Uint8)(0.299 * r + 0.587 * g + 0.114 * b);
-      Uint8 color_value = (gray > threshold) ? 255 : 0;
-
-      Uint32 color =
-          SDL_MapRGB(surface->format, color_value, color_value, color_value);
-      pixels[(y * surface->w) + x] = color;
-    }
+  for (int y = 0; y < surface->h; y++) {
+    Uint8* row = surface_row(surface, y);
+    row_luma(surface, y, gray);
+    for (int x = 0; x < surface->w; x++)
+      write_pixel(row + x * bpp, bpp, gray[x] > threshold ? white : black);
   }
   if (SDL_MUSTLOCK(surface))
     SDL_UnlockSurface(surface);
+  free(gray);
 }
 
 /**
@@ -198,28 +310,74 @@ void to_bw(SDL_Surface* surface) {
  * @param surface The surface to convert to grayscale
  */
 void to_gs(SDL_Surface* surface) {
-  int width = surface->w;
-  int height = surface->h;
+  int fast = is_xrgb8888(surface->format);
+  const int bpp = surface->format->BytesPerPixel;
+  Uint8* gray = malloc(surface->w);
+  if (gray == NULL)
+    errx(EXIT_FAILURE, "Memory allocation failed: to_gs()");
   if (SDL_MUSTLOCK(surface))
     SDL_LockSurface(surface);
 
-  Uint32* pixels = (Uint32*)surface->pixels;
-
-  for (int y = 0; y < height; y++) {
-    for (int x = 0; x < width; x++) {
-      Uint32 pixel = pixels[(y * width) + x];
-      Uint8 r, g, b;
-      SDL_GetRGB(pixel, surface->format, &r, &g, &b);
-      double gray2 = (double)(0.299 * r + 0.587 * g + 0.114 * b) / 255;
-      Uint8 color_value = (Uint8)(gray2 * 255);
-
-      Uint32 color =
-          SDL_MapRGB(surface->format, color_value, color_value, color_value);
-      pixels[(y * surface->w) + x] = color;
+  for (int y = 0; y < surface->h; y++) {
+    Uint8* row = surface_row(surface, y);
+    row_luma(surface, y, gray);
+    for (int x = 0; x < surface->w; x++) {
+      if (fast)
+        ((Uint32*)row)[x] = surface->format->Amask | gray[x] * 0x010101u;
+      else
+        write_pixel(row + x * bpp, bpp,
+                    SDL_MapRGB(surface->format, gray[x], gray[x], gray[x]));
     }
   }
   if (SDL_MUSTLOCK(surface))
     SDL_UnlockSurface(surface);
+  free(gray);
+}
+
+/**
+ * @brief Converts an IMG_H x IMG_W surface to the light intensity of its
+ * pixels, without modifying it: the luma of each pixel, or when binarizing
+ * 255 above the OTSU threshold of the surface and 0 otherwise (the pixels of
+ * to_gs() and to_bw()). Reads each pixel once, honouring the pitch.
+ *
+ * @param surface The surface to convert
+ * @param is_bw Whether to binarize the surface
+ * @param gray Where the IMG_H * IMG_W bytes are written
+ */
+void surface_to_gray(SDL_Surface* surface, int is_bw, Uint8* gray) {
+  if (surface->h != IMG_H || surface->w != IMG_W)
+    errx(EXIT_FAILURE, "Invalid image size: surface_to_gray()");
+  if (SDL_MUSTLOCK(surface))
+    SDL_LockSurface(surface);
+  for (int y = 0; y < IMG_H; y++)
+    row_luma(surface, y, gray + y * IMG_W);
+  if (SDL_MUSTLOCK(surface))
+    SDL_UnlockSurface(surface);
+  if (!is_bw)
+    return;
+
+  int histogram[256] = {0};
+  for (size_t i = 0; i < IMG_H * IMG_W; i++)
+    histogram[gray[i]]++;
+  int threshold = otsu_threshold(histogram, IMG_H * IMG_W);
+  for (size_t i = 0; i < IMG_H * IMG_W; i++)
+    gray[i] = gray[i] > threshold ? 255 : 0;
+}
+
+/**
+ * @brief Converts an IMG_H x IMG_W surface to the input of the network,
+ * between 0 (black) and 1 (white), without modifying it. Same values as
+ * to_double_array() after to_gs() or to_bw().
+ *
+ * @param surface The surface to convert
+ * @param is_bw Whether to binarize the surface
+ * @param input Where the IMG_H * IMG_W doubles are written
+ */
+void surface_to_input(SDL_Surface* surface, int is_bw, double* input) {
+  Uint8 gray[IMG_H * IMG_W];
+  surface_to_gray(surface, is_bw, gray);
+  for (size_t i = 0; i < IMG_H * IMG_W; i++)
+    input[i] = gray[i] / 255.;
 }
 
 /**
@@ -231,63 +389,257 @@ void to_gs(SDL_Surface* surface) {
  */
 double* to_double_array(SDL_Surface* surface) {
   double* gs_array = calloc(IMG_H * IMG_W, sizeof(double));
-  int width = surface->w;
-  int height = surface->h;
-  Uint32* pixels = (Uint32*)surface->pixels;
-
-  for (int y = 0; y < height; y++) {
-    for (int x = 0; x < width; x++) {
-      Uint32 pixel = pixels[(y * width) + x];
-      Uint8 r, g, b;
-      SDL_GetRGB(pixel, surface->format, &r, &g, &b);
-      double gray2 = (double)(0.299 * r + 0.587 * g + 0.114 * b) / 255.;
-      gs_array[y * IMG_W + x] = gray2;
-    }
-  }
+  if (gs_array == NULL)
+    errx(EXIT_FAILURE, "Memory allocation failed: to_double_array()");
+  surface_to_input(surface, 0, gs_array);
   return gs_array;
 }
 
 /**
- * @brief Returns a pointer to double list of size OUTPUT_SIZE of prediction of
- * a surface against the neural network. Note: size of output layer should be  *
- * of OUTPUT_SIZE
+ * @brief Returns a workspace to predict surfaces against a network without
+ * allocating, see predict_from_surface_ws(). A workspace is used by one thread
+ * at a time.
+ *
+ * **NOTE**: The struct should be freed using free_ocr_workspace()
+ *
+ * @param ocr The neural network, of IMG_H * IMG_W inputs and at least
+ * OUTPUT_SIZE outputs
+ * @return pointer to the workspace
+ */
+OcrWorkspace* init_ocr_workspace(const Network* ocr) {
+  if (ocr->nb_input != IMG_H * IMG_W || ocr->nb_output < OUTPUT_SIZE)
+    errx(EXIT_FAILURE, "Invalid network size: init_ocr_workspace()");
+  OcrWorkspace* workspace = malloc(sizeof(OcrWorkspace));
+  if (workspace == NULL)
+    errx(EXIT_FAILURE, "Memory allocation failed: init_ocr_workspace()");
+  workspace->context = init_nc(ocr);
+  workspace->temperature = 1.;
+  return workspace;
+}
+
+/**
+ * @brief Writes the OUTPUT_SIZE first outputs of a network for a surface,
+ * without allocating nor modifying the surface
  *
  * @param ocr The neural network to predict against
+ * @param workspace A workspace of the network, see init_ocr_workspace()
+ * @param surface The IMG_H x IMG_W surface to predict
+ * @param is_bw Whether to binarize the surface (as to_bw()) or convert it to
+ * grayscale (as to_gs())
+ * @param result Where the OUTPUT_SIZE outputs are written
+ */
+void predict_from_surface_ws(const Network* ocr,
+                             OcrWorkspace* workspace,
+                             SDL_Surface* surface,
+                             int is_bw,
+                             double* result) {
+  surface_to_input(surface, is_bw, workspace->input);
+  predict_nn_ctx(ocr, workspace->context, workspace->input);
+  memcpy(result, workspace->context->output, OUTPUT_SIZE * sizeof(double));
+}
+
+/**
+ * @brief Frees a workspace (not its network)
+ *
+ * @param workspace A pointer to the workspace to free
+ */
+void free_ocr_workspace(OcrWorkspace* workspace) {
+  free_nc(workspace->context);
+  free(workspace);
+}
+
+/**
+ * @brief Returns a pointer to double list of size OUTPUT_SIZE of prediction of
+ * a surface (converted to grayscale) against the neural network, see
+ * predict_from_surface_ws() to predict many surfaces
+ *
+ * @param ocr The neural network to predict against, of at least OUTPUT_SIZE
+ * outputs
  * @param surface The surface to perform the test
  * @return A double pointer correspoding to the double list of output
  */
-double* predict_from_surface(Network* ocr, SDL_Surface* surface) {
+double* predict_from_surface(const Network* ocr, SDL_Surface* surface) {
   if (surface->h != IMG_H || surface->w != IMG_W)
     errx(EXIT_FAILURE, "Invalid image size: predict_from_surface()");
 
-  to_gs(surface);
-
-  double* gs_array = calloc(IMG_H * IMG_W, sizeof(double));
   double* result = calloc(OUTPUT_SIZE, sizeof(double));
-  if (gs_array == NULL || result == NULL)
+  if (result == NULL)
     errx(EXIT_FAILURE, "Memory allocation failed: predict_from_surface()");
+  OcrWorkspace* workspace = init_ocr_workspace(ocr);
+  predict_from_surface_ws(ocr, workspace, surface, 0, result);
+  free_ocr_workspace(workspace);
+  return result;
+}
+
+/**
+ * @brief Returns the k best outputs of a network from its logits (see
+ * predict_nn_logits()), best first, with their softmax probabilities at a
+ * temperature
+ *
+ * @param logits The logits of the output layer
+ * @param size The number of logits
+ * @param temperature The temperature dividing the logits, 1 for the plain
+ * softmax
+ * @param k The number of guesses, at most size
+ * @param guesses Where the k guesses are written
+ * @return The number of guesses written, k
+ */
+size_t logits_top_k(const double* logits,
+                    size_t size,
+                    double temperature,
+                    size_t k,
+                    OcrGuess* guesses) {
+  if (k > size)
+    k = size;
+  if (k == 0)
+    return 0;
+  // Insertion into the k best so far: k is small in practice
+  size_t nb = 0;
+  for (size_t i = 0; i < size; i++) {
+    if (nb == k && logits[i] <= logits[guesses[k - 1].index])
+      continue;
+    size_t j = nb < k ? nb++ : k - 1;
+    while (j > 0 && logits[guesses[j - 1].index] < logits[i]) {
+      guesses[j] = guesses[j - 1];
+      j--;
+    }
+    guesses[j].index = i;
+  }
 
-  int width = surface->w;
-  int height = surface->h;
-  Uint32* pixels = (Uint32*)surface->pixels;
+  const double max_logit = logits[guesses[0].index];
+  double sum = 0.;
+  for (size_t i = 0; i < size; i++)
+    sum += exp((logits[i] - max_logit) / temperature);
+  for (size_t i = 0; i < k; i++) {
+    size_t index = guesses[i].index;
+    guesses[i].letter = index < OUTPUT_SIZE ? 'a' + index : '\0';
+    guesses[i].confidence =
+        exp((logits[index] - max_logit) / temperature) / sum;
+  }
+  return k;
+}
 
-  for (int y = 0; y < height; y++) {
-    for (int x = 0; x < width; x++) {
-      Uint32 pixel = pixels[(y * width) + x];
-      Uint8 r, g, b;
-      SDL_GetRGB(pixel, surface->format, &r, &g, &b);
-      double gray2 = (double)(0.299 * r + 0.587 * g + 0.114 * b) / 255;
-      gs_array[y * IMG_W + x] = ((double)gray2);
+/**
+ * @brief Returns the best output of a network from its logits (see
+ * predict_nn_logits()) and whether its softmax probability at a temperature
+ * reaches a threshold. The probability is only computed when the margin
+ * between the two best logits does not already guarantee it: the best
+ * probability is at least 1 / (1 + (size - 1) * exp(-margin / temperature)).
+ *
+ * @param logits The logits of the output layer
+ * @param size The number of logits
+ * @param temperature The temperature dividing the logits, 1 for the plain
+ * softmax
+ * @param threshold The minimal probability of the best output, 0 to only get
+ * the best output
+ * @param best Where the index of the best output is written
+ * @return 1 when the best output is confident enough, 0 when it should be
+ * rejected (e.g. checked by a slower model)
+ */
+int logits_argmax(const double* logits,
+                  size_t size,
+                  double temperature,
+                  double threshold,
+                  size_t* best) {
+  size_t first = 0;
+  double second = -INFINITY;
+  for (size_t i = 1; i < size; i++) {
+    if (logits[i] > logits[first]) {
+      second = logits[first];
+      first = i;
+    } else if (logits[i] > second) {
+      second = logits[i];
     }
   }
-  // NOTE: Assumes NN output size is OUTPUT_SIZE or more (expect segfault
-  // otherwise)
-  predict_nn(ocr, gs_array);
-  for (size_t k = 0; k < OUTPUT_SIZE; k++) {
-    result[k] = ocr->output[k];
+  *best = first;
+  if (threshold <= 0. || size == 1)
+    return 1;
+  if (threshold >= 1.)
+    return 0;
+
+  double margin = (logits[first] - second) / temperature;
+  if (margin >= log((size - 1) * threshold / (1. - threshold)))
+    return 1;
+  double sum = 0.;
+  for (size_t i = 0; i < size; i++)
+    sum += exp((logits[i] - logits[first]) / temperature);
+  return 1. / sum >= threshold;
+}
+
+/**
+ * @brief Computes the logits of a surface into the context of a workspace,
+ * checking that they are the input of a softmax: the confidences of
+ * predict_top_k() and predict_letter() are softmax probabilities, which would
+ * not match the outputs of a network with another output activation
+ */
+static void predict_surface_logits(const Network* ocr,
+                                   OcrWorkspace* workspace,
+                                   SDL_Surface* surface,
+                                   int is_bw) {
+  if (ocr->layers[ocr->nb_layers - 1].activation != SOFTMAX)
+    errx(EXIT_FAILURE, "Confidences need a softmax output layer");
+  if (!(workspace->temperature > 0.))
+    errx(EXIT_FAILURE, "Invalid calibration temperature");
+  surface_to_input(surface, is_bw, workspace->input);
+  predict_nn_logits(ocr, workspace->context, workspace->input);
+}
+
+/**
+ * @brief Writes the k most likely outputs of a surface, best first, with their
+ * softmax probabilities at the temperature of the workspace, without
+ * allocating nor modifying the surface
+ *
+ * @param ocr The neural network to predict against, whose output layer is a
+ * softmax
+ * @param workspace A workspace of the network, see init_ocr_workspace()
+ * @param surface The IMG_H x IMG_W surface to predict
+ * @param is_bw Whether to binarize the surface or convert it to grayscale
+ * @param k The number of guesses, at most the number of outputs
+ * @param guesses Where the guesses are written
+ * @return The number of guesses written
+ */
+size_t predict_top_k(const Network* ocr,
+                     OcrWorkspace* workspace,
+                     SDL_Surface* surface,
+                     int is_bw,
+                     size_t k,
+                     OcrGuess* guesses) {
+  predict_surface_logits(ocr, workspace, surface, is_bw);
+  return logits_top_k(workspace->context->output, ocr->nb_output,
+                      workspace->temperature, k, guesses);
+}
+
+/**
+ * @brief Predicts the letter of a surface, flagging it when the network is
+ * not confident enough (at the temperature of the workspace), without
+ * allocating nor modifying the surface
+ *
+ * @param ocr The neural network to predict against, whose output layer is a
+ * softmax
+ * @param workspace A workspace of the network, see init_ocr_workspace()
+ * @param surface The IMG_H x IMG_W surface to predict
+ * @param is_bw Whether to binarize the surface or convert it to grayscale
+ * @param threshold The minimal probability of the letter, see logits_argmax()
+ * @param letter Where the most likely letter ('a' to 'z') is written, '\0'
+ * when the best output is not a letter
+ * @return 1 when the letter reaches the threshold, 0 when it is rejected
+ */
+int predict_letter(const Network* ocr,
+                   OcrWorkspace* workspace,
+                   SDL_Surface* surface,
+                   int is_bw,
+                   double threshold,
+                   char* letter) {
+  predict_surface_logits(ocr, workspace, surface, is_bw);
+  size_t best;
+  int accepted = logits_argmax(workspace->context->output, ocr->nb_output,
+                               workspace->temperature, threshold, &best);
+  if (best >= OUTPUT_SIZE) {
+    *letter = '\0';
+    return 0;
   }
-  free(gs_array);
-  return result;
+  *letter = 'a' + best;
+  return accepted;
 }
 
 /*** Helper functions ***/
@@ -361,7 +713,7 @@ void printColor(double value) {
  * @param size the size of the array
  * @return The index of the max
  */
-int indexOfMax(double* arr, size_t size) {
+int indexOfMax(const double* arr, size_t size) {
   if (size == 0) {
     return -1;
   }
@@ -385,7 +737,7 @@ int indexOfMax(double* arr, size_t size) {
  * @param i the position of the element in the array to get the position of
  * @return The value of the rank of the ith element (starts at 1)
  */
-int get_rank(double* arr, size_t size, size_t i) {
+int get_rank(const double* arr, size_t size, size_t i) {
   int rank = 1;
   double target = arr[i];
 
@@ -401,8 +753,10 @@ int get_rank(double* arr, size_t size, size_t i) {
 /**
  * @brief prints the current iteration of learning. Only used internally for
  * debugging purposes.
+ *
+ * @param output The output layer of the network for the current sample
  */
-void print_current_iter(const Network* net,
+void print_current_iter(const double* output,
                         const char current_letter,
                         const size_t iter,
                         const size_t max_iter) {
@@ -410,12 +764,12 @@ void print_current_iter(const Network* net,
   printf("CHAR = %c: [", current_letter);
   for (char i = 0; i < 26; i++) {
     printf("%c = ", 'A' + i);
-    printColor(net->output[(size_t)i]);
+    printColor(output[(size_t)i]);
     printf(", ");
   }
-  printf("] Best guess: %c ", indexOfMax(net->output, 26) + 'A');
+  printf("] Best guess: %c ", indexOfMax(output, 26) + 'A');
   printf("Rank: ");
-  int rank = get_rank(net->output, 26, current_letter - 'A');
+  int rank = get_rank(output, 26, current_letter - 'A');
   if (rank == 1) {
     printf("\033[32m\033[1m%d\033[0m", rank);
   } else if (rank < 5) {
@@ -423,7 +777,7 @@ void print_current_iter(const Network* net,
   } else {
     printf("\033[31m\033[1m%d\033[0m", rank);
   }
-  if (net->output[current_letter - 'A'] < (double)0.5 && rank == 1)
+  if (output[current_letter - 'A'] < (double)0.5 && rank == 1)
     printf(" \033[31m\033[1mERROR PROBA\033[0m");
   printf("\n");
   printf("-----\n");
@@ -473,7 +827,11 @@ char** get_filenames_in_dir(const char* path, size_t* size) {
   return path_list;
 }
 
-void print_table(Network* network, char*** path, double*** data, size_t size) {
+void print_table(const Network* network,
+                 char*** path,
+                 double*** data,
+                 size_t size) {
+  NetworkContext* context = init_nc(network);
   size_t nbgood = 0;
   printf("Letter\t");
   for (char k = 0; k < 26; k++)
@@ -481,13 +839,13 @@ void print_table(Network* network, char*** path, double*** data, size_t size) {
   printf("\n");
 
   for (size_t k = 0; k < size; k++) {
-    predict_nn(network, (*data)[k]);
+    predict_nn_ctx(network, context, (*data)[k]);
     printf("%c\t", (*path)[k][0]);
     for (size_t f = 0; f < 26; f++) {
-      printColor(network->output[f]);
+      printColor(context->output[f]);
       printf("\t");
     }
-    if (get_rank(network->output, 26, (*path)[k][0] - 'a') == 1) {
+    if (get_rank(context->output, 26, (*path)[k][0] - 'a') == 1) {
       printf("✅");
       nbgood++;
     } else
@@ -497,23 +855,26 @@ void print_table(Network* network, char*** path, double*** data, size_t size) {
   }
   printf("Accuracy: %9.3lf%% (%ld/%ld) \n", (double)nbgood / size * 100, nbgood,
          size);
+  free_nc(context);
 }
 
-void print_table_2(Network* network,
+void print_table_2(const Network* network,
                    char*** path,
                    double*** data,
                    size_t size) {
+  NetworkContext* context = init_nc(network);
   printf("File\n");
   for (size_t k = 0; k < size; k++) {
-    predict_nn(network, (*data)[k]);
+    predict_nn_ctx(network, context, (*data)[k]);
     printf("%s\t", (*path)[k]);
-    size_t index_max_proba = indexOfMax(network->output, 26);
+    size_t index_max_proba = indexOfMax(context->output, 26);
 
     printf("Detected %c - %.3f ", (int)index_max_proba + 'A',
-           (network->output)[index_max_proba]);
+           (context->output)[index_max_proba]);
 
     printf("\n");
   }
+  free_nc(context);
 }
 
 int compare_strings(const void* a, const void* b) {
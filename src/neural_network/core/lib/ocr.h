@@ -12,28 +12,89 @@
 
 #include "core_network.h"
 
-double* predict_from_surface(Network* ocr, SDL_Surface* surface);
+/**
+ * Buffers reused by predict_from_surface_ws() from one surface to the next
+ */
+typedef struct OcrWorkspace {
+  NetworkContext* context;
+  double input[IMG_H * IMG_W];
+  // Temperature dividing the logits before the softmax of predict_top_k() and
+  // predict_letter(), fitted on held out images to calibrate the confidences
+  // (1 by default, the plain softmax probabilities)
+  double temperature;
+} OcrWorkspace;
+
+OcrWorkspace* init_ocr_workspace(const Network* ocr);
+void predict_from_surface_ws(const Network* ocr,
+                             OcrWorkspace* workspace,
+                             SDL_Surface* surface,
+                             int is_bw,
+                             double* result);
+void free_ocr_workspace(OcrWorkspace* workspace);
+
+/**
+ * Guess of a network: output index, letter ('\0' for an output past 'z') and
+ * softmax probability
+ */
+typedef struct OcrGuess {
+  size_t index;
+  char letter;
+  double confidence;
+} OcrGuess;
+
+size_t logits_top_k(const double* logits,
+                    size_t size,
+                    double temperature,
+                    size_t k,
+                    OcrGuess* guesses);
+int logits_argmax(const double* logits,
+                  size_t size,
+                  double temperature,
+                  double threshold,
+                  size_t* best);
+size_t predict_top_k(const Network* ocr,
+                     OcrWorkspace* workspace,
+                     SDL_Surface* surface,
+                     int is_bw,
+                     size_t k,
+                     OcrGuess* guesses);
+int predict_letter(const Network* ocr,
+                   OcrWorkspace* workspace,
+                   SDL_Surface* surface,
+                   int is_bw,
+                   double threshold,
+                   char* letter);
+double* predict_from_surface(const Network* ocr, SDL_Surface* surface);
 void to_gs(SDL_Surface* surface);
 void to_bw(SDL_Surface* surface);
+int calculate_otsu_threshold(SDL_Surface* surface);
 double* to_double_array(SDL_Surface* surface);
+void surface_to_gray(SDL_Surface* surface, int is_bw, Uint8* gray);
+void surface_to_input(SDL_Surface* surface, int is_bw, double* input);
 Network* init_ocr(size_t hidden);
 SDL_Surface* load_image(const char* path);
 
 /** Helper functions **/
-void print_current_iter(const Network* net,
+void print_current_iter(const double* output,
                         const char current_letter,
                         const size_t iter,
                         const size_t max_iter);
-int get_rank(double* arr, size_t size, size_t i);
-int indexOfMax(double* arr, size_t size);
+int get_rank(const double* arr, size_t size, size_t i);
+int indexOfMax(const double* arr, size_t size);
 void printColor(double value);
 void shuffle(double** array1, double** array2, size_t size);
 void swap(double** a, double** b);
 double* get_target(const char* filename);
 char** get_filenames_in_dir(const char* path, size_t* size);
-void print_table(Network* network, char*** path, double*** data, size_t size);
+void print_table(const Network* network,
+                 char*** path,
+                 double*** data,
+                 size_t size);
 void sort_string_list(char** list, size_t count);
 int compare_strings(const void* a, const void* b);
-void print_table_2(Network* network, char*** path, double*** data, size_t size);
+void print_table_2(const Network* network,
+                   char*** path,
+                   double*** data,
+                   size_t size);
 SDL_Surface * resizeSurface(SDL_Surface* original);
 #endif
\ No newline at end of file
@@ -0,0 +1,520 @@
+#define _GNU_SOURCE
+#include "pipeline.h"
+
+#include <err.h>
+#include <math.h>
+#include <string.h>
+
+// Number of polls of a queue before sleeping on its condition variable
+#define PIPELINE_SPINS 1024
+
+/**
+ * @brief Returns a uniform random number in [0, 1) drawn from a xorshift64()
+ * generator
+ */
+static double uniform(uint64_t* state) {
+  return (xorshift64(state) >> 11) * 0x1.0p-53;
+}
+
+/**
+ * @brief Returns the state of the generator of an epoch, derived from the seed
+ * of the training (splitmix64 finalizer) so that any epoch can be replayed
+ */
+static uint64_t epoch_state(uint64_t seed, size_t epoch) {
+  uint64_t z = seed + (epoch + 1) * 0x9e3779b97f4a7c15ULL;
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  z ^= z >> 31;
+  return z != 0 ? z : 1;
+}
+
+/**
+ * @brief Rotates an image around its center (nearest neighbour), the pixels
+ * coming from outside of the image being white
+ *
+ * @param src The image to rotate
+ * @param dst Where the rotated image is written
+ * @param height Height of the images
+ * @param width Width of the images
+ * @param angle Clockwise angle in degrees
+ */
+static void rotate_image(const uint8_t* src,
+                         uint8_t* dst,
+                         size_t height,
+                         size_t width,
+                         double angle) {
+  const double c = cos(angle * M_PI / 180.);
+  const double s = sin(angle * M_PI / 180.);
+  const double cy = (height - 1) / 2.;
+  const double cx = (width - 1) / 2.;
+  for (size_t y = 0; y < height; y++) {
+    for (size_t x = 0; x < width; x++) {
+      // Position in the source image of the pixel rotated to (x, y)
+      double sx = c * (x - cx) + s * (y - cy) + cx;
+      double sy = -s * (x - cx) + c * (y - cy) + cy;
+      long ix = lround(sx);
+      long iy = lround(sy);
+      dst[y * width + x] = ix >= 0 && ix < (long)width && iy >= 0 &&
+                                   iy < (long)height
+                               ? src[iy * width + ix]
+                               : 255;
+    }
+  }
+}
+
+/**
+ * @brief Replaces random pixels of an image by light gray values, as
+ * add_noise() of the dataset generator
+ *
+ * @param pixels The image
+ * @param size Number of pixels of the image
+ * @param intensity 0-100, percentage of pixels replaced
+ * @param state State of the xorshift64() generator
+ */
+static void add_noise(uint8_t* pixels,
+                      size_t size,
+                      int intensity,
+                      uint64_t* state) {
+  size_t nb_pixels = size * intensity / 100;
+  for (size_t i = 0; i < nb_pixels; i++) {
+    pixels[xorshift64(state) % size] = xorshift64(state) % 127 + 128;
+  }
+}
+
+/**
+ * @brief Reads the next window of shards of the epoch of a streaming pipeline
+ * and shuffles its images. The shards of the following window are prefetched
+ * while the images of this one are decoded.
+ *
+ * @param pipeline The pipeline
+ */
+static void load_window(BatchPipeline* pipeline) {
+  const DatasetStream* stream = pipeline->stream;
+  const size_t image_size = pipeline->height * pipeline->width;
+  size_t first = pipeline->next_shard;
+  size_t end = first + pipeline->window < stream->nb_shards
+                   ? first + pipeline->window
+                   : stream->nb_shards;
+  size_t count = 0;
+  for (size_t k = first; k < end; k++) {
+    count += read_dataset_shard(stream, pipeline->shards[k],
+                                pipeline->window_labels + count,
+                                pipeline->window_pixels + count * image_size);
+    evict_dataset_shard(stream, pipeline->shards[k]);
+  }
+  for (size_t k = end; k < end + pipeline->window && k < stream->nb_shards;
+       k++)
+    prefetch_dataset_shard(stream, pipeline->shards[k]);
+  pipeline->next_shard = end;
+  for (size_t i = 0; i < count; i++)
+    pipeline->window_order[i] = i;
+  shuffle_indices(pipeline->window_order, count, &pipeline->rng_state);
+  pipeline->window_size = count;
+  pipeline->position = 0;
+}
+
+/**
+ * @brief Shuffles the samples of a pipeline for an epoch, from their initial
+ * order with the generator of the epoch (see epoch_state()). Streaming
+ * pipelines shuffle the order of the shards, their images being shuffled
+ * window by window.
+ *
+ * @param pipeline The pipeline
+ * @param epoch Index of the epoch
+ */
+static void begin_epoch(BatchPipeline* pipeline, size_t epoch) {
+  pipeline->rng_state = epoch_state(pipeline->seed, epoch);
+  pipeline->position = 0;
+  if (pipeline->stream == NULL) {
+    memcpy(pipeline->dataset->order, pipeline->samples,
+           pipeline->nb_samples * sizeof(size_t));
+    shuffle_dataset(pipeline->dataset, &pipeline->rng_state);
+    return;
+  }
+  const size_t nb_shards = pipeline->stream->nb_shards;
+  for (size_t k = 0; k < nb_shards; k++)
+    pipeline->shards[k] = k;
+  shuffle_indices(pipeline->shards, nb_shards, &pipeline->rng_state);
+  pipeline->next_shard = 0;
+  pipeline->window_size = 0;
+}
+
+/**
+ * @brief Returns the pixels of the next sample of the epoch
+ *
+ * @param pipeline The pipeline
+ * @param label Where the label of the sample is written
+ */
+static const uint8_t* next_sample(BatchPipeline* pipeline, uint8_t* label) {
+  const size_t image_size = pipeline->height * pipeline->width;
+  if (pipeline->stream == NULL) {
+    const PackedDataset* dataset = pipeline->dataset;
+    size_t index = dataset->order[pipeline->position++];
+    *label = dataset->labels[index];
+    return dataset->pixels + index * image_size;
+  }
+  if (pipeline->position == pipeline->window_size)
+    load_window(pipeline);
+  size_t index = pipeline->window_order[pipeline->position++];
+  *label = pipeline->window_labels[index];
+  return pipeline->window_pixels + index * image_size;
+}
+
+/**
+ * @brief Decodes (and augments) the next samples of the epoch to a batch
+ *
+ * @param pipeline The pipeline
+ * @param batch Where the samples are written
+ * @param offset Index of the first sample in the epoch
+ */
+static void fill_batch(BatchPipeline* pipeline, Batch* batch, size_t offset) {
+  const Augmentation* augmentation = &pipeline->augmentation;
+  const size_t image_size = pipeline->height * pipeline->width;
+  size_t count = pipeline->nb_samples - offset < pipeline->batch_size
+                     ? pipeline->nb_samples - offset
+                     : pipeline->batch_size;
+  batch->size = count;
+  batch->offset = offset;
+  for (size_t s = 0; s < count; s++) {
+    const uint8_t* pixels = next_sample(pipeline, &batch->labels[s]);
+    double* input = batch->inputs + s * image_size;
+    double* target = batch->targets + s * pipeline->nb_output;
+    memset(target, 0, pipeline->nb_output * sizeof(double));
+    if (batch->labels[s] < pipeline->nb_output)
+      target[batch->labels[s]] = 1.;
+    if (augmentation->max_angle == 0. && augmentation->noise == 0) {
+      for (size_t i = 0; i < image_size; i++)
+        input[i] = pixels[i] / 255.;
+      continue;
+    }
+    if (augmentation->max_angle != 0.) {
+      double angle =
+          (2. * uniform(&pipeline->rng_state) - 1.) * augmentation->max_angle;
+      rotate_image(pixels, pipeline->image, pipeline->height, pipeline->width,
+                   angle);
+    } else {
+      memcpy(pipeline->image, pixels, image_size);
+    }
+    add_noise(pipeline->image, image_size, augmentation->noise,
+              &pipeline->rng_state);
+    for (size_t i = 0; i < image_size; i++)
+      input[i] = pipeline->image[i] / 255.;
+  }
+}
+
+/**
+ * @brief Returns whether a pipeline has been stopped by stop_pipeline()
+ */
+static int is_stopped(BatchPipeline* pipeline) {
+  return atomic_load_explicit(&pipeline->stopped, memory_order_relaxed);
+}
+
+/**
+ * @brief Waits until a queue has room for a batch, spinning for a while then
+ * sleeping until the consumer releases one (see pipeline_release())
+ *
+ * @param pipeline The pipeline
+ * @param queue The queue, whose head is only written by the caller
+ * @return 0 if the pipeline has been stopped meanwhile, 1 otherwise
+ */
+static int wait_room(BatchPipeline* pipeline, BatchQueue* queue) {
+  size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+  for (size_t i = 0; i < PIPELINE_SPINS; i++) {
+    if (head - atomic_load_explicit(&queue->tail, memory_order_acquire) <
+        PIPELINE_DEPTH)
+      return 1;
+  }
+  // The flag is raised before checking tail again and pipeline_release()
+  // stores tail before reading the flag (both sequentially consistent), so
+  // either this thread sees the release or the consumer sees the flag
+  pthread_mutex_lock(&queue->lock);
+  atomic_store(&queue->producer_waiting, 1);
+  while (head - atomic_load(&queue->tail) == PIPELINE_DEPTH &&
+         !is_stopped(pipeline))
+    pthread_cond_wait(&queue->cond, &queue->lock);
+  atomic_store(&queue->producer_waiting, 0);
+  pthread_mutex_unlock(&queue->lock);
+  return !is_stopped(pipeline);
+}
+
+/**
+ * @brief Wakes up the other side of a queue if it sleeps in wait_room() or
+ * pipeline_next(), once head or tail has been stored
+ */
+static void wake_up(BatchQueue* queue, atomic_int* waiting) {
+  if (atomic_load(waiting)) {
+    pthread_mutex_lock(&queue->lock);
+    pthread_cond_signal(&queue->cond);
+    pthread_mutex_unlock(&queue->lock);
+  }
+}
+
+/**
+ * @brief Shuffles the samples at each epoch (see begin_epoch()) and publishes
+ * their batches to the queues, waiting when the queue of the next batch is
+ * full. Ends at the first epoch or batch after stop_pipeline(). Used as a
+ * thread routine.
+ *
+ * @param arg A pointer to the BatchPipeline
+ * @return NULL
+ */
+static void* pipeline_worker(void* arg) {
+  BatchPipeline* pipeline = arg;
+  size_t size = pipeline->nb_samples;
+  size_t nb_batches = (size + pipeline->batch_size - 1) / pipeline->batch_size;
+  for (size_t epoch = pipeline->first_epoch; epoch < pipeline->nb_epochs;
+       epoch++) {
+    if (is_stopped(pipeline))
+      return NULL;
+    begin_epoch(pipeline, epoch);
+    for (size_t b = 0; b < nb_batches; b++) {
+      BatchQueue* queue = &pipeline->queues[b % pipeline->nb_queues];
+      if (is_stopped(pipeline) || !wait_room(pipeline, queue))
+        return NULL;
+      size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+      fill_batch(pipeline, &queue->batches[head % PIPELINE_DEPTH],
+                 b * pipeline->batch_size);
+      atomic_store(&queue->head, head + 1);
+      wake_up(queue, &queue->consumer_waiting);
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @brief Allocates a pipeline and its batches, without starting its thread
+ * nor setting its source of samples
+ */
+static BatchPipeline* alloc_pipeline(size_t nb_samples,
+                                     size_t height,
+                                     size_t width,
+                                     size_t first_epoch,
+                                     size_t nb_epochs,
+                                     size_t batch_size,
+                                     size_t nb_output,
+                                     size_t nb_queues,
+                                     const Augmentation* augmentation,
+                                     uint64_t seed) {
+  BatchPipeline* pipeline = calloc(1, sizeof(BatchPipeline));
+  if (pipeline == NULL)
+    errx(EXIT_FAILURE, "Error while allocating memory");
+  const size_t image_size = height * width;
+  atomic_init(&pipeline->stopped, 0);
+  pipeline->nb_samples = nb_samples;
+  pipeline->height = height;
+  pipeline->width = width;
+  pipeline->first_epoch = first_epoch;
+  pipeline->nb_epochs = nb_epochs;
+  pipeline->batch_size = batch_size;
+  pipeline->nb_output = nb_output;
+  pipeline->nb_queues = nb_queues;
+  pipeline->augmentation = *augmentation;
+  pipeline->seed = seed;
+  pipeline->queues = calloc(nb_queues, sizeof(BatchQueue));
+  pipeline->image = calloc(image_size, sizeof(uint8_t));
+  if (pipeline->queues == NULL || pipeline->image == NULL)
+    errx(EXIT_FAILURE, "Error while allocating memory");
+  for (size_t q = 0; q < nb_queues; q++) {
+    BatchQueue* queue = &pipeline->queues[q];
+    atomic_init(&queue->head, 0);
+    atomic_init(&queue->tail, 0);
+    atomic_init(&queue->consumer_waiting, 0);
+    atomic_init(&queue->producer_waiting, 0);
+    if (pthread_mutex_init(&queue->lock, NULL) != 0 ||
+        pthread_cond_init(&queue->cond, NULL) != 0)
+      errx(EXIT_FAILURE, "Error while initializing pipeline queue");
+    for (size_t i = 0; i < PIPELINE_DEPTH; i++) {
+      Batch* batch = &queue->batches[i];
+      batch->inputs = calloc(batch_size * image_size, sizeof(double));
+      batch->targets = calloc(batch_size * nb_output, sizeof(double));
+      batch->labels = calloc(batch_size, sizeof(uint8_t));
+      if (batch->inputs == NULL || batch->targets == NULL ||
+          batch->labels == NULL)
+        errx(EXIT_FAILURE, "Error while allocating memory");
+    }
+  }
+  return pipeline;
+}
+
+/**
+ * @brief Allocates the batches of a pipeline and starts its thread, which
+ * prepares the batches of every epoch from first_epoch
+ *
+ * **NOTE**: The struct should be freed using free_pipeline(), after every
+ * batch has been consumed
+ *
+ * @param dataset The training dataset, whose nb_samples first images of its
+ * current order are shuffled by the pipeline
+ * @param first_epoch Index of the first epoch (0 unless training is resumed)
+ * @param nb_epochs Total number of passes over the dataset
+ * @param batch_size Maximum number of samples of a batch
+ * @param nb_output Number of outputs of the network (size of a target)
+ * @param nb_queues Number of consumers
+ * @param augmentation Transforms applied to the images
+ * @param seed Seed of the shuffling and of the transforms
+ * @return pointer to the started pipeline
+ */
+BatchPipeline* init_pipeline(PackedDataset* dataset,
+                             size_t first_epoch,
+                             size_t nb_epochs,
+                             size_t batch_size,
+                             size_t nb_output,
+                             size_t nb_queues,
+                             const Augmentation* augmentation,
+                             uint64_t seed) {
+  BatchPipeline* pipeline = alloc_pipeline(
+      dataset->nb_samples, dataset->height, dataset->width, first_epoch,
+      nb_epochs, batch_size, nb_output, nb_queues, augmentation, seed);
+  pipeline->samples = malloc((dataset->nb_samples + 1) * sizeof(size_t));
+  if (pipeline->samples == NULL)
+    errx(EXIT_FAILURE, "Error while allocating memory");
+  memcpy(pipeline->samples, dataset->order,
+         dataset->nb_samples * sizeof(size_t));
+  pipeline->dataset = dataset;
+  if (pthread_create(&pipeline->thread, NULL, pipeline_worker, pipeline) != 0)
+    errx(EXIT_FAILURE, "Error while creating pipeline thread");
+  return pipeline;
+}
+
+/**
+ * @brief Allocates the batches of a pipeline streaming a dataset and starts
+ * its thread, which prepares the batches of every epoch from first_epoch.
+ * Only window shards of the dataset are in memory at once, their images being
+ * shuffled together.
+ *
+ * **NOTE**: The struct should be freed using free_pipeline(), after every
+ * batch has been consumed
+ *
+ * @param stream The training dataset, read by the pipeline thread
+ * @param window Number of shards shuffled together
+ * @param first_epoch Index of the first epoch (0 unless training is resumed)
+ * @param nb_epochs Total number of passes over the dataset
+ * @param batch_size Maximum number of samples of a batch
+ * @param nb_output Number of outputs of the network (size of a target)
+ * @param nb_queues Number of consumers
+ * @param augmentation Transforms applied to the images
+ * @param seed Seed of the shuffling and of the transforms
+ * @return pointer to the started pipeline
+ */
+BatchPipeline* init_stream_pipeline(const DatasetStream* stream,
+                                    size_t window,
+                                    size_t first_epoch,
+                                    size_t nb_epochs,
+                                    size_t batch_size,
+                                    size_t nb_output,
+                                    size_t nb_queues,
+                                    const Augmentation* augmentation,
+                                    uint64_t seed) {
+  BatchPipeline* pipeline = alloc_pipeline(
+      stream->size, stream->height, stream->width, first_epoch, nb_epochs,
+      batch_size, nb_output, nb_queues, augmentation, seed);
+  const size_t image_size = stream->height * stream->width;
+  const size_t window_capacity = window * stream->shard_size;
+  pipeline->stream = stream;
+  pipeline->window = window;
+  pipeline->shards = calloc(stream->nb_shards + 1, sizeof(size_t));
+  pipeline->window_labels = calloc(window_capacity, sizeof(uint8_t));
+  pipeline->window_pixels =
+      calloc(window_capacity * image_size, sizeof(uint8_t));
+  pipeline->window_order = calloc(window_capacity, sizeof(size_t));
+  if (pipeline->shards == NULL || pipeline->window_labels == NULL ||
+      pipeline->window_pixels == NULL || pipeline->window_order == NULL)
+    errx(EXIT_FAILURE, "Error while allocating memory");
+  if (pthread_create(&pipeline->thread, NULL, pipeline_worker, pipeline) != 0)
+    errx(EXIT_FAILURE, "Error while creating pipeline thread");
+  return pipeline;
+}
+
+/**
+ * @brief Returns the number of batches of an epoch given to a queue
+ */
+size_t pipeline_nb_batches(const BatchPipeline* pipeline, size_t queue) {
+  size_t size = pipeline->nb_samples;
+  size_t nb_batches = (size + pipeline->batch_size - 1) / pipeline->batch_size;
+  return nb_batches / pipeline->nb_queues +
+         (queue < nb_batches % pipeline->nb_queues);
+}
+
+/**
+ * @brief Returns the next batch of a queue, waiting for the pipeline thread
+ * only when it has not been prepared yet (spinning for a while, then sleeping
+ * until it is published). The batch stays valid until pipeline_release() is
+ * called.
+ *
+ * @param pipeline The pipeline
+ * @param queue Index of the queue of the consumer
+ */
+const Batch* pipeline_next(BatchPipeline* pipeline, size_t queue) {
+  BatchQueue* q = &pipeline->queues[queue];
+  size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+  for (size_t i = 0; i < PIPELINE_SPINS; i++) {
+    if (atomic_load_explicit(&q->head, memory_order_acquire) != tail)
+      return &q->batches[tail % PIPELINE_DEPTH];
+  }
+  // Same handshake as wait_room(), with head and consumer_waiting
+  pthread_mutex_lock(&q->lock);
+  atomic_store(&q->consumer_waiting, 1);
+  while (atomic_load(&q->head) == tail)
+    pthread_cond_wait(&q->cond, &q->lock);
+  atomic_store(&q->consumer_waiting, 0);
+  pthread_mutex_unlock(&q->lock);
+  return &q->batches[tail % PIPELINE_DEPTH];
+}
+
+/**
+ * @brief Gives the batch returned by pipeline_next() back to the pipeline
+ * thread, to be refilled
+ *
+ * @param pipeline The pipeline
+ * @param queue Index of the queue of the consumer
+ */
+void pipeline_release(BatchPipeline* pipeline, size_t queue) {
+  BatchQueue* q = &pipeline->queues[queue];
+  size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+  atomic_store(&q->tail, tail + 1);
+  wake_up(q, &q->producer_waiting);
+}
+
+/**
+ * @brief Makes the pipeline thread end without preparing the batches of the
+ * next epochs, when training stops early. The batches already prepared are
+ * dropped.
+ *
+ * @param pipeline The pipeline
+ */
+void stop_pipeline(BatchPipeline* pipeline) {
+  atomic_store_explicit(&pipeline->stopped, 1, memory_order_relaxed);
+  // Taking the lock orders the flag with the check of wait_room()
+  for (size_t q = 0; q < pipeline->nb_queues; q++) {
+    BatchQueue* queue = &pipeline->queues[q];
+    pthread_mutex_lock(&queue->lock);
+    pthread_cond_signal(&queue->cond);
+    pthread_mutex_unlock(&queue->lock);
+  }
+}
+
+/**
+ * @brief Waits for the pipeline thread to end and frees the batches
+ *
+ * @param pipeline A pointer to the pipeline to free
+ */
+void free_pipeline(BatchPipeline* pipeline) {
+  pthread_join(pipeline->thread, NULL);
+  for (size_t q = 0; q < pipeline->nb_queues; q++) {
+    for (size_t i = 0; i < PIPELINE_DEPTH; i++) {
+      free(pipeline->queues[q].batches[i].inputs);
+      free(pipeline->queues[q].batches[i].targets);
+      free(pipeline->queues[q].batches[i].labels);
+    }
+    pthread_mutex_destroy(&pipeline->queues[q].lock);
+    pthread_cond_destroy(&pipeline->queues[q].cond);
+  }
+  free(pipeline->queues);
+  free(pipeline->samples);
+  free(pipeline->shards);
+  free(pipeline->window_labels);
+  free(pipeline->window_pixels);
+  free(pipeline->window_order);
+  free(pipeline->image);
+  free(pipeline);
+}
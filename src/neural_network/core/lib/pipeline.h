@@ -0,0 +1,122 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "dataset.h"
+
+// Number of batches prepared in advance for each consumer
+#define PIPELINE_DEPTH 4
+
+/**
+ * Random transforms applied to the training images when their batch is
+ * prepared (the same as the ones of the dataset generator, gen_image.c)
+ */
+typedef struct Augmentation {
+  // Images are rotated around their center by an angle drawn in
+  // [-max_angle, max_angle] degrees, 0 to disable
+  double max_angle;
+  // Percentage (0-100) of pixels replaced by light gray noise
+  int noise;
+} Augmentation;
+
+/**
+ * Mini-batch decoded from a dataset, ready to be given to train_nn_batch()
+ */
+typedef struct Batch {
+  size_t size;    // Number of samples
+  size_t offset;  // Index of the first sample in the epoch
+  double* inputs;
+  double* targets;
+  uint8_t* labels;
+} Batch;
+
+/**
+ * Lock-free single producer single consumer ring of batches: the producer only
+ * writes head and the consumer only writes tail, each on its own cache line.
+ * A side finding the ring empty (or full) spins briefly, then sleeps on cond
+ * after raising its waiting flag, so that the other side only takes the lock
+ * to wake it up when it actually sleeps.
+ */
+typedef struct BatchQueue {
+  atomic_size_t head;  // Number of batches published by the producer
+  char head_padding[64 - sizeof(atomic_size_t)];
+  atomic_size_t tail;  // Number of batches released by the consumer
+  char tail_padding[64 - sizeof(atomic_size_t)];
+  atomic_int consumer_waiting;
+  atomic_int producer_waiting;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  Batch batches[PIPELINE_DEPTH];
+} BatchQueue;
+
+/**
+ * Background thread shuffling a dataset at each epoch and decoding its
+ * mini-batches into the queues of the consumers while they train on the
+ * previous ones. Batch b of an epoch goes to queue b % nb_queues, so each
+ * queue has a single consumer. The shuffling and transforms of an epoch only
+ * depend on the seed and on the index of the epoch, so that a training resumed
+ * from a checkpoint sees the same batches.
+ *
+ * Samples come either from a mapped dataset, shuffled as a whole, or from a
+ * dataset streamed window by window (see init_stream_pipeline()).
+ */
+typedef struct BatchPipeline {
+  // The samples of its order are owned by the pipeline thread, the held out
+  // images are not used
+  PackedDataset* dataset;
+  size_t* samples;  // Order of the samples before shuffling
+  // Streaming mode, dataset being NULL
+  const DatasetStream* stream;
+  size_t window;           // Number of shards shuffled together
+  size_t* shards;          // Order of the shards of the epoch
+  size_t next_shard;       // Index in shards of the next window
+  uint8_t* window_labels;  // Images of the current window
+  uint8_t* window_pixels;
+  size_t* window_order;
+  size_t window_size;
+  size_t position;  // Next sample in the order or in the window
+  size_t nb_samples;
+  size_t height;
+  size_t width;
+  size_t first_epoch;
+  size_t nb_epochs;
+  size_t batch_size;
+  size_t nb_output;
+  size_t nb_queues;
+  Augmentation augmentation;
+  uint64_t seed;
+  uint64_t rng_state;  // Generator of the epoch being prepared
+  BatchQueue* queues;
+  uint8_t* image;  // Augmented pixels of the current sample
+  pthread_t thread;
+  atomic_int stopped;  // Set by stop_pipeline()
+} BatchPipeline;
+
+BatchPipeline* init_pipeline(PackedDataset* dataset,
+                             size_t first_epoch,
+                             size_t nb_epochs,
+                             size_t batch_size,
+                             size_t nb_output,
+                             size_t nb_queues,
+                             const Augmentation* augmentation,
+                             uint64_t seed);
+BatchPipeline* init_stream_pipeline(const DatasetStream* stream,
+                                    size_t window,
+                                    size_t first_epoch,
+                                    size_t nb_epochs,
+                                    size_t batch_size,
+                                    size_t nb_output,
+                                    size_t nb_queues,
+                                    const Augmentation* augmentation,
+                                    uint64_t seed);
+size_t pipeline_nb_batches(const BatchPipeline* pipeline, size_t queue);
+const Batch* pipeline_next(BatchPipeline* pipeline, size_t queue);
+void pipeline_release(BatchPipeline* pipeline, size_t queue);
+void stop_pipeline(BatchPipeline* pipeline);
+void free_pipeline(BatchPipeline* pipeline);
+
+#endif
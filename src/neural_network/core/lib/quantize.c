@@ -0,0 +1,401 @@
+#include <err.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "core_network.h"
+#include "linalg.h"
+#include "quantize.h"
+
+static const char QNN_MAGIC[8] = "OCRQNN1";
+
+/**
+ * @brief Allocates a quantized network of the specified topology with all
+ * parameters set to 0
+ */
+static QuantizedNetwork* alloc_qnn(size_t nb_input,
+                                   size_t nb_hidden,
+                                   size_t nb_output,
+                                   ActivationFunction activation_hidden,
+                                   ActivationFunction activation_output) {
+  QuantizedNetwork* network = malloc(sizeof(QuantizedNetwork));
+  if (network == NULL) {
+    errx(EXIT_FAILURE, "Memory allocation failed");
+  }
+  network->nb_input = nb_input;
+  network->nb_hidden = nb_hidden;
+  network->nb_output = nb_output;
+  network->hidden_activation = activation_hidden;
+  network->output_activation = activation_output;
+
+  network->hidden_weights = calloc(nb_hidden * nb_input, sizeof(int8_t));
+  network->hidden_scales = calloc(nb_hidden, sizeof(float));
+  network->hidden_weight_sums = calloc(nb_hidden, sizeof(int32_t));
+  network->hidden_biases = calloc(nb_hidden, sizeof(float));
+  network->output_weights = calloc(nb_output * nb_hidden, sizeof(int8_t));
+  network->output_scales = calloc(nb_output, sizeof(float));
+  network->output_weight_sums = calloc(nb_output, sizeof(int32_t));
+  network->output_biases = calloc(nb_output, sizeof(float));
+  if (network->hidden_weights == NULL || network->hidden_scales == NULL ||
+      network->hidden_weight_sums == NULL || network->hidden_biases == NULL ||
+      network->output_weights == NULL || network->output_scales == NULL ||
+      network->output_weight_sums == NULL || network->output_biases == NULL) {
+    errx(EXIT_FAILURE, "Memory allocation failed");
+  }
+
+  double (*d_fct)(double);
+  if (activation_hidden == SOFTMAX ||
+      !get_activation(activation_hidden, &network->hidden_fct, &d_fct)) {
+    errx(EXIT_FAILURE, "Invalid hidden activation function");
+  }
+  if (!get_activation(activation_output, &network->output_fct, &d_fct)) {
+    errx(EXIT_FAILURE, "Invalid output activation function");
+  }
+  return network;
+}
+
+/**
+ * @brief Quantizes one channel (the incoming weights of a neuron) to int8
+ * with a symmetric scale: w ~= scale * q
+ *
+ * @param weights Weights of the channel
+ * @param size Number of weights of the channel
+ * @param res Where the size quantized weights are written
+ * @param scale Where the scale of the channel is written
+ * @param sum Where the sum of the quantized weights is written
+ */
+static void quantize_channel(const double* weights,
+                             size_t size,
+                             int8_t* res,
+                             float* scale,
+                             int32_t* sum) {
+  double max = 0;
+  for (size_t i = 0; i < size; i++) {
+    if (fabs(weights[i]) > max)
+      max = fabs(weights[i]);
+  }
+  *scale = max > 0 ? max / 127. : 1.;
+  *sum = 0;
+  for (size_t i = 0; i < size; i++) {
+    long q = lround(weights[i] / *scale);
+    res[i] = (int8_t)(q > 127 ? 127 : q < -127 ? -127 : q);
+    *sum += res[i];
+  }
+}
+
+/**
+ * @brief Quantizes a list of activations to uint8 with an affine mapping
+ * v ~= scale * q + offset covering [min, max] of the list.
+ *
+ * @return the scale, the offset being written to offset
+ */
+static double quantize_values(const double* values,
+                              size_t size,
+                              uint8_t* res,
+                              double* offset) {
+  double min = values[0];
+  double max = values[0];
+  for (size_t i = 1; i < size; i++) {
+    if (values[i] < min)
+      min = values[i];
+    if (values[i] > max)
+      max = values[i];
+  }
+  double scale = max > min ? (max - min) / 255. : 1.;
+  for (size_t i = 0; i < size; i++) {
+    res[i] = (uint8_t)lround((values[i] - min) / scale);
+  }
+  *offset = min;
+  return scale;
+}
+
+/**
+ * @brief Returns whether a network can be quantized by quantize_nn(): quantized
+ * networks have exactly one dense hidden layer and a dense output layer
+ */
+int can_quantize_nn(const Network* network) {
+  return network->nb_layers == 2 && network->layers[0].type == LAYER_DENSE &&
+         network->layers[1].type == LAYER_DENSE;
+}
+
+/**
+ * @brief Converts a trained network (e.g. from load_nn_data()) to a newly
+ * allocated int8 quantized network. Only networks with one hidden layer can be
+ * quantized, see can_quantize_nn().
+ *
+ * **NOTE**: The struct should be freed using the free_qnn() function.
+ *
+ * @param network A pointer to the network to quantize
+ * @return pointer to the quantized network
+ */
+QuantizedNetwork* quantize_nn(const Network* network) {
+  if (!can_quantize_nn(network)) {
+    errx(EXIT_FAILURE, "Quantized networks have one dense hidden layer");
+  }
+  const Layer* hidden = &network->layers[0];
+  const Layer* output = &network->layers[1];
+  QuantizedNetwork* res =
+      alloc_qnn(network->nb_input, hidden->nb_output, network->nb_output,
+                hidden->activation, output->activation);
+
+  // Network stores weights output-major: the channel of a neuron is a row
+  for (size_t h = 0; h < hidden->nb_output; h++) {
+    quantize_channel(hidden->weights + h * hidden->nb_input, hidden->nb_input,
+                     res->hidden_weights + h * res->nb_input,
+                     &res->hidden_scales[h], &res->hidden_weight_sums[h]);
+    res->hidden_biases[h] = hidden->biases[h];
+  }
+  for (size_t o = 0; o < output->nb_output; o++) {
+    quantize_channel(output->weights + o * output->nb_input, output->nb_input,
+                     res->output_weights + o * res->nb_hidden,
+                     &res->output_scales[o], &res->output_weight_sums[o]);
+    res->output_biases[o] = output->biases[o];
+  }
+  return res;
+}
+
+/**
+ * @brief Returns an inference context adapted for the specified quantized
+ * network
+ *
+ *  **NOTE**: The pointer has to be freed after use using free_qc()
+ */
+QuantizedContext* init_qc(const QuantizedNetwork* network) {
+  QuantizedContext* context = malloc(sizeof(QuantizedContext));
+  if (context == NULL) {
+    errx(EXIT_FAILURE, "Error while allocating memory");
+  }
+  context->input = calloc(network->nb_input, sizeof(uint8_t));
+  context->hidden = calloc(network->nb_hidden, sizeof(double));
+  context->hidden_q = calloc(network->nb_hidden, sizeof(uint8_t));
+  context->output = calloc(network->nb_output, sizeof(double));
+  if (context->input == NULL || context->hidden == NULL ||
+      context->hidden_q == NULL || context->output == NULL) {
+    errx(EXIT_FAILURE, "Error while allocating memory");
+  }
+  return context;
+}
+
+/**
+ * @brief Computes the output layer before its activation function. Both layers
+ * are integer dot products rescaled once per neuron.
+ */
+static void forward_qnn_logits(const QuantizedNetwork* network,
+                               QuantizedContext* context,
+                               const double* input) {
+  double in_offset;
+  double in_scale =
+      quantize_values(input, network->nb_input, context->input, &in_offset);
+
+  for (size_t h = 0; h < network->nb_hidden; h++) {
+    int32_t acc = dot_u8_i8(context->input,
+                            network->hidden_weights + h * network->nb_input,
+                            network->nb_input);
+    double total = network->hidden_scales[h] *
+                       (in_scale * acc +
+                        in_offset * network->hidden_weight_sums[h]) +
+                   network->hidden_biases[h];
+    if (network->hidden_activation == RELU)
+      context->hidden[h] = total > 0 ? total : 0;
+    else
+      context->hidden[h] = (*network->hidden_fct)(total);
+  }
+
+  double hidden_offset;
+  double hidden_scale = quantize_values(context->hidden, network->nb_hidden,
+                                        context->hidden_q, &hidden_offset);
+  for (size_t o = 0; o < network->nb_output; o++) {
+    int32_t acc = dot_u8_i8(context->hidden_q,
+                            network->output_weights + o * network->nb_hidden,
+                            network->nb_hidden);
+    context->output[o] = network->output_scales[o] *
+                             (hidden_scale * acc +
+                              hidden_offset * network->output_weight_sums[o]) +
+                         network->output_biases[o];
+  }
+}
+
+/**
+ * @brief Forward propagates the input data through the quantized network.
+ * Result is stored in the output list of the context.
+ *
+ * @param network A pointer to the quantized network (only read)
+ * @param context A pointer to the inference context
+ * @param input A double list of size equal to the input layer size
+ */
+void predict_qnn(const QuantizedNetwork* network,
+                 QuantizedContext* context,
+                 const double* input) {
+  forward_qnn_logits(network, context, input);
+  if (network->output_activation == SOFTMAX) {
+    double max_output = context->output[0];
+    for (size_t o = 0; o < network->nb_output; o++) {
+      if (context->output[o] > max_output)
+        max_output = context->output[o];
+    }
+    double total = 0;
+    for (size_t o = 0; o < network->nb_output; o++) {
+      context->output[o] = exp(context->output[o] - max_output);
+      total += context->output[o];
+    }
+    for (size_t o = 0; o < network->nb_output; o++) {
+      context->output[o] /= total;
+    }
+  } else {
+    for (size_t o = 0; o < network->nb_output; o++) {
+      context->output[o] = (*network->output_fct)(context->output[o]);
+    }
+  }
+}
+
+/**
+ * @brief Returns the index of the most probable output. All activation
+ * functions (softmax included) are increasing, so this is the argmax of the
+ * output layer before activation and no exp() is computed.
+ *
+ * @param network A pointer to the quantized network (only read)
+ * @param context A pointer to the inference context, its output list holds the
+ * output layer before activation afterwards
+ * @param input A double list of size equal to the input layer size
+ * @return index of the predicted output neuron
+ */
+size_t predict_qnn_argmax(const QuantizedNetwork* network,
+                          QuantizedContext* context,
+                          const double* input) {
+  forward_qnn_logits(network, context, input);
+  size_t best = 0;
+  for (size_t o = 1; o < network->nb_output; o++) {
+    if (context->output[o] > context->output[best])
+      best = o;
+  }
+  return best;
+}
+
+/**
+ * @brief Saves a quantized network to a binary file (host byte order):
+ * magic, topology, then the parameter arrays in the order of the struct.
+ *
+ * @param network A pointer to the quantized network to save
+ * @param path The file path where the network will be saved.
+ */
+void save_qnn_data(const QuantizedNetwork* network, const char* path) {
+  FILE* file = fopen(path, "wb");
+  if (file == NULL)
+    errx(EXIT_FAILURE, "Error while opening file to save quantized model");
+
+  uint64_t sizes[3] = {network->nb_input, network->nb_hidden,
+                       network->nb_output};
+  int32_t activations[2] = {network->hidden_activation,
+                            network->output_activation};
+  size_t nb_hidden_weights = network->nb_input * network->nb_hidden;
+  size_t nb_output_weights = network->nb_hidden * network->nb_output;
+  if (fwrite(QNN_MAGIC, sizeof(QNN_MAGIC), 1, file) != 1 ||
+      fwrite(sizes, sizeof(sizes), 1, file) != 1 ||
+      fwrite(activations, sizeof(activations), 1, file) != 1 ||
+      fwrite(network->hidden_weights, sizeof(int8_t), nb_hidden_weights,
+             file) != nb_hidden_weights ||
+      fwrite(network->hidden_scales, sizeof(float), network->nb_hidden,
+             file) != network->nb_hidden ||
+      fwrite(network->hidden_weight_sums, sizeof(int32_t), network->nb_hidden,
+             file) != network->nb_hidden ||
+      fwrite(network->hidden_biases, sizeof(float), network->nb_hidden,
+             file) != network->nb_hidden ||
+      fwrite(network->output_weights, sizeof(int8_t), nb_output_weights,
+             file) != nb_output_weights ||
+      fwrite(network->output_scales, sizeof(float), network->nb_output,
+             file) != network->nb_output ||
+      fwrite(network->output_weight_sums, sizeof(int32_t), network->nb_output,
+             file) != network->nb_output ||
+      fwrite(network->output_biases, sizeof(float), network->nb_output,
+             file) != network->nb_output) {
+    fclose(file);
+    errx(EXIT_FAILURE, "Error while writing quantized model");
+  }
+  fclose(file);
+}
+
+/**
+ * @brief Loads a quantized network saved by save_qnn_data()
+ *
+ * @param path The file path where the quantized network has been saved.
+ * @return pointer to loaded quantized network struct
+ */
+QuantizedNetwork* load_qnn_data(const char* path) {
+  FILE* file = fopen(path, "rb");
+  if (file == NULL)
+    errx(EXIT_FAILURE, "Error opening file");
+
+  char magic[sizeof(QNN_MAGIC)];
+  uint64_t sizes[3];
+  int32_t activations[2];
+  if (fread(magic, sizeof(magic), 1, file) != 1 ||
+      memcmp(magic, QNN_MAGIC, sizeof(magic)) != 0 ||
+      fread(sizes, sizeof(sizes), 1, file) != 1 ||
+      fread(activations, sizeof(activations), 1, file) != 1) {
+    fclose(file);
+    errx(EXIT_FAILURE, "Invalid quantized model file");
+  }
+  // Weight counts nb_input * nb_hidden and nb_hidden * nb_output must not
+  // overflow
+  if (sizes[0] == 0 || sizes[1] == 0 || sizes[2] == 0 || activations[0] < 0 ||
+      activations[1] < 0 || sizes[0] > SIZE_MAX / sizes[1] ||
+      sizes[2] > SIZE_MAX / sizes[1]) {
+    fclose(file);
+    errx(EXIT_FAILURE, "Invalid quantized model config");
+  }
+
+  QuantizedNetwork* network = alloc_qnn(sizes[0], sizes[1], sizes[2],
+                                        activations[0], activations[1]);
+  size_t nb_hidden_weights = network->nb_input * network->nb_hidden;
+  size_t nb_output_weights = network->nb_hidden * network->nb_output;
+  if (fread(network->hidden_weights, sizeof(int8_t), nb_hidden_weights,
+            file) != nb_hidden_weights ||
+      fread(network->hidden_scales, sizeof(float), network->nb_hidden, file) !=
+          network->nb_hidden ||
+      fread(network->hidden_weight_sums, sizeof(int32_t), network->nb_hidden,
+            file) != network->nb_hidden ||
+      fread(network->hidden_biases, sizeof(float), network->nb_hidden, file) !=
+          network->nb_hidden ||
+      fread(network->output_weights, sizeof(int8_t), nb_output_weights,
+            file) != nb_output_weights ||
+      fread(network->output_scales, sizeof(float), network->nb_output, file) !=
+          network->nb_output ||
+      fread(network->output_weight_sums, sizeof(int32_t), network->nb_output,
+            file) != network->nb_output ||
+      fread(network->output_biases, sizeof(float), network->nb_output, file) !=
+          network->nb_output) {
+    fclose(file);
+    free_qnn(network);
+    errx(EXIT_FAILURE, "Truncated quantized model file");
+  }
+  fclose(file);
+  return network;
+}
+
+/**
+ * @brief Frees a quantized inference context heap-allocated memory
+ */
+void free_qc(QuantizedContext* context) {
+  free(context->input);
+  free(context->hidden);
+  free(context->hidden_q);
+  free(context->output);
+  free(context);
+}
+
+/**
+ * @brief Frees a quantized network heap-allocated memory
+ */
+void free_qnn(QuantizedNetwork* network) {
+  free(network->hidden_weights);
+  free(network->hidden_scales);
+  free(network->hidden_weight_sums);
+  free(network->hidden_biases);
+  free(network->output_weights);
+  free(network->output_scales);
+  free(network->output_weight_sums);
+  free(network->output_biases);
+  free(network);
+}
@@ -0,0 +1,59 @@
+#ifndef QUANTIZE_H
+#define QUANTIZE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "core_network.h"
+
+/**
+ * Frozen network with 8 bits weights, quantized per channel (one scale per
+ * neuron), for inference only. Weights are stored output-major so that each
+ * neuron is one u8 x i8 dot product accumulated on 32 bits.
+ */
+typedef struct QuantizedNetwork {
+  size_t nb_input;
+  size_t nb_hidden;
+  size_t nb_output;
+  int8_t* hidden_weights;  // nb_hidden rows of nb_input weights
+  float* hidden_scales;
+  int32_t* hidden_weight_sums;
+  float* hidden_biases;
+  int8_t* output_weights;  // nb_output rows of nb_hidden weights
+  float* output_scales;
+  int32_t* output_weight_sums;
+  float* output_biases;
+  ActivationFunction hidden_activation;
+  ActivationFunction output_activation;
+  double (*hidden_fct)(double);
+  double (*output_fct)(double);
+} QuantizedNetwork;
+
+/**
+ * Per-thread inference state of a quantized network
+ */
+typedef struct QuantizedContext {
+  uint8_t* input;   // Quantized input
+  double* hidden;   // Hidden layer before quantization
+  uint8_t* hidden_q;
+  double* output;
+} QuantizedContext;
+
+int can_quantize_nn(const Network* network);
+QuantizedNetwork* quantize_nn(const Network* network);
+QuantizedContext* init_qc(const QuantizedNetwork* network);
+
+void predict_qnn(const QuantizedNetwork* network,
+                 QuantizedContext* context,
+                 const double* input);
+size_t predict_qnn_argmax(const QuantizedNetwork* network,
+                          QuantizedContext* context,
+                          const double* input);
+
+void save_qnn_data(const QuantizedNetwork* network, const char* path);
+QuantizedNetwork* load_qnn_data(const char* path);
+
+void free_qc(QuantizedContext* context);
+void free_qnn(QuantizedNetwork* network);
+
+#endif
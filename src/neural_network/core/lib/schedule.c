@@ -0,0 +1,51 @@
+#include "schedule.h"
+
+/**
+ * @brief Initializes a schedule starting at a learning rate
+ *
+ * @param schedule The schedule
+ * @param lr Initial learning rate
+ * @param patience Validations without improvement making a plateau
+ * @param factor Multiplier of the learning rate at each plateau
+ * @param max_reductions Plateaus reducing the learning rate before stopping,
+ * 0 to stop at the first one
+ */
+void init_schedule(PlateauSchedule* schedule,
+                   double lr,
+                   size_t patience,
+                   double factor,
+                   size_t max_reductions) {
+  schedule->patience = patience;
+  schedule->factor = factor;
+  schedule->max_reductions = max_reductions;
+  schedule->state = (ScheduleState){lr, -1., 0, 0, 0};
+}
+
+/**
+ * @brief Updates a schedule with the accuracy of a validation, which may
+ * reduce its learning rate or stop the training
+ *
+ * @param schedule The schedule
+ * @param accuracy Accuracy of the network on the validation images
+ * @return what the validation changed
+ */
+ScheduleEvent schedule_step(PlateauSchedule* schedule, double accuracy) {
+  ScheduleState* state = &schedule->state;
+  if (state->stopped)
+    return SCHEDULE_STOPPED;
+  if (accuracy > state->best + SCHEDULE_MIN_DELTA) {
+    state->best = accuracy;
+    state->nb_stale = 0;
+    return SCHEDULE_IMPROVED;
+  }
+  if (++state->nb_stale < schedule->patience)
+    return SCHEDULE_STALE;
+  state->nb_stale = 0;
+  if (state->nb_reductions == schedule->max_reductions) {
+    state->stopped = 1;
+    return SCHEDULE_STOPPED;
+  }
+  state->lr *= schedule->factor;
+  state->nb_reductions++;
+  return SCHEDULE_REDUCED;
+}
@@ -0,0 +1,48 @@
+#ifndef SCHEDULE_H
+#define SCHEDULE_H
+
+#include <stdlib.h>
+
+// Smallest increase of the validation accuracy counted as an improvement
+#define SCHEDULE_MIN_DELTA 1e-4
+
+/**
+ * State of a PlateauSchedule, saved in training checkpoints
+ */
+typedef struct ScheduleState {
+  double lr;             // Current learning rate
+  double best;           // Best validation accuracy so far
+  size_t nb_stale;       // Validations since the last improvement
+  size_t nb_reductions;  // Number of times the learning rate was reduced
+  int stopped;
+} ScheduleState;
+
+/**
+ * Learning rate schedule driven by the validation accuracy: once it has not
+ * improved for patience validations (a plateau), the learning rate is
+ * multiplied by factor, and training stops at the plateau following
+ * max_reductions reductions
+ */
+typedef struct PlateauSchedule {
+  size_t patience;
+  double factor;
+  size_t max_reductions;
+  ScheduleState state;
+} PlateauSchedule;
+
+typedef enum ScheduleEvent {
+  SCHEDULE_IMPROVED,
+  SCHEDULE_STALE,
+  SCHEDULE_REDUCED,
+  SCHEDULE_STOPPED
+
+} ScheduleEvent;
+
+void init_schedule(PlateauSchedule* schedule,
+                   double lr,
+                   size_t patience,
+                   double factor,
+                   size_t max_reductions);
+ScheduleEvent schedule_step(PlateauSchedule* schedule, double accuracy);
+
+#endif
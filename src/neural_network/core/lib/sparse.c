@@ -0,0 +1,126 @@
+#include "sparse.h"
+
+#include <err.h>
+#include <string.h>
+
+/**
+ * @brief Returns the inference path of a network for binarized inputs (see
+ * SparseNetwork)
+ *
+ * **NOTE**: The struct should be freed using free_sparse_nn()
+ *
+ * @param network The network, whose first layer is dense
+ * @return pointer to the sparse inference path
+ */
+SparseNetwork* init_sparse_nn(const Network* network) {
+  const Layer* first = &network->layers[0];
+  if (first->type != LAYER_DENSE)
+    errx(EXIT_FAILURE, "Sparse inference needs a dense first layer");
+  const size_t nb_input = first->nb_input;
+  const size_t nb_hidden = first->nb_output;
+  SparseNetwork* sparse = malloc(sizeof(SparseNetwork));
+  double* white = malloc(nb_hidden * sizeof(double));
+  double* columns = malloc(nb_input * nb_hidden * sizeof(double));
+  if (sparse == NULL || white == NULL || columns == NULL)
+    errx(EXIT_FAILURE, "Error while allocating memory");
+  for (size_t h = 0; h < nb_hidden; h++) {
+    const double* row = first->weights + h * nb_input;
+    double total = first->biases[h];
+    for (size_t i = 0; i < nb_input; i++) {
+      total += row[i];
+      columns[i * nb_hidden + h] = row[i];
+    }
+    white[h] = total;
+  }
+  sparse->network = network;
+  sparse->nb_input = nb_input;
+  sparse->nb_hidden = nb_hidden;
+  sparse->white = white;
+  sparse->columns = columns;
+  return sparse;
+}
+
+/**
+ * @brief Packs a binarized input to the bitmask of its ink pixels: bit i % 64
+ * of word i / 64 is set when input i is below 0.5
+ *
+ * @param input List of size doubles, 0 (ink) or 1 (paper)
+ * @param size Number of inputs
+ * @param bits Where the SPARSE_NB_WORDS(size) words of the mask are written
+ */
+void pack_ink_bits(const double* input, size_t size, uint64_t* bits) {
+  memset(bits, 0, SPARSE_NB_WORDS(size) * sizeof(uint64_t));
+  for (size_t i = 0; i < size; i++) {
+    if (input[i] < .5)
+      bits[i / 64] |= (uint64_t)1 << (i % 64);
+  }
+}
+
+/**
+ * @brief Adds sign times the weights of the inputs whose bit is set (clear
+ * when invert) to the pre-activation of the first layer, one row of the
+ * input-major weights per input
+ */
+static void add_columns(const SparseNetwork* sparse,
+                        const uint64_t* bits,
+                        int invert,
+                        double sign,
+                        double* restrict pre) {
+  const size_t nb_hidden = sparse->nb_hidden;
+  const size_t nb_words = SPARSE_NB_WORDS(sparse->nb_input);
+  for (size_t w = 0; w < nb_words; w++) {
+    uint64_t word = invert ? ~bits[w] : bits[w];
+    if (invert && w == nb_words - 1 && sparse->nb_input % 64 != 0)
+      word &= ((uint64_t)1 << (sparse->nb_input % 64)) - 1;
+    while (word != 0) {
+      size_t i = w * 64 + __builtin_ctzll(word);
+      word &= word - 1;
+      const double* restrict column = sparse->columns + i * nb_hidden;
+      for (size_t h = 0; h < nb_hidden; h++)
+        pre[h] += sign * column[h];
+    }
+  }
+}
+
+/**
+ * @brief Forward propagates a binarized input given as the bitmask of its ink
+ * pixels. Gives the same result as predict_nn_ctx() on the unpacked input, up
+ * to rounding.
+ *
+ * @param sparse The sparse inference path of the network
+ * @param context An inference context of the network, receiving the
+ * activations of every layer
+ * @param ink The SPARSE_NB_WORDS(nb_input) words of the mask of the ink
+ * pixels, see pack_ink_bits()
+ */
+void predict_sparse_nn(const SparseNetwork* sparse,
+                       NetworkContext* context,
+                       const uint64_t* ink) {
+  const size_t nb_words = SPARSE_NB_WORDS(sparse->nb_input);
+  const size_t nb_hidden = sparse->nb_hidden;
+  double* pre = context->layers[0];
+  size_t nb_ink = 0;
+  for (size_t w = 0; w < nb_words; w++)
+    nb_ink += __builtin_popcountll(ink[w]);
+
+  if (2 * nb_ink <= sparse->nb_input) {
+    memcpy(pre, sparse->white, nb_hidden * sizeof(double));
+    add_columns(sparse, ink, 0, -1., pre);
+  } else {
+    // Mostly ink: start from a black input and add the paper pixels
+    memcpy(pre, sparse->network->layers[0].biases, nb_hidden * sizeof(double));
+    add_columns(sparse, ink, 1, 1., pre);
+  }
+  predict_nn_preactivated(sparse->network, context);
+}
+
+/**
+ * @brief Frees a sparse inference path (not its network)
+ *
+ * @param sparse A pointer to the sparse inference path to free
+ */
+void free_sparse_nn(SparseNetwork* sparse) {
+  free(sparse->white);
+  free(sparse->columns);
+  free(sparse);
+}
@@ -0,0 +1,41 @@
+#ifndef SPARSE_H
+#define SPARSE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "core_network.h"
+
+// Number of words of a packed input of size bits (see pack_ink_bits())
+#define SPARSE_NB_WORDS(size) (((size) + 63) / 64)
+
+/**
+ * Inference path of a network for binarized inputs, each input being either 1
+ * (white paper) or 0 (black ink), given as a bitmask of the ink pixels (1024
+ * bits = 128 bytes for a glyph). The pre-activation of the first layer for an
+ * all white input is computed once, then each glyph only subtracts the weights
+ * of its ink pixels, instead of a dense dot product over every input. Glyphs
+ * with more ink than paper start from the biases and add the weights of their
+ * white pixels instead.
+ *
+ * The first layer has to be dense. The network is not copied and has to
+ * outlive the SparseNetwork.
+ */
+typedef struct SparseNetwork {
+  const Network* network;
+  size_t nb_input;
+  size_t nb_hidden;  // Number of neurons of the first layer
+  double* white;     // Biases + sum of the weights of every input
+  // Input-major copy of the weights of the first layer: one contiguous row of
+  // nb_hidden weights per input
+  double* columns;
+} SparseNetwork;
+
+SparseNetwork* init_sparse_nn(const Network* network);
+void pack_ink_bits(const double* input, size_t size, uint64_t* bits);
+void predict_sparse_nn(const SparseNetwork* sparse,
+                       NetworkContext* context,
+                       const uint64_t* ink);
+void free_sparse_nn(SparseNetwork* sparse);
+
+#endif
@@ -0,0 +1,50 @@
+/*
+ * Decodes the images of a dataset directory once and writes their
+ * preprocessed pixels and labels to its pack file (see lib/dataset.c), which
+ * training_images and test_accuracy map instead of decoding the PNG files.
+ * They build missing or outdated packs themselves, this tool forces a rebuild.
+ */
+
+#define _GNU_SOURCE
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "lib/dataset.h"
+
+int main(int argc, char** argv) {
+  size_t workers = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "j:")) != -1) {
+    switch (opt) {
+      case 'j':
+        if (atol(optarg) <= 0)
+          errx(EXIT_FAILURE, "Number of workers invalid");
+        workers = atol(optarg);
+        break;
+      default:
+        errx(EXIT_FAILURE, "Unknown option, see usage");
+    }
+  }
+  if (argc - optind != 2 && argc - optind != 3) {
+    errx(EXIT_FAILURE,
+         "Usage %s [-j workers] <dataset directory> <0|1, 1 = bw; 0 = gray "
+         "scale> [output path, default: <directory>.bw.pack or .gs.pack]\n"
+         "-j <workers>: number of decoding threads (default: one per CPU)",
+         argv[0]);
+  }
+  char** args = argv + optind - 1;
+
+  int is_bw = atoi(args[2]);
+  int default_path = argc - optind == 2;
+  char* path = default_path ? dataset_pack_path(args[1], is_bw) : args[3];
+  pack_dataset(args[1], is_bw, path, workers);
+
+  PackedDataset* dataset = map_dataset(path);
+  printf("Packed %ld images of %s to %s\n", dataset->size, args[1], path);
+  free_dataset(dataset);
+  if (default_path)
+    free(path);
+  return EXIT_SUCCESS;
+}
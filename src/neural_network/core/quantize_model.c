@@ -0,0 +1,30 @@
+/*
+ * Offline quantizer: converts a model saved by save_nn_data() to a per-channel
+ * int8 model for inference with predict_qnn()
+ */
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "lib/core_network.h"
+#include "lib/quantize.h"
+
+int main(int argc, char** argv) {
+  if (argc != 3) {
+    errx(EXIT_FAILURE, "Usage %s <model data> <quantized model output path>",
+         argv[0]);
+  }
+
+  Network* network = load_nn_data(argv[1]);
+  QuantizedNetwork* quantized = quantize_nn(network);
+  save_qnn_data(quantized, argv[2]);
+
+  size_t nb_weights = nn_nb_weights(network);
+  printf("Quantized %ld weights: %ld KB -> %ld KB\n", nb_weights,
+         nb_weights * sizeof(double) / 1024, nb_weights / 1024);
+
+  free_qnn(quantized);
+  free_nn(network);
+  return EXIT_SUCCESS;
+}
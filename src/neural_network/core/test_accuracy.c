@@ -1,63 +1,236 @@
+#define _GNU_SOURCE
 #include <dirent.h>
 #include <err.h>
+#include <getopt.h>
 #include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "lib/core_network.h"
+#include "lib/dataset.h"
+#include "lib/evaluation.h"
+#include "lib/glyph.h"
+#include "lib/network_f32.h"
 #include "lib/ocr.h"
+#include "lib/quantize.h"
 
-int main(int argc, char** argv) {
-  if (argc != 5)
-    errx(EXIT_FAILURE,
-         "Usage: %s <model data> <testing images directory> <0|1, 1 = bw; 0 = "
-         "gray scale> unknown?<0|1>" ,
-         argv[0]);
+/**
+ * @brief Returns the number of seconds elapsed since start
+ */
+static double elapsed_since(const struct timespec* start) {
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
 
-  Network* network = load_nn_data(argv[1]);
-  int is_bw = atoi(argv[3]);
-  int unknown = atoi(argv[4]);
-  char* testing_directory = argv[2];
-
-  size_t sample_testing_size = 0;
-  char** testing_img_path =
-      get_filenames_in_dir(testing_directory, &sample_testing_size);
-  sort_string_list(testing_img_path, sample_testing_size);
-  double** testing_data = calloc(sample_testing_size, sizeof(double*));
-  if (testing_data == NULL) {
+/**
+ * @brief Prints the accuracy, the agreement with the double precision model
+ * and the time per sample of the double, float and int8 versions of a model,
+ * and of its sparse path on bit-packed glyphs for black and white samples.
+ * Versions the model cannot be converted to are skipped: float needs dense
+ * layers, int8 one dense hidden layer.
+ *
+ * @param network The double precision model, converted to the other versions
+ * @param path Names of the files, the first letter being the expected output
+ * @param data Inputs of the samples
+ * @param size Number of samples
+ * @param unknown Whether the expected outputs are unknown
+ * @param is_bw Whether the samples are binarized
+ */
+static void compare_precisions(const Network* network,
+                               char** path,
+                               double** data,
+                               size_t size,
+                               int unknown,
+                               int is_bw) {
+  NetworkF32* network_f32 = NULL;
+  NetworkContextF32* context_f32 = NULL;
+  if (can_convert_nn_f32(network)) {
+    network_f32 = nn_to_f32(network);
+    context_f32 = init_nc_f32(network_f32);
+  }
+  QuantizedNetwork* network_q = NULL;
+  QuantizedContext* context_q = NULL;
+  if (can_quantize_nn(network)) {
+    network_q = quantize_nn(network);
+    context_q = init_qc(network_q);
+  }
+  NetworkContext* context = init_nc(network);
+  float* input_f32 = calloc(network->nb_input, sizeof(float));
+  size_t* reference = calloc(size, sizeof(size_t));
+  if (input_f32 == NULL || reference == NULL)
     errx(EXIT_FAILURE, "Error while allocating memory");
+  // Glyphs are packed up front, as a dataset of glyphs would be kept
+  SparseNetwork* sparse = NULL;
+  Glyph32* glyphs = NULL;
+  if (is_bw && network->layers[0].type == LAYER_DENSE &&
+      network->nb_input == GLYPH_SIZE * GLYPH_SIZE) {
+    sparse = init_sparse_nn(network);
+    glyphs = calloc(size, sizeof(Glyph32));
+    if (glyphs == NULL)
+      errx(EXIT_FAILURE, "Error while allocating memory");
+    for (size_t k = 0; k < size; k++)
+      array_to_glyph(data[k], &glyphs[k]);
   }
 
-  for (size_t j = 0; j < sample_testing_size; j++) {
-    size_t path_length =
-        strlen(testing_directory) + 1 + strlen(testing_img_path[j]) + 1;
-    
-    char* path2 = calloc(path_length, sizeof(char));
-    if (path2 == NULL) {
-      errx(EXIT_FAILURE, "Error while allocating memory");
+  const char* names[4] = {"double", "float32", "int8", "glyph"};
+  const int available[4] = {1, network_f32 != NULL, network_q != NULL,
+                            sparse != NULL};
+  for (size_t m = 0; m < 4; m++) {
+    if (!available[m]) {
+      if (m != 3)
+        printf("%-8s Skipped: unsupported layers\n", names[m]);
+      continue;
+    }
+    size_t nbgood = 0;
+    size_t nbagree = 0;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t k = 0; k < size; k++) {
+      size_t guess;
+      if (m == 0) {
+        predict_nn_ctx(network, context, data[k]);
+        guess = indexOfMax(context->output, network->nb_output);
+        reference[k] = guess;
+      } else if (m == 1) {
+        for (size_t i = 0; i < network->nb_input; i++)
+          input_f32[i] = (float)data[k][i];
+        predict_nn_f32(network_f32, context_f32, input_f32);
+        guess = 0;
+        for (size_t o = 1; o < network->nb_output; o++) {
+          if (context_f32->output[o] > context_f32->output[guess])
+            guess = o;
+        }
+      } else if (m == 2) {
+        guess = predict_qnn_argmax(network_q, context_q, data[k]);
+      } else {
+        predict_glyph(sparse, context, &glyphs[k]);
+        guess = indexOfMax(context->output, network->nb_output);
+      }
+      nbgood += (int)guess == path[k][0] - 'a';
+      nbagree += guess == reference[k];
     }
+    double elapsed = elapsed_since(&start);
+    printf("%-8s ", names[m]);
+    if (!unknown)
+      printf("Accuracy: %9.3lf%% ", (double)nbgood / size * 100);
+    printf("Agreement: %9.3lf%% Time: %8.2fus/sample\n",
+           (double)nbagree / size * 100, elapsed / size * 1e6);
+  }
 
-    snprintf(path2, path_length, "%s/%s", testing_directory,
-             testing_img_path[j]);
+  if (sparse != NULL)
+    free_sparse_nn(sparse);
+  free(glyphs);
+  free(reference);
+  free(input_f32);
+  free_nc(context);
+  if (network_q != NULL) {
+    free_qc(context_q);
+    free_qnn(network_q);
+  }
+  if (network_f32 != NULL) {
+    free_nc_f32(context_f32);
+    free_nn_f32(network_f32);
+  }
+}
 
-    SDL_Surface* a = load_image(path2);
-    if (is_bw == 1) {
-      to_bw(a);
-    } else {
-      to_gs(a);
+int main(int argc, char** argv) {
+  int compare = 0;
+  int verbose = 0;
+  size_t top_k = 3;
+  const char* summary_path = NULL;
+  const struct option long_options[] = {
+      {"summary", required_argument, NULL, 'S'},
+      {"top-k", required_argument, NULL, 'T'},
+      {"verbose", no_argument, NULL, 'V'},
+      {NULL, 0, NULL, 0}};
+  int opt;
+  while ((opt = getopt_long(argc, argv, "cV", long_options, NULL)) != -1) {
+    switch (opt) {
+      case 'c':
+        compare = 1;
+        break;
+      case 'S':
+        summary_path = optarg;
+        break;
+      case 'T':
+        if (atol(optarg) <= 0 || atol(optarg) > OUTPUT_SIZE)
+          errx(EXIT_FAILURE, "Top-k invalid");
+        top_k = atol(optarg);
+        break;
+      case 'V':
+        verbose = 1;
+        break;
+      default:
+        errx(EXIT_FAILURE, "Unknown option, see usage");
     }
+  }
+  if (argc - optind != 4)
+    errx(EXIT_FAILURE,
+         "Usage: %s [-c] [-V] [--summary path] [--top-k k] <model data> "
+         "<testing images directory> <0|1, 1 = bw; 0 = gray scale> "
+         "unknown?<0|1>\n"
+         "-c: compares the double, float32 and int8 versions of the model "
+         "(and its sparse path on bit-packed glyphs if bw) instead of "
+         "evaluating it\n"
+         "-V, --verbose: prints the outputs of every sample and the "
+         "confusion matrix\n"
+         "--summary <path>: writes the results to path, as CSV if it ends "
+         "with .csv and as JSON otherwise\n"
+         "--top-k <k>: counts a sample as a top-k success when its letter is "
+         "one of the k best guesses (default: 3)",
+         argv[0]);
+  char** args = argv + optind - 1;
+
+  Network* network = load_nn_data(args[1]);
+  int is_bw = atoi(args[3]);
+  int unknown = atoi(args[4]);
+  char* testing_directory = args[2];
 
-    testing_data[j] = to_double_array(a);
-    SDL_FreeSurface(a);
-    free(path2);
+  // Images are decoded once to the pack file of the directory
+  PackedDataset* testing_set = load_dataset(testing_directory, is_bw);
+  size_t sample_testing_size = testing_set->size;
+  // Inputs are only decoded up front to print every sample, the evaluation
+  // decoding them block by block
+  size_t nb_decoded = compare || unknown || verbose ? sample_testing_size : 0;
+  char** testing_img_path = calloc(nb_decoded, sizeof(char*));
+  double** testing_data = calloc(nb_decoded, sizeof(double*));
+  double* testing_inputs = calloc(nb_decoded * IMG_H * IMG_W, sizeof(double));
+  if (testing_img_path == NULL || testing_data == NULL ||
+      (nb_decoded > 0 && testing_inputs == NULL)) {
+    errx(EXIT_FAILURE, "Error while allocating memory");
+  }
+
+  for (size_t j = 0; j < nb_decoded; j++) {
+    testing_img_path[j] = strdup(testing_set->names[j]);
+    testing_data[j] = testing_inputs + j * IMG_H * IMG_W;
+    if (testing_img_path[j] == NULL) {
+      errx(EXIT_FAILURE, "Error while allocating memory");
+    }
+    dataset_input(testing_set, j, testing_data[j]);
+  }
+  if (compare)
+    compare_precisions(network, testing_img_path, testing_data,
+                       sample_testing_size, unknown, is_bw);
+  else if(unknown) print_table_2(network, &testing_img_path, &testing_data, sample_testing_size);
+  else {
+    if (verbose)
+      print_table(network, &testing_img_path, &testing_data,
+                  sample_testing_size);
+    Evaluation* evaluation = evaluate_nn(network, testing_set, NULL,
+                                         sample_testing_size, top_k);
+    print_evaluation(evaluation, verbose);
+    if (summary_path != NULL)
+      save_evaluation(evaluation, summary_path);
+    free_evaluation(evaluation);
   }
-  if(unknown) print_table_2(network, &testing_img_path, &testing_data, sample_testing_size);
-  else print_table(network, &testing_img_path, &testing_data, sample_testing_size);
+  free_dataset(testing_set);
 
   free_nn(network);
-  for (size_t k = 0; k < sample_testing_size; k++)
+  for (size_t k = 0; k < nb_decoded; k++)
     free(testing_img_path[k]);
   free(testing_img_path);
-  for(size_t k = 0;  k < sample_testing_size; k++)
-    free(testing_data[k]);
+  free(testing_inputs);
   free(testing_data);
   return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
@@ -25,21 +25,39 @@ int main(int argc, char** argv) {
   if (img == NULL)
     errx(EXIT_FAILURE, "Error loading the image");
   int nb_or_gs = atoi(argv[3]);
+  double result[OUTPUT_SIZE];
+  OcrWorkspace* workspace = init_ocr_workspace(ocr);
+  predict_from_surface_ws(ocr, workspace, img, nb_or_gs != 0, result);
+  // Confidences are softmax probabilities, only given by softmax outputs
+  OcrGuess guesses[3];
+  size_t nb_guesses = 0;
+  if (ocr->layers[ocr->nb_layers - 1].activation == SOFTMAX)
+    nb_guesses = predict_top_k(ocr, workspace, img, nb_or_gs != 0, 3, guesses);
+  free_ocr_workspace(workspace);
+  free_nn(ocr);
+  // The surface is only converted to be displayed
   if (nb_or_gs == 0) {
     to_gs(img);
 
   } else {
     to_bw(img);
   }
-  double* result = predict_from_surface(ocr, img);
-  free_nn(ocr);
 
   printf("Predictions: \n");
   for (size_t k = 0; k < OUTPUT_SIZE; k++) {
     printf("%c - %3.3f\n", (char)('a' + k), result[k]);
   }
+  if (nb_guesses > 0) {
+    printf("Best guesses:");
+    for (size_t k = 0; k < nb_guesses; k++) {
+      if (guesses[k].letter != '\0')
+        printf(" %c (%.3f)", guesses[k].letter, guesses[k].confidence);
+      else
+        printf(" #%zu (%.3f)", guesses[k].index, guesses[k].confidence);
+    }
+    printf("\n");
+  }
 
-  free(result);
 
   if (SDL_Init(SDL_INIT_VIDEO) < 0) {
     printf("SDL could not initialize! SDL_Error: %s\n", SDL_GetError());
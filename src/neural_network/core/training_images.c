@@ -1,15 +1,24 @@
+#define _GNU_SOURCE
 #include <SDL2/SDL_image.h>
 #include <SDL2/SDL_pixels.h>
 #include <dirent.h>
 #include <err.h>
+#include <getopt.h>
 #include <math.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
 #include <SDL2/SDL.h>
+#include "lib/checkpoint.h"
 #include "lib/core_network.h"
+#include "lib/dataset.h"
+#include "lib/evaluation.h"
 #include "lib/ocr.h"
+#include "lib/pipeline.h"
+#include "lib/schedule.h"
 
 // #define IMG_W 32
 // #define IMG_H 32
@@ -17,13 +26,281 @@
 #define INPUT_LAYER_SIZE IMG_H* IMG_W
 #define HIDDEN_LAYER_SIZE 256  // Arbitrary
 #define OUTPUT_LAYER_SIZE 26
+#define MAX_HIDDEN_LAYERS 8
+#define CONV_KERNEL_SIZE 3
+// Images of a shard of a streamed training set (1 MB of 32x32 pixels)
+#define STREAM_SHARD_SIZE 1024
+
+/**
+ * Part of a shuffled epoch trained by one worker. Workers share the network and
+ * update it without locking (Hogwild): with one sample or mini-batch touching a
+ * small fraction of the gradient magnitude, concurrent updates rarely conflict
+ * and the few lost updates do not prevent convergence. Each worker keeps its
+ * own optimizer state (moments) in its trainer, and consumes its own queue of
+ * the batch pipeline.
+ */
+typedef struct TrainingSlice {
+  Network* network;
+  NetworkTrainer* trainer;
+  BatchPipeline* pipeline;
+  size_t queue;       // Index of the queue of the worker in the pipeline
+  size_t nb_batches;  // Number of batches of the epoch trained by the worker
+  double lr;
+  char verbose;
+  size_t max_iter;
+} TrainingSlice;
+
+/**
+ * @brief Trains the network on every batch of a slice, prepared in the
+ * background by the pipeline. Used as a thread routine.
+ *
+ * @param arg A pointer to the TrainingSlice to train on
+ * @return NULL
+ */
+static void* train_slice(void* arg) {
+  TrainingSlice* slice = arg;
+  NetworkTrainer* trainer = slice->trainer;
+
+  for (size_t j = 0; j < slice->nb_batches; j++) {
+    const Batch* batch = pipeline_next(slice->pipeline, slice->queue);
+    if (batch->size == 1) {
+      train_nn(trainer, slice->network, batch->inputs, batch->targets,
+               slice->lr);
+      if (slice->verbose) {
+        flockfile(stdout);
+        print_current_iter(trainer->context->output, batch->labels[0] + 'A',
+                           batch->offset, slice->max_iter);
+        funlockfile(stdout);
+      }
+      pipeline_release(slice->pipeline, slice->queue);
+      continue;
+    }
+    train_nn_batch(trainer, slice->network, batch->inputs, batch->targets,
+                   batch->size, slice->lr);
+    if (slice->verbose) {
+      const double* outputs =
+          trainer->batch_layers[slice->network->nb_layers - 1];
+      flockfile(stdout);
+      for (size_t s = 0; s < batch->size; s++) {
+        print_current_iter(outputs + s * OUTPUT_LAYER_SIZE,
+                           batch->labels[s] + 'A', batch->offset + s,
+                           slice->max_iter);
+      }
+      funlockfile(stdout);
+    }
+    pipeline_release(slice->pipeline, slice->queue);
+  }
+  return NULL;
+}
+
+/**
+ * @brief Parses a comma separated list of hidden layers (e.g. "128,64" or
+ * "c8,p2,c8,p2"): a number is a dense layer of that size, "cN" a 3x3
+ * convolution with N output channels and "pN" a max pooling of N x N windows
+ *
+ * @param arg The list to parse
+ * @param specs Where the layers are written (at most MAX_HIDDEN_LAYERS), their
+ * activation function being left to the caller
+ * @return the number of hidden layers
+ */
+static size_t parse_layer_specs(const char* arg, LayerSpec* specs) {
+  size_t count = 0;
+  while (*arg != '\0') {
+    LayerSpec spec = {LAYER_DENSE, 0, 0, SIGMOID};
+    if (*arg == 'c' || *arg == 'p') {
+      spec.type = *arg == 'c' ? LAYER_CONV2D : LAYER_MAXPOOL;
+      arg++;
+    }
+    char* end;
+    long size = strtol(arg, &end, 10);
+    if (end == arg || size <= 0 || count == MAX_HIDDEN_LAYERS ||
+        (*end != ',' && *end != '\0'))
+      errx(EXIT_FAILURE, "Hidden layers invalid");
+    if (spec.type == LAYER_MAXPOOL) {
+      spec.size = 1;
+      spec.kernel = size;
+    } else {
+      spec.size = size;
+      spec.kernel = spec.type == LAYER_CONV2D ? CONV_KERNEL_SIZE : 0;
+    }
+    specs[count++] = spec;
+    arg = *end == ',' ? end + 1 : end;
+  }
+  if (count == 0)
+    errx(EXIT_FAILURE, "Hidden layers invalid");
+  return count;
+}
+
+/**
+ * @brief Prints the outputs of the network for every image of a dataset with
+ * print_table(), which needs their names and decoded inputs
+ */
+static void print_dataset_table(const Network* network,
+                                const PackedDataset* dataset) {
+  size_t size = dataset->size;
+  double** data = calloc(size, sizeof(double*));
+  char** names = calloc(size, sizeof(char*));
+  double* inputs = calloc(size * INPUT_LAYER_SIZE, sizeof(double));
+  if (data == NULL || names == NULL || (size > 0 && inputs == NULL))
+    errx(EXIT_FAILURE, "Error while allocating memory");
+  for (size_t j = 0; j < size; j++) {
+    data[j] = inputs + j * INPUT_LAYER_SIZE;
+    // Only read by print_table()
+    names[j] = (char*)dataset->names[j];
+    dataset_input(dataset, j, data[j]);
+  }
+  print_table(network, &names, &data, size);
+  free(inputs);
+  free(data);
+  free(names);
+}
+
+/**
+ * @brief Parses the name of an optimizer (sgd, momentum, nesterov or adam)
+ */
+static OptimizerType parse_optimizer(const char* arg) {
+  const char* names[4] = {"sgd", "momentum", "nesterov", "adam"};
+  const OptimizerType types[4] = {OPTIMIZER_SGD, OPTIMIZER_MOMENTUM,
+                                  OPTIMIZER_NESTEROV, OPTIMIZER_ADAM};
+  for (size_t i = 0; i < 4; i++) {
+    if (strcmp(arg, names[i]) == 0)
+      return types[i];
+  }
+  errx(EXIT_FAILURE, "Optimizer invalid");
+}
 
 int main(int argc, char** argv) {
-  if (argc != 8)
+  size_t batch_size = 1;
+  OptimizerType optimizer = OPTIMIZER_SGD;
+  size_t workers = 1;
+  LayerSpec layer_specs[MAX_HIDDEN_LAYERS + 1] = {
+      {LAYER_DENSE, HIDDEN_LAYER_SIZE, 0, SIGMOID}};
+  size_t nb_hidden_layers = 1;
+  uint64_t rng_state = time(NULL);
+  Augmentation augmentation = {0., 0};
+  const char* checkpoint_path = "./ocr.ckpt";
+  size_t checkpoint_every = 1;
+  int resume = 0;
+  double validation_percent = 0.;
+  size_t validate_every = 1;
+  size_t patience = 3;
+  double lr_factor = 0.5;
+  size_t max_reductions = 3;
+  int verbose = 0;
+  size_t top_k = 3;
+  const char* summary_path = NULL;
+  size_t stream_window = 0;
+  const struct option long_options[] = {
+      {"checkpoint", required_argument, NULL, 'c'},
+      {"checkpoint-every", required_argument, NULL, 'k'},
+      {"max-reductions", required_argument, NULL, 'M'},
+      {"resume", no_argument, NULL, 'R'},
+      {"stream", required_argument, NULL, 'W'},
+      {"summary", required_argument, NULL, 'S'},
+      {"top-k", required_argument, NULL, 'T'},
+      {"verbose", no_argument, NULL, 'V'},
+      {NULL, 0, NULL, 0}};
+  int opt;
+  while ((opt = getopt_long(argc, argv, "b:c:e:f:j:k:l:n:o:p:r:s:v:V",
+                            long_options, NULL)) != -1) {
+    switch (opt) {
+      case 'b':
+        if (atol(optarg) <= 0)
+          errx(EXIT_FAILURE, "Batch size invalid");
+        batch_size = atol(optarg);
+        break;
+      case 'c':
+        checkpoint_path = optarg;
+        break;
+      case 'e':
+        if (atol(optarg) <= 0)
+          errx(EXIT_FAILURE, "Validation interval invalid");
+        validate_every = atol(optarg);
+        break;
+      case 'f':
+        lr_factor = atof(optarg);
+        if (lr_factor <= 0. || lr_factor > 1.)
+          errx(EXIT_FAILURE, "Learning rate factor invalid");
+        break;
+      case 'j':
+        if (atol(optarg) <= 0)
+          errx(EXIT_FAILURE, "Number of workers invalid");
+        workers = atol(optarg);
+        break;
+      case 'k':
+        if (atol(optarg) < 0)
+          errx(EXIT_FAILURE, "Checkpoint interval invalid");
+        checkpoint_every = atol(optarg);
+        break;
+      case 'l':
+        nb_hidden_layers = parse_layer_specs(optarg, layer_specs);
+        break;
+      case 'M':
+        if (atol(optarg) < 0)
+          errx(EXIT_FAILURE, "Maximum number of reductions invalid");
+        max_reductions = atol(optarg);
+        break;
+      case 'n':
+        augmentation.noise = atoi(optarg);
+        if (augmentation.noise < 0 || augmentation.noise > 100)
+          errx(EXIT_FAILURE, "Noise intensity invalid");
+        break;
+      case 'o':
+        optimizer = parse_optimizer(optarg);
+        break;
+      case 'p':
+        if (atol(optarg) <= 0)
+          errx(EXIT_FAILURE, "Patience invalid");
+        patience = atol(optarg);
+        break;
+      case 'r':
+        augmentation.max_angle = atof(optarg);
+        if (augmentation.max_angle < 0. || augmentation.max_angle > 180.)
+          errx(EXIT_FAILURE, "Rotation angle invalid");
+        break;
+      case 'R':
+        resume = 1;
+        break;
+      case 'S':
+        summary_path = optarg;
+        break;
+      case 'T':
+        if (atol(optarg) <= 0 || atol(optarg) > OUTPUT_LAYER_SIZE)
+          errx(EXIT_FAILURE, "Top-k invalid");
+        top_k = atol(optarg);
+        break;
+      case 'V':
+        verbose = 1;
+        break;
+      case 'W':
+        if (atol(optarg) <= 0)
+          errx(EXIT_FAILURE, "Stream window invalid");
+        stream_window = atol(optarg);
+        break;
+      case 's':
+        rng_state = strtoull(optarg, NULL, 10);
+        if (rng_state == 0)
+          errx(EXIT_FAILURE, "Seed invalid (0 is not allowed)");
+        break;
+      case 'v':
+        validation_percent = atof(optarg);
+        if (validation_percent < 0. || validation_percent >= 100.)
+          errx(EXIT_FAILURE, "Validation percentage invalid");
+        break;
+      default:
+        errx(EXIT_FAILURE, "Unknown option, see usage");
+    }
+  }
+  if (argc - optind != 7)
     errx(EXIT_FAILURE,
-         "Usage: %s <hidden_fct> <output_fct> <training_steps> "
-         "<training_dataset_directory> <testing_dataset_directory> <0|1, 0 = "
-         "grayscale, 1 = bw> <lr>"
+         "Usage: %s [-b batch_size] [-c checkpoint] [-e epochs] [-f factor] "
+         "[-j workers] [-k epochs] [-l layers] [-n noise] [-o optimizer] "
+         "[-p patience] [-r angle] [-s seed] [-v percent] [-V] "
+         "[--max-reductions n] [--resume] [--stream shards] [--summary path] "
+         "[--top-k k] <hidden_fct> "
+         "<output_fct> "
+         "<training_steps> <training_dataset_directory> "
+         "<testing_dataset_directory> <0|1, 0 = grayscale, 1 = bw> <lr>"
          "For activation functions:\n"
          "0 = SOFTMAX (not allowed here)\n"
          "1 = SIGMOID\n"
@@ -31,14 +308,54 @@ int main(int argc, char** argv) {
          "3 = ELU\n"
          "4 = LRELU\n"
          "5 = TANH\n"
-         ,
+         "Options:\n"
+         "-b <batch_size>: trains on mini-batches of batch_size samples "
+         "(default: 1, i.e. one update per sample)\n"
+         "-c, --checkpoint <path>: checkpoint file (default: ./ocr.ckpt)\n"
+         "-e <epochs>: validates the network every epochs epochs (default: "
+         "1)\n"
+         "-f <factor>: multiplies the learning rate by factor when the "
+         "validation accuracy plateaus (default: 0.5)\n"
+         "-j <workers>: number of training threads sharing the network "
+         "(default: 1)\n"
+         "-k, --checkpoint-every <epochs>: saves a checkpoint every epochs "
+         "epochs and after the last one, 0 to disable (default: 1)\n"
+         "-l <layers>: comma separated hidden layers, a number being a dense "
+         "layer of that size, cN a 3x3 convolution with N channels and pN a "
+         "N x N max pooling, e.g. 128,64 or c8,p2,c8,p2 (default: 256)\n"
+         "-n <noise>: replaces noise %% of the pixels of the training images "
+         "by light gray at each epoch (default: 0)\n"
+         "-o <optimizer>: sgd, momentum, nesterov or adam (default: sgd), "
+         "adam usually needs a learning rate of about 0.001\n"
+         "-p <patience>: validations without improvement making a plateau "
+         "(default: 3)\n"
+         "-r <angle>: rotates the training images by a random angle in "
+         "[-angle, angle] degrees at each epoch (default: 0)\n"
+         "-s <seed>: seed of the shuffling and augmentation of the samples "
+         "(default: time)\n"
+         "-v <percent>: holds percent %% of the training images out for "
+         "validation, enabling early stopping (default: 0, disabled)\n"
+         "-V, --verbose: prints the outputs of every sample of the last "
+         "epoch and of the testing set, and the confusion matrix\n"
+         "--max-reductions <n>: stops training at the plateau following n "
+         "reductions of the learning rate (default: 3)\n"
+         "--resume: resumes the training saved in the checkpoint file, with "
+         "its network and optimizer, up to training_steps epochs\n"
+         "--stream <shards>: reads the training set by shards of 1024 "
+         "images instead of mapping it, only shards shards being in memory "
+         "and shuffled together (incompatible with -v)\n"
+         "--summary <path>: writes the results on the testing set to path, "
+         "as CSV if it ends with .csv and as JSON otherwise\n"
+         "--top-k <k>: counts a testing sample as a top-k success when its "
+         "letter is one of the k best guesses (default: 3)\n",
          argv[0]);
+  char** args = argv + optind - 1;
 
-  ActivationFunction hidden_fct = (ActivationFunction)atoi(argv[1]);
-  ActivationFunction output_fct = (ActivationFunction)atoi(argv[2]);
-  int training_steps_ = atoi(argv[3]);
-  int is_bw = atoi(argv[6]);
-  double lr = atof(argv[7]);
+  ActivationFunction hidden_fct = (ActivationFunction)atoi(args[1]);
+  ActivationFunction output_fct = (ActivationFunction)atoi(args[2]);
+  int training_steps_ = atoi(args[3]);
+  int is_bw = atoi(args[6]);
+  double lr = atof(args[7]);
 
   if (hidden_fct <= SOFTMAX || hidden_fct > TANH)
     errx(EXIT_FAILURE,
@@ -64,125 +381,183 @@ int main(int argc, char** argv) {
     errx(EXIT_FAILURE, "Training step invalid");
 
   size_t training_steps = training_steps_;
-  char* training_directory = argv[4];
-  char* testing_directory = argv[5];
+  char* training_directory = args[4];
+  char* testing_directory = args[5];
 
   /*printf("hidden_fct = %ld\noutput_fct = %ld\nsteps = %ld\n",
      hidden_fct, output_fct, training_steps);*/
-  Network* network = init_nn(INPUT_LAYER_SIZE, HIDDEN_LAYER_SIZE,
-                             OUTPUT_LAYER_SIZE, hidden_fct, output_fct);
-  NetworkTrainer* trainer = init_nt(network);
-
-  if (trainer == NULL || network == NULL)
-    errx(EXIT_FAILURE, "Error while allocating network and trainer");
-
-  size_t sample_training_size = 0;
-  size_t sample_testing_size = 0;
-
-  char** training_img_path =
-      get_filenames_in_dir(training_directory, &sample_training_size);
-  char** testing_img_path =
-      get_filenames_in_dir(testing_directory, &sample_testing_size);
-
-  double** training_data = calloc(sample_training_size, sizeof(double*));
-  if (training_data == NULL) {
-    errx(EXIT_FAILURE, "Error while allocating memory");
+  for (size_t l = 0; l < nb_hidden_layers; l++)
+    layer_specs[l].activation = hidden_fct;
+  layer_specs[nb_hidden_layers] =
+      (LayerSpec){LAYER_DENSE, OUTPUT_LAYER_SIZE, 0, output_fct};
+  Network* network = NULL;
+  NetworkTrainer** trainers = NULL;
+  size_t first_epoch = 0;
+  PlateauSchedule schedule;
+  init_schedule(&schedule, lr, patience, lr_factor, max_reductions);
+  if (resume) {
+    CheckpointState state;
+    network = load_checkpoint(checkpoint_path, &state, &trainers);
+    if (state.nb_trainers != workers)
+      errx(EXIT_FAILURE, "%s was trained with %ld workers, see -j",
+           checkpoint_path, state.nb_trainers);
+    first_epoch = state.epoch;
+    rng_state = state.seed;
+    schedule.state = state.schedule;
+    printf("Resuming %s after iter %ld\n", checkpoint_path, first_epoch);
+  } else {
+    network = init_nn_spec(1, IMG_H, IMG_W, nb_hidden_layers + 1, layer_specs);
+    if (network == NULL)
+      errx(EXIT_FAILURE, "Error while allocating network");
+    trainers = calloc(workers, sizeof(NetworkTrainer*));
+    if (trainers == NULL)
+      errx(EXIT_FAILURE, "Error while allocating memory");
+    const Optimizer settings = default_optimizer(optimizer);
+    for (size_t w = 0; w < workers; w++) {
+      trainers[w] = init_nt(network);
+      set_optimizer_nt(trainers[w], network, &settings);
+    }
   }
-  double** testing_data = calloc(sample_testing_size, sizeof(double*));
-  if (testing_data == NULL) {
-    errx(EXIT_FAILURE, "Error while allocating memory");
+  printf("%ld weights, %ld multiply-adds per sample\n", nn_nb_weights(network),
+         nn_nb_multiply_adds(network));
+
+  // Images are decoded once to the pack file of each directory. A streamed
+  // training set is read shard by shard, so it can be larger than memory.
+  PackedDataset* training_set = NULL;
+  DatasetStream* training_stream = NULL;
+  const size_t* validation_set = NULL;
+  size_t nb_validation = 0;
+  size_t sample_training_size;
+  if (stream_window > 0) {
+    if (validation_percent > 0.)
+      errx(EXIT_FAILURE, "Validation is not available with --stream");
+    training_stream =
+        open_dataset_stream(training_directory, is_bw, STREAM_SHARD_SIZE);
+    sample_training_size = training_stream->size;
+  } else {
+    training_set = load_dataset(training_directory, is_bw);
+    // Drawn from the seed, so that a resumed training holds the same images
+    // out
+    uint64_t holdout_state = rng_state;
+    nb_validation = training_set->size * validation_percent / 100.;
+    validation_set =
+        holdout_dataset(training_set, nb_validation, &holdout_state);
+    if (nb_validation > 0)
+      printf("Holding %ld training images out for validation\n",
+             nb_validation);
+    sample_training_size = training_set->nb_samples;
   }
+  PackedDataset* testing_set = load_dataset(testing_directory, is_bw);
+  size_t sample_testing_size = testing_set->size;
 
-  double** targeted_data = calloc(sample_training_size, sizeof(double*));
-  if (targeted_data == NULL) {
+  TrainingSlice* slices = calloc(workers, sizeof(TrainingSlice));
+  pthread_t* threads = calloc(workers, sizeof(pthread_t));
+  if (slices == NULL || threads == NULL) {
     errx(EXIT_FAILURE, "Error while allocating memory");
   }
-  for (size_t idx = 0; idx < sample_training_size; idx++) {
-    size_t path_length =
-        strlen(training_directory) + 1 + strlen(training_img_path[idx]) + 1;
+  // The next batches are shuffled, decoded and augmented in the background
+  // while the workers train on the current ones
+  BatchPipeline* pipeline =
+      training_stream != NULL
+          ? init_stream_pipeline(training_stream, stream_window, first_epoch,
+                                 training_steps, batch_size, OUTPUT_LAYER_SIZE,
+                                 workers, &augmentation, rng_state)
+          : init_pipeline(training_set, first_epoch, training_steps,
+                          batch_size, OUTPUT_LAYER_SIZE, workers,
+                          &augmentation, rng_state);
+  for (size_t w = 0; w < workers; w++) {
+    slices[w].network = network;
+    slices[w].trainer = trainers[w];
+    slices[w].pipeline = pipeline;
+    slices[w].queue = w;
+    slices[w].nb_batches = pipeline_nb_batches(pipeline, w);
+    slices[w].max_iter = training_steps * sample_training_size;
+  }
 
-    char* path1 = calloc(path_length, sizeof(char));
+  Checkpointer* checkpointer = init_checkpointer(checkpoint_path);
+  for (size_t i = first_epoch; i < training_steps && !schedule.state.stopped;
+       i++) {
+    printf("Current iter: %ld\n", i);
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
 
-    if (path1 == NULL) {
-      errx(EXIT_FAILURE, "Error while allocating memory");
+    for (size_t w = 0; w < workers; w++) {
+      slices[w].lr = schedule.state.lr;
+      slices[w].verbose = verbose && i == training_steps - 1;
     }
-    snprintf(path1, path_length, "%s/%s", training_directory,
-             training_img_path[idx]);
-
-    SDL_Surface* a = load_image(path1);
-    if (is_bw == 1) {
-      to_bw(a);
+    if (workers == 1) {
+      train_slice(&slices[0]);
     } else {
-      to_gs(a);
+      for (size_t w = 0; w < workers; w++) {
+        if (pthread_create(&threads[w], NULL, train_slice, &slices[w]) != 0)
+          errx(EXIT_FAILURE, "Error while creating training thread");
+      }
+      for (size_t w = 0; w < workers; w++) {
+        pthread_join(threads[w], NULL);
+      }
     }
 
-    training_data[idx] = to_double_array(a);
-    targeted_data[idx] = get_target(training_img_path[idx]);
-    SDL_FreeSurface(a);
-    free(path1);
-  }
-
-  for (size_t j = 0; j < sample_testing_size; j++) {
-    size_t path_length =
-        strlen(testing_directory) + 1 + strlen(testing_img_path[j]) + 1;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double elapsed =
+        (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("Iter %ld: %.3fs, %.0f samples/s (%ld workers)\n", i, elapsed,
+           sample_training_size / elapsed, workers);
 
-    char* path2 = calloc(path_length, sizeof(char));
-    if (path2 == NULL) {
-      errx(EXIT_FAILURE, "Error while allocating memory");
+    if (nb_validation > 0 && (i + 1) % validate_every == 0) {
+      double accuracy = evaluate_accuracy(network, training_set,
+                                          validation_set, nb_validation);
+      ScheduleEvent event = schedule_step(&schedule, accuracy);
+      printf("Validation accuracy: %.3f%% (best: %.3f%%)\n", accuracy * 100.,
+             schedule.state.best * 100.);
+      if (event == SCHEDULE_REDUCED)
+        printf("Plateau, learning rate reduced to %g\n", schedule.state.lr);
+      else if (event == SCHEDULE_STOPPED)
+        printf("Plateau, stopping after iter %ld\n", i);
     }
 
-    snprintf(path2, path_length, "%s/%s", testing_directory,
-             testing_img_path[j]);
-
-    SDL_Surface* a = load_image(path2);
-    if (is_bw == 1) {
-      to_bw(a);
-    } else {
-      to_gs(a);
+    // Written in the background while the next epoch is trained
+    if (checkpoint_every > 0 &&
+        ((i + 1) % checkpoint_every == 0 || i + 1 == training_steps ||
+         schedule.state.stopped)) {
+      const CheckpointState state = {i + 1, rng_state, workers,
+                                     schedule.state};
+      save_checkpoint(checkpointer, network, trainers, &state);
     }
-
-    testing_data[j] = to_double_array(a);
-    SDL_FreeSurface(a);
-    free(path2);
   }
+  free_checkpointer(checkpointer);
 
-  for (size_t i = 0; i < training_steps; i++) {
-    shuffle(training_data, targeted_data, sample_training_size);
-    printf("Current iter: %ld\n", i);
-    // #pragma acc parallel loop
-
-    for (size_t j = 0; j < sample_training_size; j++) {
-      train_nn(trainer, network, training_data[j], targeted_data[j], lr);
-      if (i == training_steps - 1)
-        print_current_iter(network, indexOfMax(targeted_data[j], 26) + 'A', j,
-                           training_steps * sample_training_size);
-    }
+  // The batches of the epochs left are not needed after early stopping
+  stop_pipeline(pipeline);
+  free_pipeline(pipeline);
+  for (size_t w = 0; w < workers; w++) {
+    free_nt(trainers[w]);
   }
+  free(trainers);
+  free(slices);
+  free(threads);
 
   printf("Training done - Testing the results (%ld) (%ld)\n",
          sample_testing_size, sample_training_size);
 
-  print_table(network, &testing_img_path, &testing_data, sample_testing_size);
+  // Per sample outputs are only printed in verbose mode, the terminal being
+  // much slower than the batched evaluation
+  if (verbose)
+    print_dataset_table(network, testing_set);
+  Evaluation* evaluation =
+      evaluate_nn(network, testing_set, NULL, sample_testing_size, top_k);
+  print_evaluation(evaluation, verbose);
+  if (summary_path != NULL)
+    save_evaluation(evaluation, summary_path);
+  free_evaluation(evaluation);
 
-  save_nn_data(network, "./ocr.data");
+  save_nn_binary(network, "./ocr.data");
 
-  for (size_t i = 0; i < sample_training_size; i++) {
-    free(targeted_data[i]);
-    free(training_data[i]);
-    free(training_img_path[i]);
-  }
-  free(targeted_data);
-  free(training_data);
-  free(training_img_path);
-
-  for (size_t i = 0; i < sample_testing_size; i++) {
-    free(testing_data[i]);
-    free(testing_img_path[i]);
-  }
-  free(testing_data);
-  free(testing_img_path);
+  if (training_stream != NULL)
+    close_dataset_stream(training_stream);
+  else
+    free_dataset(training_set);
+  free_dataset(testing_set);
 
-  free_nt(trainer);
   free_nn(network);
   return EXIT_SUCCESS;
 }
\ No newline at end of file